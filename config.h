@@ -4,17 +4,72 @@
 #define _CONFIG_H
 
 #define MANAGER_PORT_NO 9000 // The port we are to listen for the workers
+#define MANAGER_HOST "127.0.0.1" // Where the workers find the manager
+#define SHARED_RING 0 // 1 = workers on the same box as the manager get their messages through a ring in shared memory (see megaring.h), rather than TCP. Any that can't reach it fall back to TCP
+#define SHARED_RING_SIZE (4*1024*1024) // Bytes in each worker's ring. A power of 2
+#define THREAD_RING_SIZE (64*1024) // Bytes in the rings a worker's threads pass clients to each other in (with WORKER_THREADS), thread 0's rings for passing on the manager's messages are SHARED_RING_SIZE. A power of 2
+#define MANAGER_SOCKET_NAME "megacomet-manager" // The abstract unix socket the manager listens on for workers on the same box, in SHARED_RING mode
+#define MANAGER_RETRY_MS 100 // How long a worker that's lost the manager waits before trying it again. It doubles with each failed try
+#define MANAGER_RETRY_MAX_MS 5000 // Up to this
+#define MANAGER_CONNECT_TIMEOUT_MS 1000 // The most a worker's event loop waits on connecting to the manager and its hello
+#define MANAGER_SPOOL_SIZE (4*1024*1024) // Bytes of messages the manager keeps for each worker while it's not connected, to send it when it's back. Past this they're dropped
+#define MANAGER_OUTPUT_HIGH (4*1024*1024) // Bytes waiting for a worker that's not keeping up (its socket or ring is full) before the manager stops reading from the apps, so one slow worker can't make it run out of memory
+#define MANAGER_OUTPUT_LOW (1024*1024) // And it starts reading from them again once every worker's down to this
 #define LISTEN_BACKLOG 1024 // The number of pending connections that can be queued up at any one time 
+#define ACCEPT_BATCH 64 // The most connections a worker accepts each time it's woken, before getting back to its other sockets
+#define DEFER_ACCEPT_SECONDS 5 // Don't wake the worker for a new connection until its request has arrived (TCP_DEFER_ACCEPT), 0 to turn off
+#define CLIENT_RCVBUF 8192 // SO_RCVBUF for client sockets, 0 = kernel default
+#define CLIENT_SNDBUF 16384 // SO_SNDBUF for client sockets, 0 = kernel default
+#define CLIENT_NODELAY 1 // 1 = TCP_NODELAY on client sockets
+#define CLIENT_USER_TIMEOUT_MS (WRITE_TIMEOUT_SECONDS*1000) // TCP_USER_TIMEOUT for client sockets, 0 = kernel default
+#define CLIENT_KEEPALIVE_SECONDS 0 // TCP keepalive idle time for client sockets, 0 = off
+#define CLIENT_QUICKACK 0 // 1 = TCP_QUICKACK a request whose client is going to wait
+#define CLIENT_RESET_DROPPED 0 // 1 = reset (SO_LINGER 0) client connections we drop, rather than close them
 #define WORKERS 8 // The number of workers
+#define WORKER_THREADS 1 // Event loop threads in each worker (or set MEGACOMET_THREADS), not with SHARED_PORT
 #define MAX_MANAGER_CONNS 16 // We need to cater for N connections. Usually 8 workers + 1 (or more) app connections
 #define MAX_CLIENT_ID_LEN 128 // Length of the client id's
+#define CHANNEL_SEPARATOR '~' // Separates the channels a client's listening to from its id, and each other, in its poll URL: /clientId~chat~news.js
 #define MAX_MESSAGE_LEN 1024 // Length of the message
+#define MAX_CONNECTIONS (1024*1024) // Size of each worker's connection table. It can't use more fds than its open files limit either, so raise that to match
+#define EVENT_BATCH 256 // The most client sockets a worker deals with per wakeup, before getting back to its other sockets
+#define IO_URING 0 // 1 = workers drive their client sockets through io_uring (see megauring.h) rather than epoll, if the kernel can (6.0 or later), otherwise they use epoll anyway. Set MEGACOMET_IO=io_uring or epoll to choose when they start
+#define URING_ENTRIES 4096 // Operations a worker can queue on its ring between submits (its completion queue is 4 times that). Queueing more submits what's there first
+#define URING_BUFFERS 1024 // Receive buffers (of BUFFER_SIZE) in each worker's ring, for the kernel to read into. A power of 2. A worker only has as many in use as it's got reads to deal with at once
 #define BUFFER_SIZE 2048 // Size of the chunks we read incoming commands in. Should be big enough for a full command
+#define PROTOCOL_VERSION 2 // The newest manager protocol to speak (see megawire.h): 1 = the original null terminated commands, 2 = length prefixed frames, batched. The manager and each worker use the older of their two, so upgrade the manager first
+#define WIRE_BATCH_SIZE (64*1024) // The most messages the manager packs into one frame (and one write) to a worker
+#define MANAGER_BUFFER_SIZE (WIRE_BATCH_SIZE + MAX_CLIENT_ID_LEN + MAX_MESSAGE_LEN + 64) // What the manager and workers receive each other's frames into. Has to hold the biggest one
 
 #define COMET_BASE_PORT_NO 8000 // Which port range are we listening on for clients
-#define HTTP_TEMPLATE "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s" // The http response
-#define HTTP_OVERHEAD 80 // The size of the above line, plus a few bytes
-#define HTTP_RESPONSE_SIZE (MAX_MESSAGE_LEN + HTTP_OVERHEAD) // Size of the http response buffer
+#define SHARED_PORT 0 // 1 = all the workers listen on COMET_BASE_PORT_NO (SO_REUSEPORT) and pass each client to the worker that owns its id. 0 = worker N listens on COMET_BASE_PORT_NO+N
+#define HANDOFF_SOCKET_NAME "megacomet-%d" // The abstract unix socket each worker is handed its clients on, in SHARED_PORT mode
+#define HTTP_HEADER_START "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: " // The http response, up to the message length, when it's the last on the connection
+#define HTTP_KEEP_ALIVE_START "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-Length: " // The same, when the connection stays open for the client's next poll
+#define HTTP_HEADER_END "\r\n\r\n" // The end of the headers after the length, then comes the message
+#define HTTP_LENGTH_SIZE (12 + sizeof(HTTP_HEADER_END)) // Room for the length and the above
+#define BATCH_SINGLE 0 // Values for BATCH_MODE
+#define BATCH_JSON 1
+#define BATCH_LINES 2
+#define BATCH_MODE BATCH_SINGLE // BATCH_SINGLE, BATCH_JSON or BATCH_LINES, see readme
+#define MAX_BATCH_MESSAGES 100 // The most messages in one response (BATCH_JSON or BATCH_LINES), the rest wait for the next poll
+#define MAX_BATCH_LEN (8*MAX_MESSAGE_LEN) // The most body in one response (BATCH_JSON or BATCH_LINES). It always takes at least one message though
+#define LINGER_MS 0 // When a message arrives for a waiting client, wait this long for more before responding, so a burst goes in one response. 0 = respond straight away
+#define OUTPUT_BUFFER_SIZE ((BATCH_MODE == BATCH_SINGLE ? MAX_MESSAGE_LEN : MAX_BATCH_LEN) + 128) // The most of a response that can wait for a slow client, so a whole one
+#define MAX_WORKER_OUTPUT (64*1024*1024) // The most a worker holds in output buffers for slow clients. Past this they get dropped
+#define HEADER_TIMEOUT_SECONDS 10 // How long a new connection has to send its request before it's dropped
+#define LONG_POLL_TIMEOUT_SECONDS 50 // How long a client waits for a message before getting an empty response
+#define WHEEL_TICK_MS 100 // Resolution of the timeouts
+#define TIMEOUT_BUDGET 2000 // The most timeouts (and expired messages) to deal with per tick, so a burst of them doesn't stall the worker
+#define KEEP_ALIVE_REQUESTS 100 // The most requests a client can make on one connection, the response to the last one closes it. 1 = close after every response
+#define KEEP_ALIVE_SECONDS 30 // How long a kept-alive connection can sit idle before its next request
+#define WRITE_TIMEOUT_SECONDS 30 // How long a slow client gets to take the rest of its response
+#define QUEUE_TTL_SECONDS 60 // How long a message waits in the queue for its client to connect before it's thrown away
+#define STATS_PATH "_stats" // GET /_stats on a worker's port is its stats, in the Prometheus text format (so no client id can start with this). /_statsN is worker N's, when they share a port
+
+#define LOG_LEVEL 3 // The most detailed log messages compiled in: 1 = errors, 2 = warnings, 3 = info, 4 = debug (eg every message). Set MEGACOMET_LOG to log less at run time
+#define LOG_RATE_LIMIT 10 // The most log messages each line of code can put out per second, the rest are counted and dropped
+#define LOG_RING_SIZE 4096 // Log messages waiting to be written, per thread. A power of 2
 
 #define DAEMON_LOOP_SECONDS 10 // How many seconds between attempts to check and restart dead processes
 #define MANAGER_START_DELAY 5 // How many seconds after the manager starts to try starting the workers
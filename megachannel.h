@@ -0,0 +1,100 @@
+// MegaComet channels
+// As well as their own messages, clients can listen to channels, by naming them in their poll after their client id:
+// GET /myClientId~chat~news.js
+// While the poll's waiting, its connection is subscribed to each of them. The worker tells the manager which channels
+// it has listeners for, and the manager sends it one copy of each message on them, which goes to every subscriber.
+// Channels are kept in a client index (megaindex.h) of their own, by name. A channel's entry has its subscribers where
+// a client's has its queue: 'messages' is the first subscription, and 'fd' is how many there are.
+// Each subscription is a slab slot (megaslab.h) in two lists: its channel's subscribers (doubly linked, so one can
+// leave from the middle), and its connection's channels (singly linked, as they all go at once).
+
+#ifndef _MEGACHANNEL_H
+#define _MEGACHANNEL_H
+
+#include <string.h>
+#include "megaslab.h"
+#include "megaindex.h"
+
+typedef struct subscription {
+	unsigned int channel; // The channel's interned name
+	int fd; // The waiting connection
+	unsigned int prev, next; // The channel's other subscribers, 0 = none
+	unsigned int nextOfConn; // The connection's next channel, 0 = none
+} subscription; // 20 bytes, so a 32 byte slot
+
+typedef struct channelIndex {
+	clientIndex names; // The channels by name
+	slabStore ids; // The interned names
+	slabStore subs; // The subscriptions
+} channelIndex;
+
+static inline void channelInit(channelIndex *ci) {
+	memset(ci, 0, sizeof(channelIndex));
+	indexInit(&ci->names, &ci->ids);
+}
+
+static inline subscription *channelSub(channelIndex *ci, unsigned int handle) {
+	return (subscription*)slabPtr(&ci->subs, handle);
+}
+
+// A channel's entry, or NULL if nobody here has listened to it
+static inline indexEntry *channelFind(channelIndex *ci, const char *name, int len) {
+	return indexFind(&ci->names, name, len, indexHash(name, len));
+}
+
+// Subscribe a connection to a channel, adding it to the connection's list (*conn). Returns 1 if it's a channel we
+// didn't have, so the manager needs telling
+static inline int channelSubscribe(channelIndex *ci, const char *name, int len, int fd, unsigned int *conn) {
+	indexEntry *e = indexAdd(&ci->names, name, len, indexHash(name, len));
+	int isNew = e->fd < 0;
+	if (isNew) {
+		e->fd = 0;
+	}
+	for (unsigned int s = *conn; s; s = channelSub(ci, s)->nextOfConn) {
+		if (channelSub(ci, s)->channel == e->id) {
+			return isNew; // Already on it (they named it twice)
+		}
+	}
+	unsigned int handle = slabAlloc(&ci->subs, sizeof(subscription));
+	subscription *sub = channelSub(ci, handle);
+	sub->channel = e->id;
+	sub->fd = fd;
+	sub->prev = 0;
+	sub->next = e->messages;
+	if (e->messages) {
+		channelSub(ci, e->messages)->prev = handle;
+	}
+	e->messages = handle;
+	e->fd++;
+	sub->nextOfConn = *conn;
+	*conn = handle;
+	return isNew;
+}
+
+// Take a connection off all its channels. A channel that's left with nobody stays in the index (so someone polling
+// again straight after doesn't have to tell the manager again) until a message comes for it, see channelDrop
+static inline void channelLeaveAll(channelIndex *ci, unsigned int *conn) {
+	for (unsigned int s = *conn, next; s; s = next) {
+		subscription *sub = channelSub(ci, s);
+		next = sub->nextOfConn;
+		indexEntry *e = indexFindId(&ci->names, sub->channel);
+		if (sub->prev) {
+			channelSub(ci, sub->prev)->next = sub->next;
+		} else {
+			e->messages = sub->next;
+		}
+		if (sub->next) {
+			channelSub(ci, sub->next)->prev = sub->prev;
+		}
+		e->fd--;
+		slabFree(&ci->subs, s);
+	}
+	*conn = 0;
+}
+
+// Forget a channel that has no subscribers
+static inline void channelDrop(channelIndex *ci, indexEntry *e) {
+	indexDel(&ci->names, e);
+}
+
+#endif
@@ -9,23 +9,107 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <linux/filter.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <ev.h>
 #include "khash.h"
 #include "klist.h"
 #include "config.h"
+#include "megaparse.h"
+#include "megawheel.h"
+#include "megaslab.h"
+#include "megaindex.h"
+#include "megachannel.h"
+#include "megalog.h"
+#include "megastats.h"
+#include "megawire.h"
+#include "megaring.h"
+#include "megauring.h"
 
 // Useful utilities
 typedef unsigned char byte;
 
 // Globals
+// With WORKER_THREADS, each thread has its own listener and clients, and everything to do with them is __thread, so
+// nothing the threads touch per client or message is shared. Thread 0 has the manager connection as well, and the
+// rest is set up before the other threads start
 int workerNo; // Which worker number this is 
-int cometSd, managerSd; // The listening socket file descriptor
-struct ev_loop *libEvLoop; // The main libev loop. Global so that we don't have to pass it around everywhere, slowly pushing and popping it to the stack
-struct ev_io cometPortWatcher; // The watcher for incoming comet conns
+__thread int cometSd; // The listening socket file descriptor
+int managerSd; // The connection to the manager
+int handoffSd; // The unix socket other workers hand us clients on (SHARED_PORT mode only)
+__thread struct ev_loop *libEvLoop; // The thread's libev loop. Global so that we don't have to pass it around everywhere, slowly pushing and popping it to the stack
+__thread struct ev_io cometPortWatcher; // The watcher for incoming comet conns
 struct ev_io managerPortWatcher; // The watcher for incoming manager commands
+struct ev_io ringWatcher; // The watcher for the manager saying there's something in the ring (SHARED_RING mode)
+struct ev_timer managerRetryWatcher; // Goes off when it's time to try the manager again, after losing it
+struct ev_io handoffWatcher; // The watcher for clients handed to us by other workers
+__thread struct ev_io threadWatcher; // The watcher for the other threads putting something in our rings
+__thread struct ev_io clientsWatcher; // The watcher for the epoll set of client sockets
+__thread struct ev_timer wheelWatcher; // Ticks the timing wheel
+__thread struct ev_timer lingerWatcher; // Goes off when the first lingering connection is due
+__thread struct ev_check loopStartWatcher; // For timing each go round the event loop: it starts when the wait's over
+__thread struct ev_prepare loopEndWatcher; // And ends when it's about to wait again
+__thread struct ev_io uringWatcher; // The watcher for completions on the client ring (IO_URING mode)
+__thread struct ev_prepare uringSubmitWatcher; // Submits what's been queued on it in each go round the loop, just before the wait
+__thread uring clientRing; // The io_uring the client sockets are driven through (see megauring.h)
+__thread int usingUring; // If they are, or they're in the epoll set
+__thread timingWheel wheel; // Deadlines for every connection: reading the request, and then waiting for a message
+__thread wheelTimer *deadlines; // The wheel's timers, one per fd
+// The event loop's time in wheel ticks. It's more than 32 bits' worth, so it goes through 64 bits to wrap (which the
+// wheel doesn't mind), as a double that's out of range for an unsigned int is undefined, and ARM saturates it
+#define wheelTicks(loop) ((unsigned int)(unsigned long long)(ev_now(loop) * 1000 / WHEEL_TICK_MS))
+
+// The worker's event loop threads (WORKER_THREADS). A client belongs to one of them, by the hash of their id, like
+// they belong to a worker. Each thread has a ring (see megaring.h) from each of the others, which thread 0 passes on
+// the manager's messages in, and they all pass each other the clients that connect to the wrong one. A ring only has
+// the one writer and the one reader, so none of it needs a lock. All a thread's rings wake it through the one eventfd
+// Thread 0 never waits on a ring: what won't fit goes in the thread's backlog, till the thread's made room for it
+typedef struct workerThread {
+	pthread_t thread;
+	int wakeFd; // The dataEvent of all the rings to it
+	byte *backlog; // Frames from thread 0 that its ring wouldn't take yet. Malloc'd when first needed
+	int backlogLen, backlogSize;
+	struct ev_io backlogWatcher; // Thread 0's, waiting on the ring's spaceEvent while there's a backlog
+} workerThread;
+workerThread *threads;
+int threadCount = 1;
+__thread int threadNo; // Which one this is
+sharedRing *threadRings; // threadCount*threadCount of them, from each thread to each other thread
+#define threadRing(from, to) (&threadRings[(from)*threadCount + (to)])
+#define ownerThread(hash) (threadCount > 1 ? (hash) / WORKERS % threadCount : 0) // Which thread a client belongs to. The manager's used hash % WORKERS for the worker
+#define THREAD_CLIENT 100 // The frame type (in the wire format) of a client passed between threads. The id is their full
+// id, channels and all, and the payload is the fd and their request count. The others are WIRE_MESSAGE and WIRE_CHANNEL
+unsigned long threadMessages; // Messages thread 0 has passed to the thread their client belongs to
+int managerPaused; // Thread 0's stopped reading from the manager, as a thread's more than a ring's worth behind
+// Which threads are listening to each channel. The manager's told about a channel when the first thread has listeners,
+// and when the last stops, by thread 0 (it's the one with the manager connection) from channelTells. Changes to
+// subscriptions are rare, so these are locked
+KHASH_MAP_INIT_STR(threadChannels, int);
+khash_t(threadChannels) *threadChannels; // How many threads have listeners for each channel
+byte *channelTells; // Subscribe and unsubscribe frames waiting for thread 0 to send them
+int channelTellsLen, channelTellsSize;
+pthread_mutex_t channelLock = PTHREAD_MUTEX_INITIALIZER;
 
 // Stuff for the manager connection
+int managerVersion; // The protocol version we agreed with the manager
+byte managerBuffer[MANAGER_BUFFER_SIZE]; // What's been received from the manager. In version 2, anything left after parsing is the start of a frame
+int managerBuffered; // How much of that is waiting for the rest of its frame
+sharedRing managerRing; // Where the manager puts our messages, if we're on the same box in SHARED_RING mode
+int usingRing; // If we are
+int managerRetryMs = MANAGER_RETRY_MS; // How long till the next try, if we've lost it
+// For version 1, which is parsed a byte at a time
 byte commandClientId[MAX_CLIENT_ID_LEN+1];
 int commandClientIdLen;
 byte commandMessage[MAX_MESSAGE_LEN+1];
@@ -34,46 +118,272 @@ int commandStatus=0; // 0 = nothing, waiting
 // 200=read a '2', reading the client id
 // 201=read the client, reading the message
 
-// For creating the http response message
-char httpResponse[HTTP_RESPONSE_SIZE];
-
-// For the status of each connection, we have the below struct, which extends the io watcher
-typedef struct clientStatus {
-	ev_io io; // The IO watcher. This is first so that when the callback is called, we can cast it to a clientStatus.
-	int readStatus; // 0=nothing, waiting for '/'
-		// First line: 10=found '/', reading client id
-		// 20=found '.', reading the rest of the first line
-		// First line: 100=found '\r', 200=found '\n' 
-		// Reading headers: 200, 300=found '\r', 400='\n', 500=2nd '\r', 1000=found 2nd '\n'
-		// Ready to respond: 1000
-	int clientIdLen; // Length of the client id
-	char clientId[MAX_CLIENT_ID_LEN+1]; // Eg will be 'myClientId' for: GET /myClientId.js?c=cachekiller HTTP/1.1
-} clientStatus;
-
-// The memory pool of client statuses
+// For creating the http response message. The headers are the same apart from the Content-Length, so that part
+// is prebuilt for every possible message length, and a response is a writev of the start, the length, and the message
+char httpLengths[MAX_MESSAGE_LEN+1][HTTP_LENGTH_SIZE]; // Eg "123\r\n\r\n"
+int httpLengthsLen[MAX_MESSAGE_LEN+1];
+
+// The state of each connection lives in the connection table, which is indexed by fd. It's set up for every fd we could
+// be given at startup, and since the kernel always hands out the lowest free fd it's only ever backed by memory as far
+// as the busiest we've been. Everything else a connection needs is kept elsewhere, so a waiting connection costs its
+// 16 bytes here, its 12 byte timer in the wheel, and its client's entry in the client index (plus the interned id)
+// With WORKER_THREADS, each thread has its own table and wheel, indexed by the same fds. So no two threads ever write
+// to the same cache line, but each table's backed by memory as far as the whole worker's busiest
+typedef struct connection {
+	unsigned short readStatus; // Where the request parser is up to, see megaparse.h. PARSE_DONE (1000) means ready to respond
+	unsigned short requests; // How many requests it's made, for KEEP_ALIVE_REQUESTS. Set to that to close after this response
+	unsigned char events; // What it's in the clients epoll set for (EPOLLIN, or EPOLLOUT when SENDING), 0 = not in it
+	// With io_uring it's what it has on the go in the ring: EPOLLIN if its recv is, and EPOLLOUT (and maybe a CLOSE_ bit) if a send is
+	unsigned char clientIdLen; // Length of the client id
+	unsigned short generation; // Goes up each time the fd's closed (io_uring only), so completions for whoever had it before can be told apart
+	unsigned int clientId; // Handle of the client id in clientIds, eg 'myClientId' for: GET /myClientId.js?c=cachekiller HTTP/1.1
+	// While the request is coming in (and only if it's split over reads) that's the connection's own copy. Once it's
+	// waiting (PARSE_DONE) it's the interned id of its entry in the client index. Once it's SENDING there isn't one
+	unsigned int channels; // Its first channel subscription while it's waiting (see megachannel.h), 0 = none
+} connection;
+#define LINGERING 1001 // readStatus of a waiting connection that has had a message, and is waiting LINGER_MS for more
+#define SENDING 2000 // readStatus once we're responding: not waiting for messages any more. Once the response is sent it's
+// closed, or if it's being kept alive it goes back to PARSE_START for the next request
+#define CLOSE_LINKED 0x40 // events bit (io_uring only): the close is queued to go straight after the send
+#define CLOSING 0x80 // events bit (io_uring only): we've given up on it, and it's closed when the send comes back
+#if MAX_CLIENT_ID_LEN > 255
+#error "The connection table only has a byte for the client id length"
+#endif
+#if KEEP_ALIVE_REQUESTS > 65535
+#error "The connection table only has 16 bits for the request count"
+#endif
+__thread connection *conns; // The connection table
+int maxConns; // How many fds it has room for
+__thread int clientsSd; // The epoll set of all the client sockets we're waiting on. libev watches the set as a whole, so it doesn't keep any per connection state itself
+__thread slabStore clientIds; // Where the client ids are
+
+// What a completion on the client ring is for, from the bottom 2 bits of its user_data. A send's is its output buffer,
+// which is aligned so they're 0. The others have the fd above them, and its generation above that
+#define OP_SEND 0
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_CLOSE 3 // Closes and cancels, which only complete if they fail
+#define uringData(op, fd) ((op) | (unsigned long long)(fd) << 2 | (unsigned long long)conns[fd].generation << 34)
+
+// Responses that didn't fit in a client's socket buffer wait in one of these until it drains. Few connections ever
+// need one, so they're found by fd in the outputs hash rather than taking room in the connection table
+// With io_uring every response goes in one, as the kernel sends it from there after we've moved on, so they're only
+// held for as long as that takes
 #define __nop_free(x)
-KMEMPOOL_INIT(csPool, clientStatus, __nop_free); // Set up the macros for the client status memory pool
-kmempool_t(csPool) *csPool; // The memory pool
+typedef struct outputBuffer {
+	int len; // How much is in it
+	int sent; // How much of that has gone
+	unsigned int shared; // A channel message that goes after it, which it has a reference to rather than a copy, 0 = none
+	int sharedSent; // How much of that has gone
+	int fd; // Whose it is, and for io_uring, the sendmsg it's going in
+	struct msghdr msg;
+	struct iovec iov[2];
+	char data[OUTPUT_BUFFER_SIZE];
+} outputBuffer;
+KMEMPOOL_INIT(outPool, outputBuffer, __nop_free);
+__thread kmempool_t(outPool) *outPool;
+KHASH_MAP_INIT_INT(outputs, outputBuffer*);
+__thread khash_t(outputs) *outputs;
+__thread unsigned long outputBytes; // How much is waiting in output buffers across all the connections, capped at MAX_WORKER_OUTPUT
+__thread unsigned long partialWrites; // Responses (or the rest of them) that the client only took some of
+__thread unsigned long writeStalls; // Times a client's socket buffer was full when we went to write
+__thread unsigned long outputDrops; // Clients dropped because their response wouldn't fit in an output buffer
+__thread unsigned long clientSyscalls; // Syscalls made on the client sockets (not counting libev's wait, or io_uring_enter), to compare the two ways of driving them
+
+// Stats (see megastats.h), served at GET /_stats. The queue and output ones are above
+__thread unsigned long acceptedConns; // Connections accepted
+__thread unsigned long requestsParsed; // Polls received
+__thread unsigned long parseErrors; // Requests we couldn't make sense of
+__thread unsigned long parkedPolls; // Polls that waited for a message
+__thread unsigned long waitingNow; // Connections waiting for a message right now
+__thread unsigned long deliveredMessages, deliveredBytes; // Messages sent to clients
+__thread unsigned long emptyResponses; // Polls answered with nothing (timed out, or replaced by a newer one)
+__thread unsigned long managerMessages, channelMessages; // Messages from the manager
+__thread unsigned long handoffs; // Clients passed to the worker that owns them (SHARED_PORT mode)
+unsigned long managerReconnects; // Times we've got the manager back after losing it
+__thread statsHistogram queueWait; // How long queued messages waited for their client
+__thread statsHistogram loopTime; // How long each go round the event loop takes, not counting the wait
+__thread double loopStart;
+
+// Every client we know about, with the connection waiting for them and/or the messages queued for them (see megaindex.h)
+__thread clientIndex clients;
+
+// The channels our waiting connections are listening to
+__thread channelIndex channels;
+__thread int *fanout; // The subscribers a channel message is going to. They're collected first, as sending changes the lists
+__thread int fanoutSize;
+
+// A channel message's response body, in the messages slab. It's written to each subscriber from here, and one whose
+// socket doesn't take it all keeps a reference rather than a copy
+typedef struct sharedPayload {
+	int refs;
+	int len;
+	char data[];
+} sharedPayload;
+#define payload(handle) ((sharedPayload*)slabPtr(&messages, handle))
 
-// The hash of client id's to client statuses
-KHASH_MAP_INIT_STR(clientStatuses, clientStatus*); // Creates the macros for dealing with this hash
-khash_t(clientStatuses) *clientStatuses; // The hash table
+// The messages waiting to be collected live in the messages slab, so queueing and delivering them doesn't malloc or
+// free once the slab has grown to fit. Each client's messages are a circular list, which their index entry points into.
+// Each queued message is also on the expiry list, which has every queued message oldest first. So clearing out the
+// ones older than QUEUE_TTL_SECONDS only ever looks at messages that are being thrown away
+// The links are slab handles, with 0 for none
+typedef struct queuedMessage {
+	unsigned int next; // The next newest message for the same client (or the oldest, for the newest one)
+	unsigned int older, newer; // Neighbours in the expiry list
+	unsigned int clientId; // The client it's queued for, their interned id
+	unsigned int queuedAt; // When it was queued, in milliseconds of the event loop's time (see nowMs)
+	int len; // Length of the message
+	char message[]; // The message, null terminated
+} queuedMessage;
+__thread slabStore messages;
+#if MAX_MESSAGE_LEN + 32 > (1 << (SLAB_MIN_BITS + SLAB_CLASSES - 1))
+#error "MAX_MESSAGE_LEN is too big for the slab's biggest slots"
+#endif
+#define queued(handle) ((queuedMessage*)slabPtr(&messages, handle)) // Get a queued message from its handle
+__thread unsigned int oldestMessage, newestMessage; // Ends of the expiry list
+// The event loop's time in milliseconds. It wraps after 49 days, which the subtractions don't mind, but it has to go
+// through 64 bits to wrap, as converting an out of range double straight to unsigned int is undefined (ARM saturates)
+#define nowMs() ((unsigned int)(unsigned long long)(ev_now(libEvLoop) * 1000))
+__thread unsigned long queuedMessages, queuedBytes; // How much is sitting in the queue
+__thread unsigned long expiredMessages, expiredBytes; // How much has been thrown away for being too old
+#if BATCH_MODE != BATCH_SINGLE && MAX_BATCH_LEN < MAX_MESSAGE_LEN + 2
+#error "MAX_BATCH_LEN has to fit the longest message, and the brackets"
+#endif
+#if 2*MAX_BATCH_MESSAGES + 4 > 1024
+#error "MAX_BATCH_MESSAGES is more than a writev can take"
+#endif
 
-// The queue of messages waiting to be collected
-// TODO every few minutes, iterate through this list to clear old ones out
-// This is a hash from client id to list
-KLIST_INIT(messages, char*, __nop_free); // The message list for a single client type
-KHASH_MAP_INIT_STR(queue, klist_t(messages)*); // The queue hash table type
-khash_t(queue) *queue; // The queue hash table
+// Connections that are lingering for more messages, in the order they started. They all linger for LINGER_MS, so
+// that's also the order they're due in, and the one timer only needs to go off for whoever's at the front.
+// A connection that closes while lingering stays in here until it's due, and is skipped then
+typedef struct lingerer {
+	int fd;
+	ev_tstamp due;
+} lingerer;
+__thread lingerer *lingering; // A ring, lingerSize long (a power of 2). Grows when it's full
+__thread unsigned int lingerHead, lingerCount, lingerSize;
 
 void newConnectionCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
-void readCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void clientsCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void writeResponse(int fd);
+int readRequest(int fd);
+int requestArrived(int fd, const byte *buffer, int read);
+int receivedHeaders(int fd, const char *clientId, int clientIdLen);
+int passClient(int fd, int owner, const char *clientId, int len);
+void sendEmptyResponse(int fd);
+void queueMessage(indexEntry *entry, const char *message, int len);
+void tellManager(int type, const char *channel, int len);
+void tellManagerNow(int type, const char *channel, int len);
+void watchClient(int fd, int events);
 void managerCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void ringCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void managerRetryCallback(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+void handoffCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void wheelCallback(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+void lingerCallback(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+void uringCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void uringSubmitCallback(struct ev_loop *loop, struct ev_prepare *watcher, int revents);
+void uringAccepted(int res, unsigned int flags);
+void uringReceived(struct io_uring_cqe *cqe);
+void uringSendOutput(int fd, outputBuffer *output);
+void uringSent(outputBuffer *output, int res);
+void uringCloseClient(int fd);
+void expireQueue();
+void passMessage(int to, int type, const char *id, int idLen, const char *message, int len);
+void threadChannel(int type, const char *channel, int len);
+void threadCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void backlogCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+
+// Attach the classic BPF program that picks which worker gets each new connection in SHARED_PORT mode
+// The kernel runs it on the SYN, so the request is only there if the client used TCP fast open. If it is, this
+// does the same X31 hash of the client id as the manager. If not, it returns an out of range index, which makes the
+// kernel fall back to its usual 4-tuple hash. The index is the order the workers joined the port in, so it's only
+// a guess at the right worker: receivedHeaders hands off any client that it gets wrong
+void attachSteeringProgram(void) {
+	static struct sock_filter code[7 + 13*MAX_CLIENT_ID_LEN + 4];
+	int n = 0;
+	int fallback = sizeof(code)/sizeof(code[0]) - 1;
+	int done = fallback - 3;
+
+	// Is it a "GET /"?
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_IMM, 0); // The hash is kept in M[0]
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0); // Length of the data in the SYN
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, 5, 0, 2);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 4);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, '/', 1, 0);
+	code[n] = (struct sock_filter)BPF_STMT(BPF_JMP|BPF_JA, fallback - (n+1)); n++;
+
+	// Hash each byte of the client id. Conditional jumps only reach 255 instructions, so each byte
+	// ends with its own 'ja done' for them to jump to
+	for (int i=0; i<MAX_CLIENT_ID_LEN; i++) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0);
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JGT|BPF_K, 5+i, 0, 10); // Out of data
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 5+i);
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, '.', 8, 0); // End of the client id
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ' ', 7, 0);
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, CHANNEL_SEPARATOR, 6, 0); // Channels come after it
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC|BPF_TAX, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_MEM, 0); // hash = hash*31 + byte
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, 31);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_ADD|BPF_X, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_JMP|BPF_JA, 1); // On to the next byte
+		code[n] = (struct sock_filter)BPF_STMT(BPF_JMP|BPF_JA, done - (n+1)); n++;
+	}
+
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_MEM, 0); // done: worker = hash % WORKERS
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, WORKERS);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_A, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff); // fallback: let the kernel choose
+
+	struct sock_fprog prog = { .len = n, .filter = code };
+	if (setsockopt(cometSd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+		perror("setsockopt SO_ATTACH_REUSEPORT_CBPF"); // Not fatal, the kernel's own hash works fine
+	}
+}
+
+// Set the client connections' socket options (CLIENT_* in config.h). They're set on the listening socket, and each
+// connection it accepts starts with a copy of them, so there's nothing to do per connection. The buffer sizes have to
+// be set before the handshake anyway, as the window scale is agreed then
+void setClientOptions(int sd) {
+	int rcvbuf = CLIENT_RCVBUF, sndbuf = CLIENT_SNDBUF, nodelay = CLIENT_NODELAY, userTimeout = CLIENT_USER_TIMEOUT_MS;
+	int keepIdle = CLIENT_KEEPALIVE_SECONDS, keepInterval = keepIdle/3 > 0 ? keepIdle/3 : 1, keepCount = 3, on = 1;
+	if (rcvbuf && setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) == -1) {
+		perror("setsockopt SO_RCVBUF");
+	}
+	if (sndbuf && setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) == -1) {
+		perror("setsockopt SO_SNDBUF");
+	}
+	if (nodelay && setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int)) == -1) {
+		perror("setsockopt TCP_NODELAY");
+	}
+	if (userTimeout && setsockopt(sd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(int)) == -1) {
+		perror("setsockopt TCP_USER_TIMEOUT");
+	}
+	if (keepIdle && (setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(int)) == -1
+			|| setsockopt(sd, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int)) == -1
+			|| setsockopt(sd, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int)) == -1
+			|| setsockopt(sd, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int)) == -1)) {
+		perror("setsockopt keepalive");
+	}
+}
+
+// We're giving up on a client: with CLIENT_RESET_DROPPED, make closing it send a reset, so the kernel lets go of it
+// (and whatever's still to send) straight away. Never for a connection that's just had its response, which this
+// would throw away
+void resetOnClose(int fd) {
+	if (CLIENT_RESET_DROPPED) {
+		struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+		clientSyscalls++;
+	}
+}
 
 // Open the listening socket for incoming comet connections
 void openCometSocket(void) {
-	// Open the socket file descriptor
-	cometSd = socket(PF_INET, SOCK_STREAM, 0);
+	// Open the socket file descriptor. Non-blocking so the accept loop can run until the backlog is empty
+	cometSd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (cometSd < 0) {
 		perror("comet socket error");
 		exit(1);
@@ -87,11 +397,35 @@ void openCometSocket(void) {
 	    exit(1);
 	}
 
+	// In shared port mode, all the workers listen on the one port and the kernel shares the connections out
+	if (SHARED_PORT) {
+		if (setsockopt(cometSd, SOL_SOCKET, SO_REUSEPORT, &tr, sizeof(int)) == -1) {
+			perror("setsockopt SO_REUSEPORT");
+			exit(1);
+		}
+		int fastOpenQueue = LISTEN_BACKLOG; // So clients can put the request in the SYN, for the steering program to see
+		setsockopt(cometSd, IPPROTO_TCP, TCP_FASTOPEN, &fastOpenQueue, sizeof(int));
+	}
+
+	// With threads, each has its own listener on the worker's port, and the kernel shares the connections out between them
+	if (threadCount > 1 && setsockopt(cometSd, SOL_SOCKET, SO_REUSEPORT, &tr, sizeof(int)) == -1) {
+		perror("setsockopt SO_REUSEPORT");
+		exit(1);
+	}
+
+	// Have the kernel hold on to new connections until their request arrives, so the first read
+	// straight after accepting them nearly always has the whole thing
+	int deferSeconds = DEFER_ACCEPT_SECONDS;
+	if (deferSeconds && setsockopt(cometSd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSeconds, sizeof(int)) == -1) {
+		perror("setsockopt TCP_DEFER_ACCEPT");
+	}
+	setClientOptions(cometSd);
+
 	// Bind the socket to the address
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(COMET_BASE_PORT_NO+workerNo);
+	addr.sin_port = htons(SHARED_PORT ? COMET_BASE_PORT_NO : COMET_BASE_PORT_NO+workerNo);
 	addr.sin_addr.s_addr = INADDR_ANY;
 	int bindResult = bind(cometSd, (struct sockaddr*) &addr, sizeof(addr));
 	if (bindResult < 0) {
@@ -106,54 +440,283 @@ void openCometSocket(void) {
 		exit(1);
 	}
 
+	if (SHARED_PORT) {
+		attachSteeringProgram();
+	}
+
 	// puts("Socket opened");
 }
 
-// Open the connection to the manager
-void openManagerSocket(void) {
-	// Open the socket file descriptor
-	managerSd = socket(PF_INET, SOCK_STREAM, 0);
-	if (managerSd < 0) {
-		perror("manager socket error");
+// Fill in the (abstract namespace) address of a worker's handoff socket, returns the length of it
+socklen_t handoffAddress(int worker, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	int len = snprintf(addr->sun_path+1, sizeof(addr->sun_path)-1, HANDOFF_SOCKET_NAME, worker); // Leading null = abstract
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// Open the socket that other workers hand us our clients on, for SHARED_PORT mode
+void openHandoffSocket(void) {
+	handoffSd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (handoffSd < 0) {
+		perror("handoff socket error");
 		exit(1);
 	}
 
-	// Build the address of the manager
-	struct sockaddr_in addr;
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(MANAGER_PORT_NO);
-	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
-
-	// Connect to the manager
-	// puts ("Connecting to manager...");
-	int connectResult = connect(managerSd, (struct sockaddr*) &addr, sizeof addr);
-	if (connectResult < 0) {
-		perror("Could not connect to manager. Start the manager first!");
+	struct sockaddr_un addr;
+	socklen_t addrLen = handoffAddress(workerNo, &addr);
+	if (bind(handoffSd, (struct sockaddr*) &addr, addrLen) < 0) {
+		perror("handoff bind error (is this worker already running?)");
 		exit(1);
 	}
+}
+
+// A socket for talking to the manager. Connecting and the hello are blocking, but only for so long, as the clients
+// are waiting, whichever way we reach it
+int managerSocket(int domain) {
+	int sd = socket(domain, SOCK_STREAM, 0);
+	if (sd >= 0) {
+		struct timeval timeout = { MANAGER_CONNECT_TIMEOUT_MS / 1000, MANAGER_CONNECT_TIMEOUT_MS % 1000 * 1000 };
+		setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	}
+	return sd;
+}
+
+// Open the connection to the manager. Returns 0 if we couldn't, and we'll try again later
+int connectToManager(void) {
+	// In SHARED_RING mode, try the manager's unix socket first, as that means it's on this box and can give us a ring
+	managerSd = -1;
+	if (SHARED_RING && PROTOCOL_VERSION >= 2) {
+		struct sockaddr_un addr;
+		socklen_t addrLen = ringSocketAddress(&addr);
+		managerSd = managerSocket(AF_UNIX);
+		if (managerSd >= 0 && connect(managerSd, (struct sockaddr*) &addr, addrLen) < 0) {
+			logInfo("No shared ring, the manager's not on this box, so using TCP");
+			close(managerSd);
+			managerSd = -1;
+		}
+	}
+
+	if (managerSd < 0) {
+		// Open the socket file descriptor
+		managerSd = managerSocket(PF_INET);
+		if (managerSd < 0) {
+			logError("manager socket error: %s", strerror(errno));
+			return 0;
+		}
+
+		// Build the address of the manager
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(MANAGER_PORT_NO);
+		inet_pton(AF_INET, MANAGER_HOST, &addr.sin_addr.s_addr);
+
+		// Connect to the manager
+		if (connect(managerSd, (struct sockaddr*) &addr, sizeof addr) < 0) {
+			logWarn("Could not connect to the manager: %s", strerror(errno));
+			close(managerSd);
+			managerSd = -1;
+			return 0;
+		}
+	}
+
+	// Now tell the manager which worker i am, and which protocol we'll be talking
+	if (PROTOCOL_VERSION < 2) { // The original hello, which a manager that doesn't know about versions understands
+		byte msg[2] = { WIRE_LEGACY_HELLO, workerNo };
+		if (write(managerSd, msg, 2) != 2) {
+			logError("Couldn't send the manager our hello: %s", strerror(errno));
+			close(managerSd);
+			managerSd = -1;
+			return 0;
+		}
+		managerVersion = 1;
+	} else {
+		byte msg[3] = { WIRE_HELLO, PROTOCOL_VERSION, workerNo };
+		byte reply[2];
+		if (write(managerSd, msg, 3) != 3) {
+			logError("Couldn't send the manager our hello: %s", strerror(errno));
+			close(managerSd);
+			managerSd = -1;
+			return 0;
+		}
+
+		// The answer comes with the ring's memfd and eventfds if the manager made us one
+		struct iovec iov = { .iov_base = reply, .iov_len = 2 };
+		char control[CMSG_SPACE(3*sizeof(int))];
+		struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+		if (recvmsg(managerSd, &hdr, MSG_WAITALL) != 2 || reply[0] != WIRE_HELLO || reply[1] < 1) {
+			logError("The manager didn't answer our hello, is it an old one?");
+			close(managerSd);
+			managerSd = -1;
+			return 0;
+		}
+		managerVersion = reply[1] < PROTOCOL_VERSION ? reply[1] : PROTOCOL_VERSION;
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(3*sizeof(int))) {
+			int fds[3];
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+			usingRing = ringAttach(&managerRing, fds[0], fds[1], fds[2]);
+			if (!usingRing) {
+				logError("Couldn't map the manager's ring");
+				close(managerSd); // It'll be putting our messages in it regardless, so start again
+				managerSd = -1;
+				return 0;
+			}
+		}
+	}
+	struct timeval never = { 0, 0 };
+	setsockopt(managerSd, SOL_SOCKET, SO_SNDTIMEO, &never, sizeof(never));
+	setsockopt(managerSd, SOL_SOCKET, SO_RCVTIMEO, &never, sizeof(never));
+	logInfo("Talking to the manager in protocol version %d%s", managerVersion, usingRing ? ", through a shared ring" : "");
+	return 1;
+}
+
+// Tell the manager about every channel we've got listeners for, as it's only just met us. Ones nobody's listening
+// to any more are dropped instead. With threads, it's every channel that any of them have listeners for, and the
+// subscriptions waiting to be sent are all in that already
+void resubscribe() {
+	if (threadCount > 1) {
+		pthread_mutex_lock(&channelLock);
+		channelTellsLen = 0;
+		for (khiter_t k = kh_begin(threadChannels); k != kh_end(threadChannels); k++) {
+			if (kh_exist(threadChannels, k)) {
+				tellManagerNow(WIRE_SUBSCRIBE, kh_key(threadChannels, k), strlen(kh_key(threadChannels, k)));
+			}
+		}
+		pthread_mutex_unlock(&channelLock);
+		return;
+	}
+	clientIndex *names = &channels.names;
+	for (unsigned int i=0; i<names->groups*INDEX_GROUP; i++) {
+		if (names->ctrl[i] < 0) {
+			continue; // Empty or deleted
+		}
+		indexEntry *e = &names->entries[i];
+		if (e->fd) {
+			tellManager(WIRE_SUBSCRIBE, indexKey(names, e), indexKeyLen(names, e));
+		} else {
+			channelDrop(&channels, e);
+		}
+	}
+}
+
+// Start listening to the manager, now we're connected
+void managerConnected() {
+	managerRetryMs = MANAGER_RETRY_MS;
+	ev_io_init(&managerPortWatcher, managerCallback, managerSd, EV_READ);
+	if (usingRing) { // The socket's still watched, to find out if the manager goes
+		ev_io_init(&ringWatcher, ringCallback, managerRing.dataEvent, EV_READ);
+	}
+	if (!managerPaused) {
+		ev_io_start(libEvLoop, &managerPortWatcher);
+		if (usingRing) {
+			ev_io_start(libEvLoop, &ringWatcher);
+		}
+	}
+	resubscribe();
+}
+
+// Try the manager again after a while. The wait doubles each time, and is jittered so the workers don't all come at once
+void retryManagerLater() {
+	ev_timer_set(&managerRetryWatcher, managerRetryMs * (0.5 + drand48() / 2) / 1000, 0.);
+	ev_timer_start(libEvLoop, &managerRetryWatcher);
+	managerRetryMs = managerRetryMs * 2 < MANAGER_RETRY_MAX_MS ? managerRetryMs * 2 : MANAGER_RETRY_MAX_MS;
+}
+
+// We've lost the manager (or it sent us something we can't make sense of). Our clients stay connected, with their
+// queues, and we keep trying to get it back. The manager keeps their messages for us meanwhile
+void managerLost() {
+	ev_io_stop(libEvLoop, &managerPortWatcher);
+	if (usingRing) {
+		ev_io_stop(libEvLoop, &ringWatcher);
+		ringClose(&managerRing);
+		usingRing = 0;
+	}
+	close(managerSd);
+	managerSd = -1;
+	managerBuffered = 0; // Half a frame's no good to us now
+	commandStatus = 0;
+	retryManagerLater();
+}
+
+void managerRetryCallback(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+	if (!connectToManager()) {
+		retryManagerLater();
+		return;
+	}
+	logInfo("Reconnected to the manager");
+	managerReconnects++;
+	managerConnected();
+}
 
-	// Now tell the manager which worker i am
-	byte msg[2];
-	msg[0]=1;
-	msg[1]=workerNo;
-	write(managerSd, msg, 2);
+// Time each go round the event loop, from when the wait's over to when it's about to wait again
+void loopStartCallback(struct ev_loop *loop, struct ev_check *watcher, int revents) {
+	loopStart = statsNowUs();
+}
 
-	// puts("Manager connected");
+void loopEndCallback(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+	if (loopStart) {
+		statsRecord(&loopTime, statsNowUs() - loopStart);
+	}
 }
 
-// The main libev loop
+// The thread's libev loop
 void run() {
-	// use the default event loop unless you have special needs
-	libEvLoop = ev_default_loop(0);
+	// use the default event loop unless you have special needs, which the threads after the first do
+	libEvLoop = threadNo ? ev_loop_new(EVFLAG_AUTO) : ev_default_loop(0);
 
-	// The watcher for incoming comet connections
-	ev_io_init(&cometPortWatcher, newConnectionCallback, cometSd, EV_READ);
-	ev_io_start(libEvLoop, &cometPortWatcher);
+	// The watcher for incoming comet connections, or with io_uring, the one multishot accept for them all and the
+	// watcher for the ring
+	if (usingUring) {
+		uringAccept(&clientRing, cometSd, SOCK_NONBLOCK, OP_ACCEPT);
+		ev_io_init(&uringWatcher, uringCallback, clientRing.fd, EV_READ);
+		ev_io_start(libEvLoop, &uringWatcher);
+		ev_prepare_init(&uringSubmitWatcher, uringSubmitCallback);
+		ev_prepare_start(libEvLoop, &uringSubmitWatcher);
+	} else {
+		ev_io_init(&cometPortWatcher, newConnectionCallback, cometSd, EV_READ);
+		ev_io_start(libEvLoop, &cometPortWatcher);
+	}
 
-	// The watcher for manager commands on the already-open socket
-	ev_io_init(&managerPortWatcher, managerCallback, managerSd, EV_READ);
-	ev_io_start(libEvLoop, &managerPortWatcher);
+	// The watcher for manager commands on the already-open socket, or keep trying if it wasn't there. That's thread 0
+	if (threadNo == 0) {
+		ev_init(&managerRetryWatcher, managerRetryCallback);
+		if (managerSd >= 0) {
+			managerConnected();
+		} else {
+			retryManagerLater();
+		}
+	}
+
+	// The watcher for the other threads' rings to us
+	if (threadCount > 1) {
+		ev_io_init(&threadWatcher, threadCallback, threads[threadNo].wakeFd, EV_READ);
+		ev_io_start(libEvLoop, &threadWatcher);
+	}
+
+	// The watcher for clients other workers pass to us
+	if (SHARED_PORT) {
+		ev_io_init(&handoffWatcher, handoffCallback, handoffSd, EV_READ);
+		ev_io_start(libEvLoop, &handoffWatcher);
+	}
+
+	// The watcher for all the client sockets, via the epoll set
+	if (!usingUring) {
+		ev_io_init(&clientsWatcher, clientsCallback, clientsSd, EV_READ);
+		ev_io_start(libEvLoop, &clientsWatcher);
+	}
+
+	// The one timer that looks after all the connections' timeouts
+	wheelInit(&wheel, deadlines, wheelTicks(libEvLoop));
+	ev_timer_init(&wheelWatcher, wheelCallback, WHEEL_TICK_MS / 1000., WHEEL_TICK_MS / 1000.);
+	ev_timer_start(libEvLoop, &wheelWatcher);
+	ev_init(&lingerWatcher, lingerCallback); // Started when someone lingers
+	ev_check_init(&loopStartWatcher, loopStartCallback);
+	ev_check_start(libEvLoop, &loopStartWatcher);
+	ev_prepare_init(&loopEndWatcher, loopEndCallback);
+	ev_prepare_start(libEvLoop, &loopEndWatcher);
 
 	// puts("Ready");
 
@@ -161,27 +724,164 @@ void run() {
 	ev_loop(libEvLoop, 0);
 }
 
+// Build the Content-Length part of the response headers for each message length
+void initResponses() {
+	for (int len=0; len<=MAX_MESSAGE_LEN; len++) {
+		httpLengthsLen[len] = snprintf(httpLengths[len], HTTP_LENGTH_SIZE, "%d" HTTP_HEADER_END, len);
+	}
+}
+
+// Set up the connection table and the wheel's timers with room for every fd we can have open, and the epoll set
+void initConnections() {
+	// Reserved now, but only given memory as the pages get used
+	conns = mmap(NULL, (size_t)maxConns * sizeof(connection), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	deadlines = mmap(NULL, (size_t)(WHEEL_HEADS + maxConns) * sizeof(wheelTimer), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (conns == MAP_FAILED || deadlines == MAP_FAILED) {
+		perror("connection table mmap");
+		exit(1);
+	}
+	clientsSd = epoll_create1(0);
+	if (clientsSd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+}
+
+// Use io_uring for the client sockets if we've been asked to (IO_URING, or MEGACOMET_IO=io_uring or epoll to choose at
+// run time) and the kernel can, otherwise they go in the epoll set
+void initClientIo() {
+	const char *io = getenv("MEGACOMET_IO");
+	if (io ? strcmp(io, "io_uring") : !IO_URING) {
+		return;
+	}
+	usingUring = uringInit(&clientRing, URING_ENTRIES, URING_BUFFERS, BUFFER_SIZE);
+	if (usingUring) {
+		logInfo("Driving the client sockets through io_uring");
+	} else {
+		logWarn("This kernel can't do what we need from io_uring (it needs 6.0), so using epoll");
+	}
+}
+
 // Initialise the hash tables that are needed
 void initHashes() {
-	csPool = kmp_init(csPool);
-	clientStatuses = kh_init(clientStatuses); // Malloc the hash
-	queue = kh_init(queue);
+	outPool = kmp_init(outPool);
+	outputs = kh_init(outputs);
+	indexInit(&clients, &clientIds);
+	channelInit(&channels);
+	fanoutSize = 1024;
+	fanout = malloc(fanoutSize * sizeof(int));
+	lingerSize = 64;
+	lingering = malloc(lingerSize * sizeof(lingerer));
 }
 
-// All the setup stuff goes here
-void setup() {
+// Work out how many threads to run (WORKER_THREADS, or MEGACOMET_THREADS to choose at run time), and make their rings
+void initThreads() {
+	const char *env = getenv("MEGACOMET_THREADS");
+	threadCount = env ? atoi(env) : WORKER_THREADS;
+	if (threadCount < 1) {
+		threadCount = 1;
+	}
+	if (threadCount > 1 && SHARED_PORT) {
+		logWarn("SHARED_PORT shares the clients out between the workers rather than threads, so using the one thread");
+		threadCount = 1;
+	}
+	threads = calloc(threadCount, sizeof(workerThread));
+	if (threadCount == 1) {
+		return;
+	}
+	threadChannels = kh_init(threadChannels);
+	threadRings = calloc(threadCount * threadCount, sizeof(sharedRing));
+	for (int to=0; to<threadCount; to++) {
+		threads[to].wakeFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		for (int from=0; from<threadCount; from++) {
+			sharedRing *ring = threadRing(from, to);
+			if (from == to) {
+				continue;
+			}
+			if (threads[to].wakeFd < 0 || !ringCreate(ring, from ? THREAD_RING_SIZE : SHARED_RING_SIZE, -1)) {
+				perror("thread ring");
+				exit(1);
+			}
+			close(ring->dataEvent); // They all wake the thread through the one
+			ring->dataEvent = threads[to].wakeFd;
+		}
+	}
+	logInfo("Running %d threads", threadCount);
+}
+
+// Keep the thread on a core of its own, carrying on round the cores from the worker before
+void pinThread() {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET((workerNo * threadCount + threadNo) % (cores > 0 ? cores : 1), &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+		logWarn("Couldn't pin thread %d to a core: %s", threadNo, strerror(errno));
+	}
+}
+
+// The setup each thread does for itself: its own connections and clients, and its own listener
+void setupThread() {
+	if (threadCount > 1) {
+		pinThread();
+	}
+	initConnections();
+	initClientIo();
 	initHashes();
 	openCometSocket();
-	openManagerSocket();
+}
+
+// All the setup stuff goes here. This thread is thread 0, which sets up the rest of the threads' too when it's started them
+void setup() {
+	static char logName[16];
+	snprintf(logName, sizeof(logName), "worker %d", workerNo);
+	logInit(logName);
+	signal(SIGPIPE, SIG_IGN); // Writing to a client that's just gone should be an error, not kill the worker
+	srand48(getpid()); // For the jitter on retrying the manager, which should differ between the workers
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	maxConns = limit.rlim_cur < MAX_CONNECTIONS ? limit.rlim_cur : MAX_CONNECTIONS;
+	initResponses();
+	initThreads();
+	if (SHARED_PORT) {
+		openHandoffSocket(); // Before joining the port, so a second copy of this worker bails out first
+	}
+	setupThread();
+	if (!connectToManager()) {
+		logWarn("The manager isn't there yet, we'll keep trying");
+	}
+}
+
+// Where the threads after the first start
+void *threadMain(void *arg) {
+	threadNo = (long)arg;
+	setupThread();
+	run();
+	return NULL;
+}
+
+void startThreads() {
+	for (long t=1; t<threadCount; t++) {
+		if (pthread_create(&threads[t].thread, NULL, threadMain, (void*)t)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
 }
 
 // All the shutdown stuff goes here. Is it really worth bothering to clean up memory just prior to exit?
 void shutDown() {
 	close(cometSd);
-	close(managerSd);
-	kmp_destroy(csPool, csPool); // Free the pooled client statuses
-	kh_destroy(clientStatuses, clientStatuses); // Free it all
-	kh_destroy(queue, queue); // Todo: this probably wont destroy the lists in each queue hash value
+	if (managerSd >= 0) {
+		close(managerSd);
+	}
+	close(clientsSd);
+	if (usingUring) {
+		close(clientRing.fd);
+	}
+	kmp_destroy(outPool, outPool);
+	kh_destroy(outputs, outputs);
+	// Todo: free the client index and the slabs
 	// Todo clean up the libev stuff
 }
 
@@ -196,332 +896,1513 @@ int main(int argc, char **args) {
 	workerNo = atoi(args[1]);
 	
 	setup();
+	startThreads();
 	run();
 	shutDown();
 	return 0;
 }
 
+// Start a new connection off in the connection table. The generation carries on from whoever had the fd before
+void resetConnection(int fd) {
+	unsigned short generation = conns[fd].generation;
+	memset(&conns[fd], 0, sizeof(connection));
+	conns[fd].generation = generation;
+}
+
 // Accept client requests
+// This takes up to ACCEPT_BATCH connections off the backlog each time libev wakes us, and tries reading each
+// one's request straight away. Thanks to TCP_DEFER_ACCEPT it's usually already there, so only the connections
+// that have to wait for a message need to go in the epoll set at all
 void newConnectionCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 	if (EV_ERROR & revents) {
-		puts("got invalid event");
+		logError("got invalid event");
 		return;
 	}
 
-	// Accept client request
-	struct sockaddr_in clientAddr;
-	socklen_t clientAddrLen = sizeof(clientAddr);
-	int clientSd = accept(watcher->fd, (struct sockaddr *)&clientAddr, &clientAddrLen);
-
-	if (clientSd < 0) {
-		puts("accept error");
-		return;
-	}
+	for (int accepted=0; accepted<ACCEPT_BATCH; accepted++) {
+		// Accept client request
+		struct sockaddr_in clientAddr;
+		socklen_t clientAddrLen = sizeof(clientAddr);
+		int clientSd = accept4(watcher->fd, (struct sockaddr *)&clientAddr, &clientAddrLen, SOCK_NONBLOCK);
+		clientSyscalls++;
 
-	// Create a client status by getting it from the memory pool
-	clientStatus *newStatus = kmp_alloc(csPool, csPool);
-	memset(newStatus, 0, sizeof(clientStatus));
+		if (clientSd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+				logError("accept error");
+			}
+			return; // The backlog is empty (or we're out of fds), wait for the next wakeup
+		}
+		if (clientSd >= maxConns) { // Past the end of the connection table
+			close(clientSd);
+			continue;
+		}
 
-	// Initialize and start watcher to read client requests
-	ev_io_init(&newStatus->io, readCallback, clientSd, EV_READ);
-	ev_io_start(loop, &newStatus->io);
-}
+		// Start them off in the connection table
+		acceptedConns++;
+		resetConnection(clientSd);
+		wheelAdd(&wheel, clientSd, wheel.now + HEADER_TIMEOUT_SECONDS*1000/WHEEL_TICK_MS); // Drop them if they're too slow sending the request
 
-// Close a connection and free the memory associated and skip removing from hash, only for use when a connection
-// arrives and already was a message waiting for it
-void closeConnectionSkipHash(ev_io *watcher) {
-	ev_io_stop(libEvLoop, watcher); // Tell libev to stop following it
-	close(watcher->fd); // Close the socket
-	kmp_free(csPool, csPool, (clientStatus*)watcher); // Free the clientstatus/watcher (this is last because the fd is used above, after ev_io_stop)
+		// Try to get the request now, and only watch the socket if it's still open afterwards
+		if (readRequest(clientSd)) {
+			watchClient(clientSd, EPOLLIN);
+		}
+	}
 }
 
-// Close a connection and free the memory associated and remove from hash
-void closeConnection(ev_io *watcher) {
-	ev_io_stop(libEvLoop, watcher); // Tell libev to stop following it
-	close(watcher->fd); // Close the socket
-
-	// Remove the client status from the hash if it's a waiting connection
-	if (((clientStatus*)watcher)->readStatus==1000) { // Only ones waiting a message (1000) are in the hash
-		khiter_t k = kh_get(clientStatuses, clientStatuses, ((clientStatus*)watcher)->clientId); // Find it in the hash
-		if (k != kh_end(clientStatuses)) { // Was it in the hash?
-			kh_del(clientStatuses, clientStatuses, k); // Remove it from the hash
+// Put a client's socket in the epoll set, or change what it's in there for
+// With io_uring, reading is a multishot recv, which is queued if it isn't already, and writes don't need watching
+void watchClient(int fd, int events) {
+	connection *thisClient = &conns[fd];
+	if (usingUring) {
+		if (events == EPOLLIN && !(thisClient->events & EPOLLIN)) {
+			uringRecv(&clientRing, fd, uringData(OP_RECV, fd));
+			thisClient->events |= EPOLLIN;
 		}
+		return;
 	}
-
-	kmp_free(csPool, csPool, (clientStatus*)watcher); // Free the clientstatus/watcher (this is last because the fd is used above, after ev_io_stop)
+	if (thisClient->events == events) {
+		return;
+	}
+	struct epoll_event event = { .events = events, .data.fd = fd };
+	epoll_ctl(clientsSd, thisClient->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+	clientSyscalls++;
+	thisClient->events = events;
 }
 
-// Called when the manager sends a complete message
-void messageArrivedFromManager() {
-	printf ("Message arrived: >%s< for >%s<\r\n", commandMessage, commandClientId);
-
-	// See if the client is connected, if so immediately forward
-	khiter_t k = kh_get(clientStatuses, clientStatuses, (char*)commandClientId); // Find it in the hash
-	if (k != kh_end(clientStatuses)) { // Was it in the hash?
-		clientStatus* status = kh_value(clientStatuses, k); // Grab the clientStatus from the hash
-		snprintf(httpResponse, HTTP_RESPONSE_SIZE, HTTP_TEMPLATE, commandMessageLen, commandMessage); // Compose the response message
-		write(status->io.fd, httpResponse, strlen(httpResponse)); // Send it
-		closeConnection((ev_io*)status); // Close the conn
+// Some client sockets are ready: libev has told us the epoll set is readable, so see which ones
+void clientsCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	if (EV_ERROR & revents) {
+		logError("got invalid event");
 		return;
 	}
 
-	// If not, add to a queue
-	khiter_t q = kh_get(queue, queue, (char*)commandClientId); // See if this client is already in the queue
-	if (q == kh_end(queue)) {
-		printf("Creating queue for %s\r\n", commandClientId);
-		// This client needs to be added to the queue
-		// First make a new list
-		klist_t(messages) *newMessageList = kl_init(messages);
-		*kl_pushp(messages, newMessageList) = strdup((char*)commandMessage); // Add the message to the list
-		// Now make a new hash entry pointing to this new list
-		int ret;
-		q = kh_put(queue, queue, strdup((char*)commandClientId), &ret);
-		kh_value(queue, q) = newMessageList;
-	} else {
-		printf("Adding to the queue for %s\r\n", commandClientId);
-		// This client is in the queue already eg it has a hash entry
-		// Pushp puts this message at the end of the queue, so that shift will grab the oldest first (like a FIFO)
-		*kl_pushp(messages, kh_value(queue, q)) = strdup((char*)commandMessage);
+	struct epoll_event events[EVENT_BATCH];
+	int ready = epoll_wait(clientsSd, events, EVENT_BATCH, 0);
+	clientSyscalls++;
+	for (int i=0; i<ready; i++) {
+		int fd = events[i].data.fd;
+		if (!conns[fd].events) {
+			continue; // Closed while dealing with an earlier one
+		}
+		if (conns[fd].readStatus == SENDING) {
+			writeResponse(fd);
+		} else {
+			readRequest(fd);
+		}
 	}
+}
 
-	// Now do a printout of the hash list
-	for (khiter_t qi = kh_begin(queue); qi < kh_end(queue); qi++) {
-		if (kh_exist(queue, qi)) {
-			printf("Queue for %s\n", kh_key(queue,qi));
-			klist_t(messages) *list = kh_value(queue, qi);
-			kliter_t(messages) *li;
-			for (li = kl_begin(list); li != kl_end(list); li = kl_next(li))
-				printf("%s\n", kl_val(li));
-			printf("----\n");
-		}
+// Let go of a channel message's body, freeing it if that was the last reference
+void releasePayload(unsigned int handle) {
+	if (--payload(handle)->refs == 0) {
+		slabFree(&messages, handle);
 	}
 }
 
-// This gets called when there's an incoming command from the manager
-void managerCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-	byte buffer[BUFFER_SIZE];
-	size_t read;
+// Free a slow client's output buffer
+void freeOutput(int fd) {
+	khiter_t k = kh_get(outputs, outputs, fd);
+	outputBytes -= kh_value(outputs, k)->len;
+	if (kh_value(outputs, k)->shared) {
+		releasePayload(kh_value(outputs, k)->shared);
+	}
+	kmp_free(outPool, outPool, kh_value(outputs, k));
+	kh_del(outputs, outputs, k);
+}
 
-	if (EV_ERROR & revents) {
-		puts ("got invalid event");
+// Close a connection and free the memory associated and skip removing from hash, only for use when a connection
+// isn't in the hash (eg it arrived and already was a message waiting for it)
+void closeConnectionSkipHash(int fd) {
+	connection *thisClient = &conns[fd];
+	wheelDel(&wheel, fd); // Stop the timeout
+	if (thisClient->clientId) {
+		slabFree(&clientIds, thisClient->clientId);
+	}
+	thisClient->clientId = 0;
+	if (usingUring) {
+		uringCloseClient(fd);
 		return;
 	}
+	if (thisClient->readStatus == SENDING && thisClient->events == EPOLLOUT) { // Throw away anything that didn't get sent
+		freeOutput(fd);
+	}
+	thisClient->events = 0;
+	close(fd); // Close the socket, which also takes it out of the epoll set
+	clientSyscalls++;
+}
 
-	// Receive message from client socket
-	read = recv(managerSd, buffer, BUFFER_SIZE, 0);
-	
-	if (read < 0) {
-		puts ("manager read error");
-		// TODO reconnect to the manager?
-		// Or should i exit, and let a monitoring script look after re-launching?
-		return;
+// A waiting connection has stopped waiting: take it out of its client's index entry, and the entry out of the index
+// if there's nothing queued for them either
+void unpark(indexEntry *entry) {
+	connection *thisClient = &conns[entry->fd];
+	if (thisClient->channels) {
+		channelLeaveAll(&channels, &thisClient->channels);
 	}
-	if (read == 0) {
-		puts ("manager connection closing");
-		// TODO reconnect to the manager?
-		// Or should i exit, and let a monitoring script look after re-launching?
-		// I'm thinking i should exit because the manager has probably died
-		exit(1);
-		return;
+	waitingNow--;
+	thisClient->readStatus = SENDING;
+	thisClient->clientId = 0; // It was the entry's
+	entry->fd = -1;
+	if (!entry->messages) {
+		indexDel(&clients, entry);
 	}
-	// Go through the bytes read and parse what the client is sending us
-	for (int i=0; i<read; i++) {
-		if (commandStatus==0) {
-			if (buffer[i]==2) { // Start of the mgr sending a message
-				commandStatus = 200;
-				commandClientIdLen = 0;
-				commandMessageLen = 0;
-				continue;				
-			}
-		}
-		if (commandStatus==200) { // We are waiting for the mgr to send a client id
-			if (buffer[i]==0) {
-				commandClientId[commandClientIdLen] = 0; // Add the null terminator
-				commandStatus=201; // Now wait for the message	
-				continue;
-			} else {
-				if (commandClientIdLen < MAX_CLIENT_ID_LEN) {
-					commandClientId[commandClientIdLen] = buffer[i];
-					commandClientIdLen ++;
-					continue;
-				} else {
-					// Buffer overrun on the client id, so put the error
-					puts("Buffer overrun on the client id from the mgr");
-					commandStatus=0;
-					continue;
-				}
-			}
-		}
-		if (commandStatus==201) { // We are waiting for the app sending a message
-			if (buffer[i]==0) {
-				commandMessage[commandMessageLen] = 0; // Add the null terminator
-				messageArrivedFromManager(); // Send the message to the correct client
-				commandStatus=0; // Now wait for the next command	
-				continue;
-			} else {
-				if (commandMessageLen < MAX_MESSAGE_LEN) {
-					commandMessage[commandMessageLen] = buffer[i];
-					commandMessageLen ++;
-					continue;
-				} else {
-					// Buffer overrun on the message, so put the error and kill this connection todo
-					puts("Buffer overrun on the message from the mgr");
-					commandStatus=0;
-					continue;
-				}
+}
+
+// Is the connection waiting for messages (and so in the index)?
+int isWaiting(int fd) {
+	return conns[fd].readStatus == PARSE_DONE || conns[fd].readStatus == LINGERING;
+}
+
+// Take the client out of the index if it's a waiting connection
+void forgetClient(int fd) {
+	if (isWaiting(fd)) { // Only ones waiting a message are in the index
+		indexEntry *entry = indexFindId(&clients, conns[fd].clientId);
+		if (entry->fd == fd) { // Was it still the one waiting (and not replaced by a newer poll)?
+			unpark(entry);
+		} else {
+			waitingNow--;
+			if (conns[fd].channels) {
+				channelLeaveAll(&channels, &conns[fd].channels);
 			}
 		}
-		// If it got to the end of the loop here, then the manager has sent a malformed message so lets reset the parser
-		commandStatus = 0;
-	} // end of the for loop
+		conns[fd].clientId = 0;
+	}
 }
 
-// This is called when the headers are received so we can look for a message waiting for
-// this person, or leave them connected until one comes, or time them out after 50s maybe?
-void receivedHeaders(clientStatus *thisClient) {
-	// printf ("Connected by >%s<\r\n", thisClient->clientId);
-
-	// Check to see if there's a message queued for this person
-	// if so, send it and drop the connection
-	khiter_t q = kh_get(queue, queue, (char*)thisClient->clientId);
-	if (q != kh_end(queue)) {
-		char *queuedMessage;
-		kl_shift(messages, kh_value(queue,q), &queuedMessage);
-		// Now send the message to the person and close
-		snprintf(httpResponse, HTTP_RESPONSE_SIZE, HTTP_TEMPLATE, (int)strlen(queuedMessage), queuedMessage); // Compose the response message
-		free(queuedMessage);
-		write(thisClient->io.fd, httpResponse, strlen(httpResponse)); // Send it
-		closeConnectionSkipHash((ev_io*)thisClient);
-		// If that was the last one, free the list and remove it from the hash
-		if (!kh_value(queue, q)->head->next) {
-			kl_destroy(messages, kh_value(queue, q)); // Free the list
-			free((void*)kh_key(queue, q)); // Free the key (the client id)
-			kh_del(queue, queue, q); // Remove this client id from the hash
-		}
+// Close a connection and free the memory associated and remove from hash
+void closeConnection(int fd) {
+	forgetClient(fd);
+	closeConnectionSkipHash(fd);
+}
+
+// Will the connection stay open after this response?
+int keepAlive(int fd) {
+	return conns[fd].requests < KEEP_ALIVE_REQUESTS;
+}
+
+// The start of the response headers, which say whether the connection stays open
+void responseStart(int fd, struct iovec *iov) {
+	if (keepAlive(fd)) {
+		iov->iov_base = HTTP_KEEP_ALIVE_START;
+		iov->iov_len = sizeof(HTTP_KEEP_ALIVE_START)-1;
 	} else {
-		// If there's no message, then add their client id to the hash for later
-		int ret;
-		khiter_t k = kh_put(clientStatuses, clientStatuses, thisClient->clientId, &ret);
-		kh_value(clientStatuses, k) = thisClient;
+		iov->iov_base = HTTP_HEADER_START;
+		iov->iov_len = sizeof(HTTP_HEADER_START)-1;
 	}
-
 }
 
-/* Read client message */
-void readCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-	if (EV_ERROR & revents) {
-		puts ("got invalid event");
+// The response has all gone. Close the connection, or if it's being kept alive, wait for their next request
+void finishResponse(int fd) {
+	connection *thisClient = &conns[fd];
+	if (!keepAlive(fd)) {
+		closeConnectionSkipHash(fd);
 		return;
 	}
+	if (thisClient->events == EPOLLOUT) {
+		freeOutput(fd);
+	}
+	thisClient->readStatus = PARSE_START;
+	thisClient->clientIdLen = 0;
+	wheelAdd(&wheel, fd, wheel.now + KEEP_ALIVE_SECONDS*1000/WHEEL_TICK_MS); // Drop them if they don't come back
+	watchClient(fd, EPOLLIN);
+}
 
-	struct clientStatus *thisClient = (clientStatus*)watcher;
+// Send a response, then close the connection (or keep it for the next request)
+// The sockets are non-blocking, so a slow client may only take part of it. The rest goes in an output buffer and the
+// connection stays open (no longer waiting for messages) until the socket drains, or WRITE_TIMEOUT_SECONDS passes
+// If 'shared' is set, the last of the iovecs is that channel message's body, and a slow client keeps a reference to it
+// With io_uring it all goes in an output buffer for the kernel to send, unless it won't fit (only a stats page's that
+// big), in which case as much as the socket takes is written first, as it is with epoll
+void sendAndFinish(int fd, struct iovec *iov, int iovcnt, unsigned int shared) {
+	forgetClient(fd);
+	conns[fd].readStatus = SENDING;
 
-	// Receive message from client socket
-	byte buffer[BUFFER_SIZE];
-	size_t read;
-	read = recv(watcher->fd, buffer, BUFFER_SIZE, 0);
-	
-	if (read < 0) {
-		puts ("read error");
-		// TODO shut down this connection
-		return;
+	ssize_t sent = 0;
+	int total = 0;
+	for (int i=0; i<iovcnt; i++) {
+		total += iov[i].iov_len;
 	}
-	if (read == 0) {
-		// Stop and free watcher if client socket is closing
-		closeConnection(watcher); // TODO is the socket close in this function necessary since the other side closed it anyway?
-		// puts("peer closing");
+	if (!usingUring || total - (shared ? iov[iovcnt-1].iov_len : 0) > OUTPUT_BUFFER_SIZE) {
+		sent = writev(fd, iov, iovcnt);
+		clientSyscalls++;
+		if (sent == total) {
+			finishResponse(fd); // The usual case
+			return;
+		}
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				closeConnectionSkipHash(fd); // They've gone
+				return;
+			}
+			sent = 0;
+			writeStalls++;
+		} else {
+			partialWrites++;
+		}
+	}
+
+	// Keep what's left for when they're ready, as long as it fits and we're not holding too much already
+	int left = total - sent, sharedLeft = 0, sharedLen = 0;
+	if (shared) { // The channel message isn't copied, just whatever's left of the headers
+		sharedLen = iov[--iovcnt].iov_len;
+		sharedLeft = left < sharedLen ? left : sharedLen;
+		left -= sharedLeft;
+	}
+	if (left > OUTPUT_BUFFER_SIZE || outputBytes + left > MAX_WORKER_OUTPUT) {
+		outputDrops++;
+		resetOnClose(fd);
+		closeConnectionSkipHash(fd);
+		return;
+	}
+	outputBuffer *output = kmp_alloc(outPool, outPool);
+	output->len = 0;
+	output->sent = 0;
+	output->shared = 0;
+	if (sharedLeft) {
+		output->shared = shared;
+		output->sharedSent = sharedLen - sharedLeft;
+		payload(shared)->refs++;
+	}
+	for (int i=0; i<iovcnt; i++) { // Copy everything after the first 'sent' bytes
+		if (sent >= iov[i].iov_len) {
+			sent -= iov[i].iov_len;
+			continue;
+		}
+		memcpy(output->data + output->len, (char*)iov[i].iov_base + sent, iov[i].iov_len - sent);
+		output->len += iov[i].iov_len - sent;
+		sent = 0;
+	}
+	outputBytes += output->len;
+	int ret;
+	khiter_t k = kh_put(outputs, outputs, fd, &ret);
+	kh_value(outputs, k) = output;
+
+	// Now wait for the socket to be writable rather than readable, or have the kernel send it
+	if (usingUring) {
+		uringSendOutput(fd, output);
+	} else {
+		watchClient(fd, EPOLLOUT);
+	}
+	wheelAdd(&wheel, fd, wheel.now + WRITE_TIMEOUT_SECONDS*1000/WHEEL_TICK_MS);
+}
+
+// A slow client can take some more of their response
+void writeResponse(int fd) {
+	outputBuffer *output = kh_value(outputs, kh_get(outputs, outputs, fd));
+	struct iovec iov[2] = { { .iov_base = output->data + output->sent, .iov_len = output->len - output->sent } };
+	if (output->shared) {
+		iov[1].iov_base = payload(output->shared)->data + output->sharedSent;
+		iov[1].iov_len = payload(output->shared)->len - output->sharedSent;
+	}
+	ssize_t sent = writev(fd, iov, output->shared ? 2 : 1);
+	clientSyscalls++;
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			writeStalls++;
+			return;
+		}
+		closeConnectionSkipHash(fd);
+		return;
+	}
+	int fromData = sent < iov[0].iov_len ? sent : iov[0].iov_len;
+	output->sent += fromData;
+	if (output->shared) {
+		output->sharedSent += sent - fromData;
+	}
+	if (output->sent < output->len || (output->shared && output->sharedSent < payload(output->shared)->len)) {
+		partialWrites++;
+		return;
+	}
+	finishResponse(fd); // All gone
+}
+
+// The io_uring way of driving the client sockets (IO_URING mode), instead of newConnectionCallback, clientsCallback and
+// the writes above. The ring's fd is watched like any other, and this deals with whatever's completed, which queues
+// whatever comes next. That all goes to the kernel in one io_uring_enter, when
+// the loop's about to wait again, so a busy loop round makes two syscalls for everything it did
+void uringCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	struct io_uring_cqe cqe;
+	for (int done=0; done<EVENT_BATCH && uringNext(&clientRing, &cqe); done++) {
+		switch (cqe.user_data & 3) {
+		case OP_SEND:
+			uringSent((outputBuffer*)(unsigned long)cqe.user_data, cqe.res);
+			break;
+		case OP_ACCEPT:
+			uringAccepted(cqe.res, cqe.flags);
+			break;
+		case OP_RECV:
+			uringReceived(&cqe);
+			break;
+		default: // A close or cancel that didn't work. A close that was linked to a send that failed is sorted out by
+			// uringSent, and cancels fail when there was nothing left to cancel
+			logDebug("io_uring close or cancel for fd %d: %d", (int)(cqe.user_data >> 2 & 0xffffffff), cqe.res);
+		}
+	}
+}
+
+void uringSubmitCallback(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+	uringSubmit(&clientRing);
+}
+
+// The multishot accept has a new connection for us (or it's stopped)
+void uringAccepted(int res, unsigned int flags) {
+	if (!(flags & IORING_CQE_F_MORE)) { // It's stopped (eg we're out of fds), so start it again
+		uringAccept(&clientRing, cometSd, SOCK_NONBLOCK, OP_ACCEPT);
+	}
+	if (res < 0) {
+		if (res != -EAGAIN && res != -ECONNABORTED) {
+			logError("accept error %d", -res);
+		}
+		return;
+	}
+	if (res >= maxConns) { // Past the end of the connection table
+		close(res);
+		clientSyscalls++;
+		return;
+	}
+
+	// Start them off in the connection table, and start reading. Thanks to TCP_DEFER_ACCEPT their request is usually
+	// there already, so the recv completes as soon as it's submitted
+	acceptedConns++;
+	resetConnection(res);
+	wheelAdd(&wheel, res, wheel.now + HEADER_TIMEOUT_SECONDS*1000/WHEEL_TICK_MS); // Drop them if they're too slow sending the request
+	watchClient(res, EPOLLIN);
+}
+
+// A client's multishot recv has read something, or they've closed, or it's stopped
+void uringReceived(struct io_uring_cqe *cqe) {
+	int fd = cqe->user_data >> 2 & 0xffffffff;
+	connection *thisClient = &conns[fd];
+	const byte *buffer = (const byte*)uringBuffer(&clientRing, cqe);
+	if ((cqe->user_data >> 34) != thisClient->generation || !(thisClient->events & EPOLLIN)) {
+		// It's from before the recv was cancelled, or the fd was closed (and maybe someone else has it now)
+		uringRecycle(&clientRing, cqe);
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		thisClient->events &= ~EPOLLIN; // That's the last from this recv
+	}
+	if (cqe->res > 0) {
+		int open = requestArrived(fd, buffer, cqe->res);
+		uringRecycle(&clientRing, cqe); // Anything it needs to keep, it's copied
+		if (open) {
+			watchClient(fd, EPOLLIN); // In case the recv's stopped
+		}
+	} else if (cqe->res == -ENOBUFS) {
+		watchClient(fd, EPOLLIN); // The buffers were all in use, they'll be back by the time it's submitted again
+	} else {
+		closeConnection(fd); // The client's closed (0), or the recv failed
+	}
+}
+
+// Have the kernel send a response (or the rest of one) from its output buffer. It's MSG_WAITALL, so the kernel keeps
+// at it until it's all gone, however slow the client is. If it's the last on the connection, the recv's cancelled
+// first and the close is linked on after it, so the deliver and hang up is all one submit
+void uringSendOutput(int fd, outputBuffer *output) {
+	connection *thisClient = &conns[fd];
+	output->fd = fd;
+	output->iov[0].iov_base = output->data + output->sent;
+	output->iov[0].iov_len = output->len - output->sent;
+	if (output->shared) {
+		output->iov[1].iov_base = payload(output->shared)->data + output->sharedSent;
+		output->iov[1].iov_len = payload(output->shared)->len - output->sharedSent;
+	}
+	memset(&output->msg, 0, sizeof(struct msghdr));
+	output->msg.msg_iov = output->iov;
+	output->msg.msg_iovlen = output->shared ? 2 : 1;
+	int last = !keepAlive(fd);
+	uringReserve(&clientRing, 3); // A link only goes as far as the end of a submit
+	if (last && thisClient->events & EPOLLIN) {
+		uringCancel(&clientRing, fd, uringData(OP_CLOSE, fd));
+		thisClient->events &= ~EPOLLIN;
+	}
+	struct io_uring_sqe *sqe = uringSendmsg(&clientRing, fd, &output->msg, MSG_WAITALL, (unsigned long)output);
+	thisClient->events |= EPOLLOUT;
+	if (last) {
+		sqe->flags |= IOSQE_IO_LINK;
+		uringClose(&clientRing, fd, uringData(OP_CLOSE, fd));
+		thisClient->events |= CLOSE_LINKED;
+	}
+}
+
+// The kernel's finished with a send: it's all gone, or some of it (if it was interrupted), or the client has, or we
+// cancelled it
+void uringSent(outputBuffer *output, int res) {
+	int fd = output->fd;
+	connection *thisClient = &conns[fd];
+	int left = output->len - output->sent + (output->shared ? payload(output->shared)->len - output->sharedSent : 0);
+	thisClient->events &= ~EPOLLOUT;
+	if (res != left) {
+		thisClient->events &= ~CLOSE_LINKED; // It came up short, which cancels the close that was linked to it
+	}
+	if (res > 0 && res < left && !(thisClient->events & CLOSING)) { // Send the rest
+		int fromData = res < output->len - output->sent ? res : output->len - output->sent;
+		output->sent += fromData;
+		output->sharedSent += res - fromData;
+		partialWrites++;
+		uringSendOutput(fd, output);
+		return;
+	}
+	freeOutput(fd);
+	if (res <= 0 || thisClient->events & CLOSING) {
+		closeConnectionSkipHash(fd); // They've gone, or we'd given up on them
+		return;
+	}
+	finishResponse(fd); // All gone. If that was the last response the linked close has closed it already
+}
+
+// Close a client socket through the ring, after cancelling anything it has on the go. The fd isn't ours once it's
+// closed, so the generation goes up, and any completions still to come for it are ignored. But if a send's on the go,
+// its output buffer is the kernel's till it comes back, so the close waits for that
+void uringCloseClient(int fd) {
+	connection *thisClient = &conns[fd];
+	if (thisClient->events & (EPOLLIN|EPOLLOUT)) {
+		uringCancel(&clientRing, fd, uringData(OP_CLOSE, fd));
+		thisClient->events &= ~EPOLLIN;
+	}
+	if (thisClient->events & EPOLLOUT) {
+		thisClient->events |= CLOSING; // uringSent comes back here
+		return;
+	}
+	if (!(thisClient->events & CLOSE_LINKED)) { // Unless it went with the last response
+		uringClose(&clientRing, fd, uringData(OP_CLOSE, fd));
+	}
+	thisClient->events = 0;
+	thisClient->generation++;
+}
+
+// Take a message off the expiry list once it's been delivered or expired
+void unlinkQueuedMessage(unsigned int handle) {
+	queuedMessage *m = queued(handle);
+	if (m->older) {
+		queued(m->older)->newer = m->newer;
+	} else {
+		oldestMessage = m->newer;
+	}
+	if (m->newer) {
+		queued(m->newer)->older = m->older;
+	} else {
+		newestMessage = m->older;
+	}
+	queuedMessages--;
+	queuedBytes -= m->len;
+}
+
+// Take the oldest message off a client's list, returns its handle. The caller frees it from the slab once it's
+// done with it. If that was the last one, and there's no connection waiting for them (and there can't be, if they
+// had messages queued), they come out of the index
+unsigned int shiftMessage(indexEntry *entry) {
+	queuedMessage *newest = queued(entry->messages);
+	unsigned int oldest = newest->next;
+	if (oldest == entry->messages) {
+		entry->messages = 0;
+		if (entry->fd < 0) {
+			indexDel(&clients, entry);
+		}
+	} else {
+		newest->next = queued(oldest)->next;
+	}
+	unlinkQueuedMessage(oldest);
+	return oldest;
+}
+
+// Throw away messages that have been queued longer than QUEUE_TTL_SECONDS, at most TIMEOUT_BUDGET at a time
+// The expiry list is oldest first, and a client's oldest message is always at the front of their list, so
+// each one is a shiftMessage
+void expireQueue() {
+	int expired = 0;
+	while (oldestMessage && nowMs() - queued(oldestMessage)->queuedAt >= QUEUE_TTL_SECONDS*1000 && expired < TIMEOUT_BUDGET) {
+		unsigned int m = shiftMessage(indexFindId(&clients, queued(oldestMessage)->clientId));
+		expiredMessages++;
+		expiredBytes += queued(m)->len;
+		slabFree(&messages, m);
+		expired++;
+	}
+	if (expired) {
+		logInfo("Expired %d queued messages, %lu (%lu bytes) so far, %lu still queued", expired, expiredMessages, expiredBytes, queuedMessages);
+	}
+}
+
+// The rest of the headers after responseStart: the Content-Length, from the table, or made in 'buffer' if it's longer
+void contentLength(struct iovec *iov, int body, char *buffer) {
+	if (body <= MAX_MESSAGE_LEN) {
+		iov->iov_base = httpLengths[body];
+		iov->iov_len = httpLengthsLen[body];
+	} else { // Only a batch (or a framed channel message) gets this long
+		iov->iov_base = buffer;
+		iov->iov_len = snprintf(buffer, HTTP_LENGTH_SIZE, "%d" HTTP_HEADER_END, body);
+	}
+}
+
+// Send messages to a client as the http response, straight from wherever the messages are
+// In BATCH_SINGLE mode there's only ever one. Otherwise they're framed as BATCH_MODE says
+void sendMessages(int fd, struct iovec *msgs, int count) {
+	struct iovec iov[2*MAX_BATCH_MESSAGES + 4];
+	int n = 2, body = 0;
+	if (BATCH_MODE == BATCH_JSON) {
+		iov[n++] = (struct iovec){ .iov_base = "[", .iov_len = 1 };
+	}
+	for (int i=0; i<count; i++) {
+		if (BATCH_MODE == BATCH_JSON && i) {
+			iov[n++] = (struct iovec){ .iov_base = ",", .iov_len = 1 };
+		}
+		iov[n++] = msgs[i];
+		if (BATCH_MODE == BATCH_LINES) {
+			iov[n++] = (struct iovec){ .iov_base = "\n", .iov_len = 1 };
+		}
+	}
+	if (BATCH_MODE == BATCH_JSON) {
+		iov[n++] = (struct iovec){ .iov_base = "]", .iov_len = 1 };
+	}
+	for (int i=2; i<n; i++) {
+		body += iov[i].iov_len;
+	}
+	deliveredMessages += count;
+	deliveredBytes += body;
+	responseStart(fd, &iov[0]);
+	char length[HTTP_LENGTH_SIZE];
+	contentLength(&iov[1], body, length);
+	sendAndFinish(fd, iov, n, 0);
+}
+
+// Send a single message as the response
+void sendResponse(int fd, const char *message, int len) {
+	struct iovec msg = { .iov_base = (void*)message, .iov_len = len };
+	sendMessages(fd, &msg, 1);
+}
+
+// Send the empty response that tells the client to poll again
+void sendEmptyResponse(int fd) {
+	struct iovec iov[2];
+	emptyResponses++;
+	responseStart(fd, &iov[0]);
+	iov[1].iov_base = httpLengths[0];
+	iov[1].iov_len = httpLengthsLen[0];
+	sendAndFinish(fd, iov, 2, 0);
+}
+
+// Send a channel message, from the body that's shared by all its subscribers
+void sendShared(int fd, unsigned int shared) {
+	struct iovec iov[3];
+	char length[HTTP_LENGTH_SIZE];
+	responseStart(fd, &iov[0]);
+	contentLength(&iov[1], payload(shared)->len, length);
+	iov[2].iov_base = payload(shared)->data;
+	iov[2].iov_len = payload(shared)->len;
+	deliveredMessages++;
+	deliveredBytes += payload(shared)->len;
+	sendAndFinish(fd, iov, 3, shared);
+}
+
+// Send a client as many of their queued messages as fit in a response (just the oldest, in BATCH_SINGLE mode)
+// The connection mustn't be in the index, so the rest stay queued for their next poll
+void sendQueued(int fd, indexEntry *entry) {
+	unsigned int handles[BATCH_MODE == BATCH_SINGLE ? 1 : MAX_BATCH_MESSAGES];
+	struct iovec msgs[BATCH_MODE == BATCH_SINGLE ? 1 : MAX_BATCH_MESSAGES];
+	int count = 0, body = 2, more = 1; // The body starts with room for the "[]"
+	while (more && count < sizeof(handles)/sizeof(handles[0])) {
+		queuedMessage *newest = queued(entry->messages);
+		queuedMessage *oldest = queued(newest->next);
+		if (count && body + oldest->len + 1 > MAX_BATCH_LEN) {
+			break; // Always take the first, however long
+		}
+		more = newest->next != entry->messages; // Once it's the last one, the entry may go
+		body += oldest->len + 1;
+		handles[count] = shiftMessage(entry);
+		statsRecord(&queueWait, (nowMs() - queued(handles[count])->queuedAt) * 1000.);
+		msgs[count].iov_base = queued(handles[count])->message;
+		msgs[count].iov_len = queued(handles[count])->len;
+		count++;
+	}
+	sendMessages(fd, msgs, count);
+	for (int i=0; i<count; i++) {
+		slabFree(&messages, handles[i]);
+	}
+}
+
+// Start a waiting connection lingering, so it gets whatever else comes in the next LINGER_MS along with this message
+void startLinger(int fd) {
+	conns[fd].readStatus = LINGERING;
+	if (lingerCount == lingerSize) { // Full, so double it. The part of the ring that had wrapped round goes after the rest
+		lingering = realloc(lingering, 2 * lingerSize * sizeof(lingerer));
+		memcpy(lingering + lingerSize, lingering, lingerHead * sizeof(lingerer));
+		lingerSize *= 2;
+	}
+	lingering[(lingerHead + lingerCount) & (lingerSize-1)] = (lingerer){ .fd = fd, .due = ev_now(libEvLoop) + LINGER_MS/1000. };
+	lingerCount++;
+	if (!ev_is_active(&lingerWatcher)) {
+		ev_timer_set(&lingerWatcher, LINGER_MS/1000., 0);
+		ev_timer_start(libEvLoop, &lingerWatcher);
+	}
+}
+
+// A lingering connection's time is up (or its long poll ran out first), so send them what they've got
+void finishLinger(int fd) {
+	indexEntry *entry = indexFindId(&clients, conns[fd].clientId);
+	if (!entry->messages) { // A newer poll got them (or they expired)
+		sendEmptyResponse(fd);
+		return;
+	}
+	unpark(entry);
+	sendQueued(fd, entry);
+}
+
+// Called when the lingering connection at the front of the ring is due. Sees to everyone that's due, then waits
+// for the next one
+void lingerCallback(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+	ev_tstamp now = ev_now(loop);
+	while (lingerCount && lingering[lingerHead].due <= now) {
+		int fd = lingering[lingerHead].fd;
+		lingerHead = (lingerHead + 1) & (lingerSize-1);
+		lingerCount--;
+		// If it closed while lingering this is stale, or the fd is now someone else's. If they're lingering too they
+		// go a little early, which does no harm
+		if (conns[fd].readStatus == LINGERING) {
+			finishLinger(fd);
+		}
+	}
+	if (lingerCount) {
+		ev_timer_set(watcher, lingering[lingerHead].due - now, 0);
+		ev_timer_start(loop, watcher);
+	}
+}
+
+// Called when the manager sends a complete message. The id and message may be in the receive buffer, so they're not
+// null terminated, and they're only good until this returns
+// With threads, thread 0 gets them all from the manager, and passes on the ones for clients that aren't its own
+void messageArrivedFromManager(const char *clientId, int clientIdLen, const char *message, int len) {
+	unsigned int hash = indexHash(clientId, clientIdLen);
+	int owner = ownerThread(hash);
+	if (owner != threadNo) {
+		passMessage(owner, WIRE_MESSAGE, clientId, clientIdLen, message, len);
+		return;
+	}
+	managerMessages++;
+	logDebug("Message arrived: >%.*s< for >%.*s<", len, message, clientIdLen, clientId);
+
+	// Find (or add) the client in the index
+	indexEntry *entry = indexAdd(&clients, clientId, clientIdLen, hash);
+
+	// See if the client is connected, if so immediately forward (unless we're giving more messages a chance to arrive)
+	if (entry->fd >= 0 && !LINGER_MS) {
+		int fd = entry->fd;
+		unpark(entry);
+		sendResponse(fd, message, len); // Send it
+		return;
+	}
+
+	// If not, add to their queue
+	queueMessage(entry, message, len);
+}
+
+// Add a message to a client's queue. If they're waiting, they get it (and anything else that turns up) once they've lingered
+void queueMessage(indexEntry *entry, const char *message, int len) {
+	unsigned int handle = slabAlloc(&messages, sizeof(queuedMessage) + len + 1);
+	queuedMessage *newMessage = queued(handle);
+	memcpy(newMessage->message, message, len);
+	newMessage->message[len] = 0;
+	newMessage->len = len;
+	newMessage->queuedAt = nowMs();
+	newMessage->clientId = entry->id;
+	if (!entry->messages) {
+		newMessage->next = handle;
+	} else {
+		// It goes in as the newest, so that shiftMessage will grab the oldest first (like a FIFO)
+		newMessage->next = queued(entry->messages)->next;
+		queued(entry->messages)->next = handle;
+	}
+	entry->messages = handle;
+
+	// Add it to the end of the expiry list
+	newMessage->older = newestMessage;
+	newMessage->newer = 0;
+	if (newestMessage) {
+		queued(newestMessage)->newer = handle;
+	} else {
+		oldestMessage = handle;
+	}
+	newestMessage = handle;
+	queuedMessages++;
+	queuedBytes += newMessage->len;
+
+	if (entry->fd >= 0 && conns[entry->fd].readStatus != LINGERING) {
+		startLinger(entry->fd);
+	}
+}
+
+// Tell the manager we've got someone listening to a channel now, or haven't any more. With threads, it's whether
+// the worker as a whole has, which threadChannel works out, and thread 0 tells the manager
+void tellManager(int type, const char *channel, int len) {
+	if (threadCount > 1) {
+		threadChannel(type, channel, len);
 		return;
 	}
-	// Go through the bytes read
+	tellManagerNow(type, channel, len);
+}
+
+void tellManagerNow(int type, const char *channel, int len) {
+	if (managerSd < 0 || managerVersion < 2) {
+		return; // We'll tell it all our channels when it's back
+	}
+	byte frame[WIRE_HEADER + MAX_CLIENT_ID_LEN];
+	int n = wireFrame(frame, type, channel, len, "", 0);
+	if (write(managerSd, frame, n) != n) {
+		logError("Couldn't tell the manager about channel %.*s", len, channel);
+	}
+}
+
+// Subscribe a connection that's now waiting to the channels it named after its client id: "~chat~news"
+void listenToChannels(int fd, const char *list, int len) {
+	const char *end = list + len;
+	for (const char *p = list + 1, *next; p < end; p = next + 1) {
+		next = memchr(p, CHANNEL_SEPARATOR, end - p);
+		if (!next) next = end;
+		if (next > p && channelSubscribe(&channels, p, next - p, fd, &conns[fd].channels)) {
+			tellManager(WIRE_SUBSCRIBE, p, next - p);
+		}
+	}
+}
+
+// Called when the manager sends a message for a channel. Everyone waiting here that's listening to it gets the same
+// copy of it, framed once
+void channelMessageArrived(const char *channel, int channelLen, const char *message, int len) {
+	logDebug("Channel message arrived: >%.*s< for >%.*s<", len, message, channelLen, channel);
+	channelMessages++;
+	indexEntry *e = channelFind(&channels, channel, channelLen);
+	if (!e) {
+		return;
+	}
+	if (!e->fd) { // Nobody's listened to it since the last one, so stop the manager sending them
+		tellManager(WIRE_UNSUBSCRIBE, channel, channelLen);
+		channelDrop(&channels, e);
+		return;
+	}
+
+	// Who it's going to. Sending to one takes it off its channels, so they're collected first
+	if (e->fd > fanoutSize) {
+		fanoutSize = e->fd * 2;
+		fanout = realloc(fanout, fanoutSize * sizeof(int));
+	}
+	int count = 0;
+	for (unsigned int s = e->messages; s; s = channelSub(&channels, s)->next) {
+		fanout[count++] = channelSub(&channels, s)->fd;
+	}
+
+	if (LINGER_MS) { // They linger first, so it goes in their queues like any other message
+		for (int i=0; i<count; i++) {
+			queueMessage(indexFindId(&clients, conns[fanout[i]].clientId), message, len);
+		}
+		return;
+	}
+
+	// The body, ready framed for the BATCH_MODE
+	int body = len + (BATCH_MODE == BATCH_JSON ? 2 : BATCH_MODE == BATCH_LINES ? 1 : 0);
+	unsigned int shared = slabAlloc(&messages, sizeof(sharedPayload) + body);
+	payload(shared)->refs = 1; // Ours, till they've all had it
+	payload(shared)->len = body;
+	char *p = payload(shared)->data;
+	if (BATCH_MODE == BATCH_JSON) *p++ = '[';
+	memcpy(p, message, len);
+	p += len;
+	if (BATCH_MODE == BATCH_JSON) *p++ = ']';
+	if (BATCH_MODE == BATCH_LINES) *p++ = '\n';
+
+	for (int i=0; i<count; i++) {
+		int fd = fanout[i];
+		unpark(indexFindId(&clients, conns[fd].clientId));
+		sendShared(fd, shared);
+	}
+	releasePayload(shared);
+}
+
+// Called for the manager's frames that aren't client messages. Any of our threads could have listeners for a channel
+void frameArrivedFromManager(int type, const char *id, int idLen, const char *payload, int len) {
+	if (type == WIRE_CHANNEL) {
+		for (int t=1; t<threadCount; t++) {
+			passMessage(t, WIRE_CHANNEL, id, idLen, payload, len);
+		}
+		channelMessageArrived(id, idLen, payload, len);
+	}
+}
+
+// Parse commands from a manager speaking protocol version 1, a byte at a time
+void legacyCommands(const byte *buffer, int read) {
 	for (int i=0; i<read; i++) {
-		// Are we reading (and ignoring) the rest of the headers?
-		if (thisClient->readStatus == 500) { // looking for the second \n to signify the end of headers
-			if (buffer[i]=='\n') {
-				thisClient->readStatus = 1000; // Now we are ready to respond
-				receivedHeaders(thisClient); // Now we can respond
-				return; // No point processing the rest of the stuff from the client: TODO what about skipping everything after the first line?
-			} else {
-				// TODO throw error and give up - '\r' not followed by '\n'	
+		if (commandStatus==0) {
+			if (buffer[i]==2) { // Start of the mgr sending a message
+				commandStatus = 200;
+				commandClientIdLen = 0;
+				commandMessageLen = 0;
+				continue;				
 			}
 		}
-		if (thisClient->readStatus == 400) { // looking for the second \r to signify the end of headers, or the next header
-			if (buffer[i]=='\r') {
-				thisClient->readStatus = 500; // Waiting for the next '\n'
+		if (commandStatus==200) { // We are waiting for the mgr to send a client id
+			if (buffer[i]==0) {
+				commandStatus=201; // Now wait for the message	
+				continue;
 			} else {
-				thisClient->readStatus = 200; // Back to reading another header line
+				if (commandClientIdLen < MAX_CLIENT_ID_LEN) {
+					commandClientId[commandClientIdLen] = buffer[i];
+					commandClientIdLen ++;
+					continue;
+				} else {
+					// Buffer overrun on the client id, so put the error
+					logWarn("Buffer overrun on the client id from the mgr");
+					commandStatus=0;
+					continue;
+				}
 			}
 		}
-		if (thisClient->readStatus == 300) { // looking for the first \n
-			if (buffer[i]=='\n') {
-				thisClient->readStatus = 400; // Waiting for the next '\r'
+		if (commandStatus==201) { // We are waiting for the app sending a message
+			if (buffer[i]==0) {
+				messageArrivedFromManager((char*)commandClientId, commandClientIdLen, (char*)commandMessage, commandMessageLen); // Send the message to the correct client
+				commandStatus=0; // Now wait for the next command	
+				continue;
 			} else {
-				// TODO throw error and give up - '\r' not followed by '\n'	
+				if (commandMessageLen < MAX_MESSAGE_LEN) {
+					commandMessage[commandMessageLen] = buffer[i];
+					commandMessageLen ++;
+					continue;
+				} else {
+					// Buffer overrun on the message, so put the error and kill this connection todo
+					logWarn("Buffer overrun on the message from the mgr");
+					commandStatus=0;
+					continue;
+				}
 			}
 		}
-		if (thisClient->readStatus == 200) { // reading (and ignoring) the rest of the headers
-			if (buffer[i]=='\r') {
-				thisClient->readStatus = 300; // Waiting for a '\n'
-			}
+		// If it got to the end of the loop here, then the manager has sent a malformed message so lets reset the parser
+		commandStatus = 0;
+	} // end of the for loop
+}
+
+
+// This gets called when there's incoming data from the manager. It reads everything that's there, in as few recvs as
+// it can, and in version 2 passes on each message straight from the buffer
+void managerCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	if (EV_ERROR & revents) {
+		logError("got invalid event");
+		return;
+	}
+
+	for (;;) {
+		ssize_t read = recv(managerSd, managerBuffer + managerBuffered, MANAGER_BUFFER_SIZE - managerBuffered, MSG_DONTWAIT);
+		if (read < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return; // Got it all
+			logError("manager read error: %s", strerror(errno));
+			managerLost();
+			return;
 		}
-		// Are we reading the first line of the header?
-		// Did we just receive the '\r' and are we now waiting for the '\n' ?
-		if (thisClient->readStatus == 100) {
-			if (buffer[i]=='\n') {
-				thisClient->readStatus = 200; // Great, now we're going thru the rest of the headers
-			} else {
-				// Bugger, it wasn't a \n. Drop the connection
-				// TODO shut down the connection
-			}
+		if (read == 0) {
+			logError("manager connection closing, we'll keep trying it");
+			managerLost();
+			return;
 		}
-		// Reading the rest of the first header line, waiting for the '\r'
-		if (thisClient->readStatus == 20) {
-			if (buffer[i]=='\r') {
-				thisClient->readStatus = 100; // Now waiting for the '\n'
-			}
+		if (managerVersion < 2) {
+			legacyCommands(managerBuffer, read);
+			continue;
 		}
-		// Reading the '.js' after the client id
-		if (thisClient->readStatus == 12) {
-			if (buffer[i]=='s') {
-				thisClient->readStatus=20;
-			} else {
-				// drop the connection, they might be trying to access the favicon or something annoying like that	
-				// puts ("Not a .js request!");
-				closeConnection(watcher);
+		int len = managerBuffered + read;
+		int used = wireParse(managerBuffer, len, messageArrivedFromManager, frameArrivedFromManager);
+		if (used == WIRE_ERROR) {
+			logError("The manager sent a bad frame");
+			managerLost(); // We can't tell where the next one starts, so start again
+			return;
+		}
+		managerBuffered = len - used;
+		memmove(managerBuffer, managerBuffer + used, managerBuffered); // Keep the start of the next frame
+	}
+}
+
+// This gets called when the manager's put something in an empty ring, and we'd said we were waiting. We take the
+// messages from where they are in the ring, until it's empty
+void ringCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	unsigned long long n;
+	read(managerRing.dataEvent, &n, sizeof(n)); // Reset it
+	do {
+		byte *start;
+		unsigned long len;
+		while (!managerPaused && (len = ringReadable(&managerRing, &start))) {
+			int used = wireParse(start, len, messageArrivedFromManager, frameArrivedFromManager);
+			if (used <= 0) {
+				logError("Bad frame in the shared ring");
+				managerLost();
 				return;
 			}
+			ringConsume(&managerRing, used);
 		}
-		if (thisClient->readStatus == 11) {
-			if (buffer[i]=='j') {
-				thisClient->readStatus=12;
-			} else {
-				// drop the connection, they might be trying to access the favicon or something annoying like that	
-				// puts ("Not a .js request!");
-				closeConnection(watcher);
+	} while (!managerPaused && !ringSleep(&managerRing));
+}
+
+// Pass a client that landed on this worker to the worker that owns their client id, in SHARED_PORT mode
+// The connection goes over the owner's handoff socket, with the client id as the datagram's contents
+// Returns 0 if it couldn't be sent (eg the owner is down or backed up), in which case we keep the client
+int handOff(int fd, int owner, const char *clientId, int clientIdLen) {
+	struct sockaddr_un addr;
+	socklen_t addrLen = handoffAddress(owner, &addr);
+	struct iovec iov = { .iov_base = (void*)clientId, .iov_len = clientIdLen };
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg = { .msg_name = &addr, .msg_namelen = addrLen, .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(handoffSd, &msg, 0) < 0) {
+		return 0;
+	}
+	handoffs++;
+	if (!usingUring && conns[fd].events) { // The socket lives on in the owner, so closing our fd won't take it out of our epoll set
+		epoll_ctl(clientsSd, EPOLL_CTL_DEL, fd, NULL);
+	}
+	closeConnectionSkipHash(fd); // The owner has its own copy of the socket now
+	if (usingUring) {
+		uringSubmit(&clientRing); // Cancel our recv now, so it doesn't take anything that's meant for the owner
+	}
+	return 1;
+}
+
+// This gets called when another worker hands us one of our clients (SHARED_PORT mode)
+// They've already read the request, so these go straight to receivedHeaders
+void handoffCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	if (EV_ERROR & revents) {
+		logError("got invalid event");
+		return;
+	}
+
+	for (int received=0; received<ACCEPT_BATCH; received++) {
+		char clientId[MAX_CLIENT_ID_LEN+1];
+		struct iovec iov = { .iov_base = clientId, .iov_len = MAX_CLIENT_ID_LEN };
+		char control[CMSG_SPACE(sizeof(int))];
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+		ssize_t len = recvmsg(handoffSd, &msg, 0);
+		if (len < 0) {
+			return; // No more waiting
+		}
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			logWarn("handoff without a socket");
+			continue;
+		}
+		int clientSd;
+		memcpy(&clientSd, CMSG_DATA(cmsg), sizeof(int));
+		if (clientSd >= maxConns) {
+			close(clientSd);
+			continue;
+		}
+
+		// Set up the client as if it had connected to us
+		connection *thisClient = &conns[clientSd];
+		resetConnection(clientSd);
+		thisClient->clientIdLen = len;
+		thisClient->readStatus = PARSE_DONE;
+		if (receivedHeaders(clientSd, clientId, len)) {
+			watchClient(clientSd, EPOLLIN);
+		}
+	}
+}
+
+// Stop dealing with a client that another of our threads is taking over. It's the same fd, so it stays open, but it
+// comes out of our epoll set (or our ring stops reading it) before they start on it
+void releaseClient(int fd) {
+	connection *thisClient = &conns[fd];
+	wheelDel(&wheel, fd);
+	if (thisClient->clientId) {
+		slabFree(&clientIds, thisClient->clientId);
+		thisClient->clientId = 0;
+	}
+	if (usingUring) {
+		if (thisClient->events & EPOLLIN) {
+			uringCancel(&clientRing, fd, uringData(OP_CLOSE, fd));
+			uringSubmit(&clientRing); // Now, so it doesn't take anything that's meant for the owner
+		}
+		thisClient->generation++;
+	} else if (thisClient->events) {
+		epoll_ctl(clientsSd, EPOLL_CTL_DEL, fd, NULL);
+		clientSyscalls++;
+	}
+	thisClient->events = 0;
+}
+
+// Pass a client to the thread that owns them, through our ring to it. Returns 0 if it's full, in which case we keep
+// the client. The id's copied into the frame first, as it may be in the connection's own copy
+int passClient(int fd, int owner, const char *clientId, int len) {
+	sharedRing *ring = threadRing(threadNo, owner);
+	int passed[2] = { fd, conns[fd].requests };
+	byte frame[WIRE_HEADER + MAX_CLIENT_ID_LEN + sizeof(passed)];
+	int n = wireFrame(frame, THREAD_CLIENT, clientId, len, (const char*)passed, sizeof(passed));
+	if (ringRoom(ring) < n) {
+		return 0;
+	}
+	releaseClient(fd);
+	ringPut(ring, frame, n);
+	handoffs++;
+	return 1;
+}
+
+// Another thread has passed us one of our clients. They've already read the request, so it's on to receivedHeaders
+void adoptClient(int fd, int requests, const char *id, int len) {
+	char clientId[MAX_CLIENT_ID_LEN+1];
+	memcpy(clientId, id, len);
+	clientId[len] = 0;
+	connection *thisClient = &conns[fd];
+	resetConnection(fd);
+	thisClient->requests = requests;
+	thisClient->clientIdLen = len;
+	thisClient->readStatus = PARSE_DONE;
+	if (receivedHeaders(fd, clientId, len)) {
+		watchClient(fd, EPOLLIN);
+	}
+}
+
+// Stop (or start again) reading from the manager, while a thread's more than a ring's worth behind on what thread 0's
+// passing it, so its backlog can't grow without end. The manager keeps what we don't read, as it would for a slow worker
+void pauseManager(int pause) {
+	managerPaused = pause;
+	if (managerSd < 0) {
+		return; // managerConnected will see to it
+	}
+	if (pause) {
+		logWarn("A thread's behind, not reading from the manager till it catches up");
+		ev_io_stop(libEvLoop, &managerPortWatcher);
+		if (usingRing) {
+			ev_io_stop(libEvLoop, &ringWatcher);
+		}
+		return;
+	}
+	logInfo("The threads have caught up, reading from the manager again");
+	ev_io_start(libEvLoop, &managerPortWatcher);
+	if (usingRing) {
+		ev_io_start(libEvLoop, &ringWatcher);
+		ev_feed_event(libEvLoop, &ringWatcher, EV_READ); // It won't say there's something there, as we didn't say we'd sleep
+	}
+}
+
+// A thread's backlog is waiting for room in thread 0's ring to it. The ring only says there's room when we've said
+// we're waiting, which has to be said again each time
+void waitForThread(int to) {
+	workerThread *t = &threads[to];
+	if (!ev_is_active(&t->backlogWatcher)) {
+		ev_io_init(&t->backlogWatcher, backlogCallback, threadRing(0, to)->spaceEvent, EV_READ);
+		t->backlogWatcher.data = (void*)(long)to;
+		ev_io_start(libEvLoop, &t->backlogWatcher);
+	}
+	if (!ringWait(threadRing(0, to), WIRE_HEADER + t->backlog[1] + wireGetLength(t->backlog + 2))) {
+		ev_feed_event(libEvLoop, &t->backlogWatcher, EV_READ); // It made room in the meantime
+	}
+}
+
+// There's room in a thread's ring for some of its backlog. As many whole frames go in as fit
+void backlogCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	int to = (long)watcher->data;
+	workerThread *t = &threads[to];
+	sharedRing *ring = threadRing(0, to);
+	unsigned long long n;
+	read(ring->spaceEvent, &n, sizeof(n)); // Reset it
+	unsigned long room = ringRoom(ring);
+	int put = 0;
+	while (put < t->backlogLen) {
+		unsigned long size = WIRE_HEADER + t->backlog[put+1] + wireGetLength(t->backlog + put + 2);
+		if (size > room) {
+			break;
+		}
+		put += size;
+		room -= size;
+	}
+	if (put) {
+		ringPut(ring, t->backlog, put);
+		t->backlogLen -= put;
+		memmove(t->backlog, t->backlog + put, t->backlogLen);
+	}
+	if (t->backlogLen) {
+		waitForThread(to);
+		return;
+	}
+	ev_io_stop(loop, watcher);
+	if (managerPaused) {
+		for (int i=1; i<threadCount; i++) {
+			if (threads[i].backlogLen) {
 				return;
 			}
 		}
-		// Reading the client id up to the '.js'
-		if (thisClient->readStatus == 10) {
-			if (buffer[i]=='.') {
-				thisClient->clientId[thisClient->clientIdLen]=0; // Put the null terminator on the end of the client id
-				thisClient->readStatus = 11; // now reading the rest of the first header line, waiting for the '\r'
-			} else {
-				// Record the client id
-				if (thisClient->clientIdLen < MAX_CLIENT_ID_LEN) {
-					thisClient->clientId[thisClient->clientIdLen] = buffer[i];
-					thisClient->clientIdLen++;
-				} else {
-					// Client id too long
-					// TODO shut down the connection and print a warning
-				}
+		pauseManager(0);
+	}
+}
+
+// Pass a message from the manager (or a channel message) to another thread. Thread 0 is the only one that does. If
+// the thread's ring is full, it goes in the thread's backlog rather than wait, as thread 0 has clients of its own
+void passMessage(int to, int type, const char *id, int idLen, const char *message, int len) {
+	byte frame[WIRE_HEADER + MAX_CLIENT_ID_LEN + MAX_MESSAGE_LEN];
+	int n = wireFrame(frame, type, id, idLen, message, len);
+	threadMessages++;
+	workerThread *t = &threads[to];
+	if (!t->backlogLen && ringRoom(threadRing(0, to)) >= n) {
+		ringPut(threadRing(0, to), frame, n);
+		return;
+	}
+	if (t->backlogLen + n > t->backlogSize) {
+		t->backlogSize = t->backlogLen + n > 2*t->backlogSize ? t->backlogLen + n : 2*t->backlogSize;
+		t->backlog = realloc(t->backlog, t->backlogSize);
+	}
+	memcpy(t->backlog + t->backlogLen, frame, n);
+	t->backlogLen += n;
+	if (t->backlogLen == n) {
+		waitForThread(to);
+	}
+	if (!managerPaused && t->backlogLen > SHARED_RING_SIZE) {
+		pauseManager(1);
+	}
+}
+
+// Deal with everything in a ring from another thread. It's only ever whole frames, that we wrote ourselves
+void readThreadRing(sharedRing *ring) {
+	byte *start;
+	unsigned long len;
+	while ((len = ringReadable(ring, &start))) {
+		for (const byte *p = start, *end = start + len; p < end; ) {
+			int type = p[0], idLen = p[1];
+			unsigned int payloadLen = wireGetLength(p+2);
+			const char *id = (const char*)p + WIRE_HEADER, *payload = id + idLen;
+			if (type == WIRE_MESSAGE) {
+				messageArrivedFromManager(id, idLen, payload, payloadLen);
+			} else if (type == WIRE_CHANNEL) {
+				channelMessageArrived(id, idLen, payload, payloadLen);
+			} else if (type == THREAD_CLIENT) {
+				int passed[2];
+				memcpy(passed, payload, sizeof(passed));
+				adoptClient(passed[0], passed[1], id, idLen);
 			}
+			p = (const byte*)payload + payloadLen;
 		}
-		// Are we receiving the first line's "GET /" part?
-		if (thisClient->readStatus == 0) {
-			if (buffer[i]=='/') {
-				thisClient->readStatus = 10; // Reading the client id now
-				thisClient->clientIdLen = 0;
+		ringConsume(ring, len);
+	}
+}
+
+// Send the manager the subscriptions the threads have left for thread 0
+void sendChannelTells() {
+	pthread_mutex_lock(&channelLock);
+	for (int i=0; i<channelTellsLen; ) {
+		int len = channelTells[i+1];
+		tellManagerNow(channelTells[i], (const char*)channelTells + i + WIRE_HEADER, len);
+		i += WIRE_HEADER + len;
+	}
+	channelTellsLen = 0;
+	pthread_mutex_unlock(&channelLock);
+}
+
+// Another thread has put something in one of our rings (or for thread 0, has subscriptions for the manager). We empty
+// them all, then say we're going to sleep on each, going round again if something's arrived in the meantime
+void threadCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	unsigned long long n;
+	read(threads[threadNo].wakeFd, &n, sizeof(n)); // Reset it
+	for (int more = 1; more; ) {
+		more = 0;
+		for (int from=0; from<threadCount; from++) {
+			if (from != threadNo) {
+				readThreadRing(threadRing(from, threadNo));
+				more |= !ringSleep(threadRing(from, threadNo));
 			}
 		}
 	}
+	if (threadNo == 0) {
+		sendChannelTells();
+	}
+}
+
+// One of our threads has a listener for a channel for the first time, or has stopped having any. The manager only
+// needs telling if it's the first thread to listen, or the last to stop
+void threadChannel(int type, const char *channel, int len) {
+	char name[MAX_CLIENT_ID_LEN+1];
+	memcpy(name, channel, len);
+	name[len] = 0;
+	int tell = 0;
+	pthread_mutex_lock(&channelLock);
+	khiter_t k = kh_get(threadChannels, threadChannels, name);
+	if (type == WIRE_SUBSCRIBE) {
+		if (k == kh_end(threadChannels)) {
+			int ret;
+			k = kh_put(threadChannels, threadChannels, strdup(name), &ret);
+			kh_value(threadChannels, k) = 0;
+		}
+		tell = kh_value(threadChannels, k)++ == 0;
+	} else if (k != kh_end(threadChannels) && --kh_value(threadChannels, k) == 0) {
+		free((char*)kh_key(threadChannels, k));
+		kh_del(threadChannels, threadChannels, k);
+		tell = 1;
+	}
+	if (tell) {
+		if (channelTellsLen + WIRE_HEADER + len > channelTellsSize) {
+			channelTellsSize = 2 * (channelTellsSize + WIRE_HEADER + MAX_CLIENT_ID_LEN);
+			channelTells = realloc(channelTells, channelTellsSize);
+		}
+		channelTellsLen += wireFrame(channelTells + channelTellsLen, type, channel, len, "", 0);
+	}
+	pthread_mutex_unlock(&channelLock);
+	if (!tell) {
+		return;
+	}
+	if (threadNo == 0) {
+		sendChannelTells();
+	} else {
+		unsigned long long one = 1;
+		write(threads[0].wakeFd, &one, sizeof(one));
+	}
+}
+
+// Our stats, in the Prometheus text format (see megastats.h)
+void writeStats(statsText *t) {
+	statsValue(t, "megacomet_accepted_total", "counter", "Connections accepted", acceptedConns);
+	statsValue(t, "megacomet_requests_total", "counter", "Polls received", requestsParsed);
+	statsValue(t, "megacomet_parse_errors_total", "counter", "Requests that weren't polls, or were too long", parseErrors);
+	statsValue(t, "megacomet_parked_total", "counter", "Polls that waited for a message", parkedPolls);
+	statsValue(t, "megacomet_waiting", "gauge", "Connections waiting for a message", waitingNow);
+	statsValue(t, "megacomet_delivered_messages_total", "counter", "Messages sent to clients", deliveredMessages);
+	statsValue(t, "megacomet_delivered_bytes_total", "counter", "Bytes of response bodies sent to clients", deliveredBytes);
+	statsValue(t, "megacomet_empty_responses_total", "counter", "Polls answered with no message", emptyResponses);
+	statsValue(t, "megacomet_queued_messages", "gauge", "Messages waiting for their client to poll", queuedMessages);
+	statsValue(t, "megacomet_queued_bytes", "gauge", "Bytes of messages waiting for their client to poll", queuedBytes);
+	statsValue(t, "megacomet_expired_messages_total", "counter", "Queued messages thrown away after QUEUE_TTL_SECONDS", expiredMessages);
+	statsValue(t, "megacomet_expired_bytes_total", "counter", "Bytes of queued messages thrown away", expiredBytes);
+	statsValue(t, "megacomet_manager_messages_total", "counter", "Client messages from the manager", managerMessages);
+	statsValue(t, "megacomet_channel_messages_total", "counter", "Channel messages from the manager", channelMessages);
+	if (threadNo == 0) { // It's thread 0 that has the manager
+		statsValue(t, "megacomet_manager_reconnects_total", "counter", "Times the manager came back after being lost", managerReconnects);
+		statsValue(t, "megacomet_manager_connected", "gauge", "1 if we're connected to the manager", managerSd >= 0);
+		statsValue(t, "megacomet_thread_messages_total", "counter", "Messages from the manager passed to the thread their client belongs to", threadMessages);
+	}
+	statsValue(t, "megacomet_handoffs_total", "counter", "Clients passed to the worker (or thread) that owns them", handoffs);
+	statsValue(t, "megacomet_partial_writes_total", "counter", "Responses a client only took some of", partialWrites);
+	statsValue(t, "megacomet_write_stalls_total", "counter", "Writes to a client whose socket buffer was full", writeStalls);
+	statsValue(t, "megacomet_output_drops_total", "counter", "Slow clients dropped as their response wouldn't fit in an output buffer", outputDrops);
+	statsValue(t, "megacomet_output_bytes", "gauge", "Bytes waiting in output buffers for slow clients", outputBytes);
+	statsValue(t, "megacomet_client_syscalls_total", "counter", "Syscalls on client sockets, not counting the event loop's wait or io_uring_enter", clientSyscalls);
+	statsValue(t, "megacomet_io_uring", "gauge", "1 if the client sockets are driven through io_uring, 0 for epoll", usingUring);
+	statsValue(t, "megacomet_uring_enters_total", "counter", "io_uring_enter calls", clientRing.enters);
+	statsValue(t, "megacomet_uring_completions_total", "counter", "io_uring completions", clientRing.completions);
+	statsHistogramText(t, "megacomet_queue_wait_seconds", "How long queued messages waited for their client", &queueWait);
+	statsHistogramText(t, "megacomet_loop_seconds", "How long each go round the event loop took, not counting the wait", &loopTime);
+}
+
+// Is it GET /_stats (or /_statsN, for worker N when the workers share a port, and /_stats-T for thread T)?
+int isStatsRequest(const char *clientId, int clientIdLen) {
+	return clientIdLen >= sizeof(STATS_PATH)-1 && !memcmp(clientId, STATS_PATH, sizeof(STATS_PATH)-1);
+}
+
+// Answer a stats request, or pass it to the worker (or thread) it's for. Each thread has its own stats, and one
+// without a thread is thread 0's. Returns 0, like receivedHeaders
+int sendStats(int fd, const char *clientId, int clientIdLen) {
+	const char *number = clientId + sizeof(STATS_PATH)-1, *end = clientId + clientIdLen;
+	const char *dash = memchr(number, '-', end - number);
+	int worker = number < end && number != dash ? atoi(number) : workerNo;
+	int thread = dash ? atoi(dash + 1) : 0;
+	if (worker != workerNo) {
+		// Not ours: if it's down, closing is better than answering for it, so megastart doesn't count us twice
+		if (!SHARED_PORT || worker < 0 || worker >= WORKERS || !handOff(fd, worker, clientId, clientIdLen)) {
+			closeConnectionSkipHash(fd); // It was never parked
+		}
+		return 0;
+	}
+	if (thread != threadNo) {
+		if (thread < 0 || thread >= threadCount || !passClient(fd, thread, clientId, clientIdLen)) {
+			closeConnectionSkipHash(fd);
+		}
+		return 0;
+	}
+	if (conns[fd].requests < KEEP_ALIVE_REQUESTS) {
+		conns[fd].requests++;
+	}
+	if (conns[fd].clientId) {
+		slabFree(&clientIds, conns[fd].clientId);
+		conns[fd].clientId = 0;
+	}
+	static __thread char text[STATS_TEXT_SIZE];
+	statsText t = { text, 0, sizeof(text) };
+	writeStats(&t);
+	char headers[160];
+	struct iovec iov[2];
+	iov[0].iov_base = headers;
+	iov[0].iov_len = snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\nConnection: %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %d\r\n\r\n", keepAlive(fd) ? "keep-alive" : "close", t.len);
+	iov[1].iov_base = text;
+	iov[1].iov_len = t.len;
+	conns[fd].readStatus = SENDING;
+	sendAndFinish(fd, iov, 2, 0);
+	return 0;
+}
+
+// This is called when the headers are received so we can look for a message waiting for
+// this person, or leave them connected until one comes (or LONG_POLL_TIMEOUT_SECONDS passes)
+// The client id is wherever the parser put it. Returns 0 if the connection was closed or answered (and so needs no
+// watching by the caller: if it's kept alive, finishResponse has seen to that)
+int receivedHeaders(int fd, const char *clientId, int clientIdLen) {
+	// printf ("Connected by >%.*s<\r\n", clientIdLen, clientId);
+	if (isStatsRequest(clientId, clientIdLen)) {
+		return sendStats(fd, clientId, clientIdLen);
+	}
+	// Any channels they're listening to come after their id: myClientId~chat~news. They're copied, as the id may be
+	// the connection's own copy, which is freed below
+	char channelList[MAX_CLIENT_ID_LEN];
+	const char *separator = memchr(clientId, CHANNEL_SEPARATOR, clientIdLen);
+	int channelListLen = separator ? clientIdLen - (separator - clientId) : 0;
+	memcpy(channelList, separator, channelListLen);
+	int fullLen = clientIdLen; // With the channels, for handing off
+	clientIdLen -= channelListLen;
+	unsigned int hash = indexHash(clientId, clientIdLen);
+
+	// When the workers share a port, the client may have landed on the wrong one. If so pass them to the right one
+	if (SHARED_PORT) {
+		int owner = hash % WORKERS;
+		if (owner != workerNo && handOff(fd, owner, clientId, fullLen)) {
+			return 0;
+		}
+	}
+
+	// It's the same with threads, as the kernel shares the connections out between their listeners however it likes.
+	// If the owner's too backed up to take them, they're told to poll again
+	int owner = ownerThread(hash);
+	if (owner != threadNo) {
+		if (!passClient(fd, owner, clientId, fullLen)) {
+			sendEmptyResponse(fd);
+		}
+		return 0;
+	}
+
+	if (conns[fd].requests < KEEP_ALIVE_REQUESTS) {
+		conns[fd].requests++;
+	}
+
+	// One lookup for both: is there a message queued for them, and are they already waiting?
+	indexEntry *entry = indexAdd(&clients, clientId, clientIdLen, hash);
+	if (conns[fd].clientId) { // The connection's own copy of the id (if the request was split) isn't needed now it's interned
+		slabFree(&clientIds, conns[fd].clientId);
+		conns[fd].clientId = 0;
+	}
+
+	// If there are messages queued for this person, send them and drop the connection
+	if (entry->messages) {
+		conns[fd].readStatus = SENDING; // They aren't in the index
+		sendQueued(fd, entry);
+		return 0;
+	}
+
+	// If there's no message, then they wait in the index for one
+	if (entry->fd >= 0) {
+		// They already had a poll waiting (eg they reloaded the page). The new one takes its place, so answer the
+		// old one with an empty response
+		int oldFd = entry->fd;
+		entry->fd = fd; // Before answering the old one, so it doesn't take the entry with it
+		sendEmptyResponse(oldFd);
+	}
+	entry->fd = fd;
+	conns[fd].clientId = entry->id;
+	if (channelListLen) {
+		listenToChannels(fd, channelList, channelListLen);
+	}
+	parkedPolls++;
+	waitingNow++;
+	if (CLIENT_QUICKACK) { // Their response could be a long way off, so don't hold their ack back for it
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(int));
+		clientSyscalls++;
+	}
+	wheelAdd(&wheel, fd, wheel.now + LONG_POLL_TIMEOUT_SECONDS*1000/WHEEL_TICK_MS); // Now they're waiting for a message
+	return 1;
+}
+
+// A connection's deadline has passed
+void timedOut(unsigned int fd) {
+	if (conns[fd].readStatus == LINGERING) {
+		finishLinger(fd);
+		return;
+	}
+	if (conns[fd].readStatus == PARSE_DONE) {
+		// They've waited long enough for a message, send them an empty response so they poll again
+		sendEmptyResponse(fd);
+		return;
+	}
+	// Otherwise they're too slow sending the request (or sent half of one and went quiet), or too slow taking
+	// their response, so just drop them
+	resetOnClose(fd);
+	closeConnection(fd);
+}
+
+// Called every WHEEL_TICK_MS to move the timing wheel along, time out whoever's due and clear out old messages
+// At most TIMEOUT_BUDGET connections are dealt with per tick, the rest wait for the next tick
+void wheelCallback(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+	wheelAdvance(&wheel, wheelTicks(loop));
+	wheelExpire(&wheel, TIMEOUT_BUDGET, timedOut);
+	expireQueue();
+}
+
+// Read and parse whatever the client has sent so far
+// Returns 0 if the connection was closed or answered
+int readRequest(int fd) {
+	// Receive message from client socket
+	byte buffer[BUFFER_SIZE];
+	ssize_t read = recv(fd, buffer, BUFFER_SIZE, 0);
+	clientSyscalls++;
+
+	if (read < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 1; // Nothing there yet
+		}
+		logDebug("read error %d", errno);
+		closeConnection(fd);
+		return 0;
+	}
+	if (read == 0) {
+		// Close it if the client socket is closing
+		closeConnection(fd); // TODO is the socket close in this function necessary since the other side closed it anyway?
+		// puts("peer closing");
+		return 0;
+	}
+	return requestArrived(fd, buffer, read);
+}
+
+// Parse some of a request that's arrived, however it was read
+// Returns 0 if the connection was closed or answered
+int requestArrived(int fd, const byte *buffer, int read) {
+	connection *thisClient = &conns[fd];
+	if (isWaiting(fd) || thisClient->readStatus == SENDING) {
+		// Already have their request, so ignore anything else they send while waiting (or with io_uring, while their
+		// response is still going). We don't do pipelining, so if that's their next request, the connection closes
+		// after this response rather than lose track of where it's up to
+		thisClient->requests = KEEP_ALIVE_REQUESTS;
+		return 1;
+	}
+
+	// Parse what we have so far. The client id goes into a buffer on the stack, unless an earlier read already
+	// had the start of it, in which case it's in clientIds
+	char id[MAX_CLIENT_ID_LEN+1];
+	char *clientId = thisClient->clientId ? slabPtr(&clientIds, thisClient->clientId) : id;
+	int status = thisClient->readStatus, clientIdLen = thisClient->clientIdLen, used, close = 0;
+	int result = parseRequest(&status, clientId, &clientIdLen, buffer, read, &used, &close);
+	thisClient->readStatus = status;
+	thisClient->clientIdLen = clientIdLen;
+	if (close) { // They've asked to be closed after this response
+		thisClient->requests = KEEP_ALIVE_REQUESTS;
+	}
+	if (result == PARSE_ERROR) {
+		parseErrors++;
+		// drop the connection, they might be trying to access the favicon or something annoying like that
+		// puts ("Not a .js request!");
+		closeConnection(fd);
+		return 0;
+	}
+	if (result == PARSE_COMPLETE) {
+		requestsParsed++;
+		if (used < read) { // They've sent more after the request, which gets thrown away, so close after this one too
+			thisClient->requests = KEEP_ALIVE_REQUESTS;
+		}
+		return receivedHeaders(fd, clientId, clientIdLen); // Now we can respond
+	}
+	if (!thisClient->clientId && status != PARSE_START) {
+		// Keep the id for the next read. If the read ended part way through it, leave room for the rest
+		thisClient->clientId = slabAlloc(&clientIds, (status == PARSE_CLIENT_ID ? MAX_CLIENT_ID_LEN : clientIdLen) + 1);
+		memcpy(slabPtr(&clientIds, thisClient->clientId), id, clientIdLen+1);
+	}
+	return 1;
 }
@@ -0,0 +1,200 @@
+// MegaComet client index
+// One hash table of every client id the worker knows about, either because a connection is waiting for that client's
+// messages or because messages are queued for it. Both live in the one entry, so a connect or a delivery is a single
+// lookup. The ids are interned in a slab (megaslab.h) with their length in front, and the entry has the hash too,
+// so a lookup only looks at an id once the hashes match, and then it's a memcmp.
+// It's laid out like a swiss table: the entries are in groups of 16, and each has a control byte, which is either
+// empty, deleted, or 7 bits of the entry's hash. A lookup compares all 16 control bytes of a group against the hash in
+// one go with SSE2, so it normally only touches the one entry it's after. Groups are probed triangularly.
+
+#ifndef _MEGAINDEX_H
+#define _MEGAINDEX_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "megaslab.h"
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define INDEX_GROUP 16 // Entries per group
+#define INDEX_EMPTY ((signed char)0x80) // Control byte of a slot that's never been used (since the last resize)
+#define INDEX_DELETED ((signed char)0xfe) // Control byte of a slot that's been used. Keeps probes going past it
+
+typedef struct indexEntry {
+	unsigned int hash; // X31 hash of the id
+	unsigned int id; // The interned id: length byte, then the id, then a null
+	int fd; // The connection waiting for this client's messages, -1 = none
+	unsigned int messages; // The newest message queued for this client, 0 = none. The worker keeps them in a circular list, so its next is the oldest
+} indexEntry; // 16 bytes
+
+typedef struct clientIndex {
+	signed char *ctrl; // A control byte per slot
+	indexEntry *entries;
+	unsigned int groups; // Always a power of 2
+	unsigned int count; // Entries in use
+	unsigned int deleted; // Slots marked deleted
+	slabStore *ids; // Where the ids are interned
+} clientIndex;
+
+// The hash of a client id. It's the same X31 as the manager (and khash) use, so it also says which worker owns the client
+static inline unsigned int indexHash(const char *id, int len) {
+	unsigned int h = 0;
+	for (int i=0; i<len; i++) {
+		h = (h << 5) - h + (unsigned char)id[i];
+	}
+	return h;
+}
+
+// X31 on its own is a weak hash, so mix it before taking the group and the 7 control bits from it
+static inline unsigned long long indexMix(unsigned int hash) {
+	return hash * 0x9e3779b97f4a7c15ull;
+}
+static inline unsigned int indexGroup(clientIndex *ix, unsigned long long mixed) {
+	return (unsigned int)(mixed >> 25) & (ix->groups - 1);
+}
+static inline signed char indexTag(unsigned long long mixed) {
+	return (signed char)(mixed >> 57);
+}
+
+// Which of a group's control bytes equal 'c', as a bit mask
+static inline unsigned int indexMatch(const signed char *ctrl, signed char c) {
+#if defined(__SSE2__)
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)ctrl), _mm_set1_epi8(c)));
+#else
+	unsigned int mask = 0;
+	for (int i=0; i<INDEX_GROUP; i++) {
+		if (ctrl[i] == c) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// An entry's id, and its length
+static inline char *indexKey(clientIndex *ix, indexEntry *e) {
+	return slabPtr(ix->ids, e->id) + 1;
+}
+static inline int indexKeyLen(clientIndex *ix, indexEntry *e) {
+	return (unsigned char)slabPtr(ix->ids, e->id)[0];
+}
+
+// Make the arrays for a number of groups, all empty
+static inline void indexAllocate(clientIndex *ix, unsigned int groups) {
+	ix->groups = groups;
+	ix->ctrl = malloc(groups * INDEX_GROUP);
+	memset(ix->ctrl, INDEX_EMPTY, groups * INDEX_GROUP);
+	ix->entries = malloc(groups * INDEX_GROUP * sizeof(indexEntry));
+	ix->count = 0;
+	ix->deleted = 0;
+}
+
+static inline void indexInit(clientIndex *ix, slabStore *ids) {
+	ix->ids = ids;
+	indexAllocate(ix, 1);
+}
+
+// The first slot in the probe sequence that isn't in use, for inserting
+static inline unsigned int indexFreeSlot(clientIndex *ix, unsigned long long mixed) {
+	unsigned int g = indexGroup(ix, mixed);
+	for (unsigned int step=1; ; step++) {
+		unsigned int free = indexMatch(ix->ctrl + g*INDEX_GROUP, INDEX_EMPTY) | indexMatch(ix->ctrl + g*INDEX_GROUP, INDEX_DELETED);
+		if (free) {
+			return g*INDEX_GROUP + __builtin_ctz(free);
+		}
+		g = (g + step) & (ix->groups - 1);
+	}
+}
+
+// Move everything into twice as many groups (or the same number, if it's mostly deleted slots that have filled it)
+static inline void indexResize(clientIndex *ix) {
+	signed char *oldCtrl = ix->ctrl;
+	indexEntry *oldEntries = ix->entries;
+	unsigned int oldSlots = ix->groups * INDEX_GROUP, count = ix->count;
+	indexAllocate(ix, ix->deleted > count/2 ? ix->groups : ix->groups*2);
+	for (unsigned int i=0; i<oldSlots; i++) {
+		if (oldCtrl[i] >= 0) { // In use. The stored hash means the ids don't need looking at
+			unsigned long long mixed = indexMix(oldEntries[i].hash);
+			unsigned int slot = indexFreeSlot(ix, mixed);
+			ix->ctrl[slot] = indexTag(mixed);
+			ix->entries[slot] = oldEntries[i];
+		}
+	}
+	ix->count = count;
+	free(oldCtrl);
+	free(oldEntries);
+}
+
+// Find a client's entry, or NULL
+static inline indexEntry *indexFind(clientIndex *ix, const char *id, int len, unsigned int hash) {
+	unsigned long long mixed = indexMix(hash);
+	signed char tag = indexTag(mixed);
+	unsigned int g = indexGroup(ix, mixed);
+	for (unsigned int step=1; ; step++) {
+		const signed char *ctrl = ix->ctrl + g*INDEX_GROUP;
+		for (unsigned int match = indexMatch(ctrl, tag); match; match &= match - 1) {
+			indexEntry *e = &ix->entries[g*INDEX_GROUP + __builtin_ctz(match)];
+			if (e->hash == hash) {
+				const char *key = slabPtr(ix->ids, e->id);
+				if ((unsigned char)key[0] == len && !memcmp(key+1, id, len)) {
+					return e;
+				}
+			}
+		}
+		if (indexMatch(ctrl, INDEX_EMPTY)) {
+			return NULL; // A probe for it would have stopped here
+		}
+		g = (g + step) & (ix->groups - 1);
+	}
+}
+
+// Find a client's entry, or add one (with no connection or messages) if they haven't got one.
+// Adding may move the other entries, so don't hang on to entry pointers across it
+static inline indexEntry *indexAdd(clientIndex *ix, const char *id, int len, unsigned int hash) {
+	indexEntry *e = indexFind(ix, id, len, hash);
+	if (e) {
+		return e;
+	}
+	if ((ix->count + ix->deleted + 1) * 8 > ix->groups * INDEX_GROUP * 7) { // Keep it under 7/8ths full
+		indexResize(ix);
+	}
+	unsigned long long mixed = indexMix(hash);
+	unsigned int slot = indexFreeSlot(ix, mixed);
+	if (ix->ctrl[slot] == INDEX_DELETED) {
+		ix->deleted--;
+	}
+	ix->ctrl[slot] = indexTag(mixed);
+	ix->count++;
+	e = &ix->entries[slot];
+	e->hash = hash;
+	e->id = slabAlloc(ix->ids, len + 2);
+	char *key = slabPtr(ix->ids, e->id);
+	key[0] = len;
+	memcpy(key+1, id, len);
+	key[len+1] = 0;
+	e->fd = -1;
+	e->messages = 0;
+	return e;
+}
+
+// Find the entry for an interned id we got from an earlier lookup
+static inline indexEntry *indexFindId(clientIndex *ix, unsigned int id) {
+	const char *key = slabPtr(ix->ids, id);
+	int len = (unsigned char)key[0];
+	return indexFind(ix, key+1, len, indexHash(key+1, len));
+}
+
+// Remove an entry, and free its id
+static inline void indexDel(clientIndex *ix, indexEntry *e) {
+	unsigned int slot = e - ix->entries;
+	slabFree(ix->ids, e->id);
+	// If the group has an empty slot, no probe ever went past it, so this slot can be empty too
+	if (indexMatch(ix->ctrl + (slot & ~(INDEX_GROUP-1)), INDEX_EMPTY)) {
+		ix->ctrl[slot] = INDEX_EMPTY;
+	} else {
+		ix->ctrl[slot] = INDEX_DELETED;
+		ix->deleted++;
+	}
+	ix->count--;
+}
+
+#endif
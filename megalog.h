@@ -0,0 +1,289 @@
+// MegaComet logging
+// Logging from the event loop mustn't cost the loop a write to stdout each time, so a log call only puts a record in
+// a ring, and a writer thread formats them and writes them out. A record is binary: the format string (which has to be
+// a literal, so only the pointer is kept), then each argument as a raw 64-bit word, with the strings copied into the
+// record (as the caller's buffer may have changed by the time the writer gets to it). Each thread that logs gets its
+// own ring the first time it does, so a ring has the one producer (an event loop thread) and the one consumer (the
+// writer), and needs no lock, just the two indexes. The writer empties the rings in turn, so lines from different
+// threads can come out of order by up to LOG_FLUSH_MS. If a ring fills up, log calls are dropped and counted rather
+// than wait.
+// Levels are checked twice: against LOG_LEVEL at compile time, so more detailed calls compile to nothing, and against
+// logLevel at run time (from the MEGACOMET_LOG environment variable), which is a load and a compare. Each call site is
+// also limited to LOG_RATE_LIMIT records a second, so one that fires per message or per connection can be left in.
+
+#ifndef _MEGALOG_H
+#define _MEGALOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "config.h"
+
+#define LOG_ERROR 1 // Levels
+#define LOG_WARN 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+#define LOG_ARGS 8 // The most arguments a log call can have (a '*' width or precision counts as one)
+#define LOG_TEXT 160 // Room in each record for its string arguments. Longer ones are cut short
+#define LOG_FLUSH_MS 50 // How long the writer sleeps when the rings are empty
+#define LOG_THREADS 64 // The most threads that can log. Any more have their log calls dropped
+
+typedef struct logRecord {
+	struct timespec time;
+	const char *format;
+	unsigned char level;
+	unsigned char textLen; // How much of text is used
+	unsigned int suppressed; // How many calls from the same site were rate limited since the last one that got in
+	unsigned long args[LOG_ARGS]; // Each argument's bits. A string's is its offset in text
+	char text[LOG_TEXT];
+} logRecord; // 256 bytes
+
+typedef struct logSite {
+	time_t second; // The second it's counting calls for
+	unsigned int count; // Calls that got in during that second
+	unsigned int suppressed; // Calls that didn't since the last one that did
+} logSite;
+
+typedef struct logBuffer {
+	logRecord ring[LOG_RING_SIZE];
+	unsigned int head, tail; // Written by the producer and the writer respectively, read by the other
+	unsigned long dropped; // Records lost to a full ring
+} logBuffer;
+
+static logBuffer *logBuffers[LOG_THREADS]; // A ring for each thread that's logged, in the order they started
+static int logBufferCount; // Only changed or read with logWriting held
+static __thread logBuffer *logMine; // This thread's, once it's logged something
+static int logLevel = LOG_LEVEL; // The most detailed level that's logged
+static const char *logName = ""; // Goes at the start of every line, to tell the processes apart
+static pthread_mutex_t logWriting = PTHREAD_MUTEX_INITIALIZER; // Between the writer thread and logFlush at exit
+
+// Log something at a level, printf style. The format has to be a string literal. The rate limit's per thread
+#define logAt(level, ...) do { \
+	if ((level) <= LOG_LEVEL && (level) <= logLevel) { \
+		static __thread logSite site; \
+		logWrite(&site, (level), __VA_ARGS__); \
+	} \
+} while (0)
+#define logError(...) logAt(LOG_ERROR, __VA_ARGS__)
+#define logWarn(...) logAt(LOG_WARN, __VA_ARGS__)
+#define logInfo(...) logAt(LOG_INFO, __VA_ARGS__)
+#define logDebug(...) logAt(LOG_DEBUG, __VA_ARGS__)
+
+// Skip over the flags, width, precision and length of a conversion, counting the '*'s. Returns the conversion letter
+static inline const char *logConversion(const char *p, int *stars, int *isLong) {
+	*stars = 0;
+	*isLong = 0;
+	while (*p && strchr("-+ #0123456789.*hlLqjzt", *p)) {
+		*stars += *p == '*';
+		*isLong |= *p == 'l' || *p == 'L' || *p == 'q' || *p == 'j' || *p == 'z' || *p == 't';
+		p++;
+	}
+	return p;
+}
+
+// Give this thread a ring of its own, for the writer to find. Once per thread, so the lock doesn't matter
+static inline logBuffer *logAttach(void) {
+	logBuffer *b = NULL;
+	pthread_mutex_lock(&logWriting);
+	if (logBufferCount < LOG_THREADS && (b = calloc(1, sizeof(logBuffer)))) {
+		logBuffers[logBufferCount++] = b;
+	}
+	pthread_mutex_unlock(&logWriting);
+	return b;
+}
+
+// Put a record in the thread's ring, going by the format for what each argument is. Called from logAt once the
+// level's passed
+static inline void logWrite(logSite *site, int level, const char *format, ...) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now); // Good enough for the rate limit, and much quicker
+	if (now.tv_sec != site->second) {
+		site->second = now.tv_sec;
+		site->count = 0;
+	}
+	if (site->count >= LOG_RATE_LIMIT) {
+		site->suppressed++;
+		return;
+	}
+	site->count++;
+	logBuffer *b = logMine;
+	if (!b && !(b = logMine = logAttach())) {
+		return;
+	}
+	unsigned int head = b->head;
+	if (head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+		b->dropped++;
+		return;
+	}
+	logRecord *r = &b->ring[head & (LOG_RING_SIZE-1)];
+	clock_gettime(CLOCK_REALTIME, &r->time);
+	r->format = format;
+	r->level = level;
+	r->textLen = 0;
+	r->suppressed = site->suppressed;
+	site->suppressed = 0;
+
+	va_list ap;
+	va_start(ap, format);
+	int n = 0;
+	for (const char *p = strchr(format, '%'); p; p = strchr(p, '%')) {
+		int stars, isLong, precision = -1;
+		const char *conv = p+1;
+		p = logConversion(conv, &stars, &isLong);
+		if (*p == '%' || !*p) {
+			p += !!*p;
+			continue;
+		}
+		int fits = n + stars + 1 <= LOG_ARGS; // If not, it's read and thrown away, and the rest come out as '?'
+		for (; stars; stars--) {
+			int star = va_arg(ap, int);
+			precision = star; // Only matters if it's the last one, and a ".*"
+			if (fits) r->args[n++] = star;
+		}
+		unsigned long arg;
+		if (*p == 's') { // Copy as much as fits, with a null on the end
+			const char *s = va_arg(ap, const char*);
+			int room = LOG_TEXT - 1 - r->textLen;
+			if (p - conv >= 2 && p[-2] == '.' && p[-1] == '*' && precision >= 0 && precision < room) {
+				room = precision; // A "%.*s" string needn't have a null on the end
+			}
+			int len = fits ? strnlen(s, room) : 0;
+			memcpy(r->text + r->textLen, s, len);
+			arg = r->textLen;
+			r->textLen += len;
+			r->text[r->textLen++] = 0;
+			if (r->textLen >= LOG_TEXT) {
+				r->textLen = LOG_TEXT - 1; // Full, any more strings will be empty
+			}
+		} else if (strchr("fFeEgGaA", *p)) {
+			double d = va_arg(ap, double);
+			memcpy(&arg, &d, sizeof(arg));
+		} else if (*p == 'p') {
+			arg = (unsigned long)va_arg(ap, void*);
+		} else {
+			arg = isLong ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+		}
+		if (fits) {
+			r->args[n++] = arg;
+		} else {
+			n = LOG_ARGS;
+		}
+		p++;
+	}
+	va_end(ap);
+	__atomic_store_n(&b->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Add to a line being formatted, keeping the last byte of it for the newline
+static inline void logAppend(char *line, int size, int *len, const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	*len += vsnprintf(line + *len, size - 1 - *len, format, ap);
+	va_end(ap);
+	if (*len > size - 2) {
+		*len = size - 2;
+	}
+}
+
+// Turn a record back into a line of text, going through the format a conversion at a time. Returns its length
+static inline int logFormat(logRecord *r, char *line, int size) {
+	static const char *levels[] = { "", "ERROR", "WARN", "INFO", "DEBUG" };
+	struct tm tm;
+	localtime_r(&r->time.tv_sec, &tm);
+	int len = strftime(line, size, "%Y-%m-%d %H:%M:%S", &tm);
+	logAppend(line, size, &len, ".%03ld %s %s ", r->time.tv_nsec / 1000000, logName, levels[r->level]);
+	int n = 0;
+	const char *p = r->format;
+	for (const char *pc = strchr(p, '%'); pc; pc = strchr(p, '%')) {
+		logAppend(line, size, &len, "%.*s", (int)(pc-p), p);
+		int stars, isLong;
+		const char *conv = logConversion(pc+1, &stars, &isLong);
+		p = conv + !!*conv;
+		if (*conv == '%' || !*conv) {
+			logAppend(line, size, &len, "%%");
+			continue;
+		}
+		if (n + stars + 1 > LOG_ARGS) {
+			logAppend(line, size, &len, "?");
+			n = LOG_ARGS;
+			continue;
+		}
+		char spec[32];
+		snprintf(spec, sizeof(spec), "%.*s", (int)(conv-pc+1), pc);
+		int star[2] = {0, 0};
+		for (int i=0; i<stars; i++) {
+			star[i&1] = (int)r->args[n++];
+		}
+		unsigned long arg = r->args[n++];
+		double d;
+		memcpy(&d, &arg, sizeof(d));
+		#define logOne(value) (stars == 0 ? logAppend(line, size, &len, spec, value) : stars == 1 ? \
+			logAppend(line, size, &len, spec, star[0], value) : logAppend(line, size, &len, spec, star[0], star[1], value))
+		if (*conv == 's') logOne(r->text + arg);
+		else if (strchr("fFeEgGaA", *conv)) logOne(d);
+		else if (*conv == 'p') logOne((void*)arg);
+		else if (isLong) logOne(arg);
+		else logOne((unsigned int)arg);
+		#undef logOne
+	}
+	logAppend(line, size, &len, "%s", p);
+	if (r->suppressed) {
+		logAppend(line, size, &len, " (and %u more like it)", r->suppressed);
+	}
+	line[len++] = '\n';
+	return len;
+}
+
+// Write out everything in the rings
+static inline void logFlush(void) {
+	pthread_mutex_lock(&logWriting);
+	char lines[8192];
+	int len = 0;
+	for (int i=0; i<logBufferCount; i++) {
+		logBuffer *b = logBuffers[i];
+		unsigned int tail = b->tail, head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			if (len > sizeof(lines) - 1024) {
+				fwrite(lines, 1, len, stdout);
+				len = 0;
+			}
+			len += logFormat(&b->ring[tail & (LOG_RING_SIZE-1)], lines+len, 1024);
+			__atomic_store_n(&b->tail, tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+	fwrite(lines, 1, len, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&logWriting);
+}
+
+// The writer thread: empty the rings, then have a nap
+static inline void *logWriter(void *unused) {
+	for (;;) {
+		logFlush();
+		usleep(LOG_FLUSH_MS * 1000);
+	}
+	return NULL;
+}
+
+// Start logging. Takes the level from MEGACOMET_LOG (a number, or error/warn/info/debug) if it's set
+static inline void logInit(const char *name) {
+	static const char *names[] = { "off", "error", "warn", "info", "debug" };
+	logName = name;
+	const char *env = getenv("MEGACOMET_LOG");
+	if (env) {
+		logLevel = atoi(env);
+		for (int l=0; l<=LOG_DEBUG; l++) {
+			if (!strcmp(env, names[l])) logLevel = l;
+		}
+	}
+	pthread_t writer;
+	pthread_create(&writer, NULL, logWriter, NULL);
+	pthread_detach(writer);
+	atexit(logFlush); // So whatever it logged on the way out gets written
+}
+
+#endif
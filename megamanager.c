@@ -9,32 +9,100 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 
-#include "khash.h"
 #include <ev.h>
+#include "khash.h"
 #include "config.h"
+#include "megalog.h"
+#include "megawire.h"
+#include "megaring.h"
+#include "megastats.h"
 
 // Useful utilities
 typedef unsigned char byte;
 
 // Globals (i know, globals are yuck, but we're going for speed not beauty in this code...)
 int managerSd; // The listening socket file descriptors
+int localSd = -1; // The unix socket workers on this box connect to, to get a shared ring (SHARED_RING mode)
 struct ev_loop *libEvLoop; // The main libev loop. Global so that we don't have to pass it around everywhere
 typedef struct connection {
+	struct ev_io watcher; // Reading from it
 	int socket; // File descriptor
-	int readStatus; // For parsing the input bytes
+	int readStatus; // For parsing the input bytes, in protocol version 1
 	int workerNo; // Which worker number it is (0-7) or -1 if not a worker
+	int version; // Which protocol it's talking, 1 until it says hello
+	byte *buffer; // What's been received. In version 2, anything left after parsing is the start of a frame
+	int buffered; // How much of that is waiting for the rest of its frame
+	int local; // It connected on the unix socket, so it's on this box
+	int sender; // It's an app that's sent us messages, so it's paused while a worker's behind
+	sharedRing *ring; // Where its messages go, if it's a worker that took a shared ring
 	byte appClientId[MAX_CLIENT_ID_LEN+1]; // The client id for an incoming message from the app (+1 for null term)
 	int appClientIdLen;
 	byte appMessage[MAX_MESSAGE_LEN+1]; // The message for an incoming message from the app (+1 for null term)
 	int appMessageLen;
+	byte *output; // What a worker's socket (or ring) wouldn't take yet, from outputSent to outputLen. Malloc'd when first needed
+	int outputSent, outputLen, outputSize;
+	int outputFrame; // Where the first whole frame in output starts, as the one before it may be partly sent (version 2)
+	struct ev_io drainWatcher; // Waits for room in its socket (or ring) while there's output
 } connection;
-connection conn[MAX_MANAGER_CONNS]; // Just using an array not a hash because its quicker for small lists
+// The connections, indexed by their fd, so finding the one that's readable is a lookup. Like the workers' connection
+// table it's sized from the open files limit, but the kernel hands out the lowest free fd, so it's only ever backed by
+// memory as far as the few we use
+connection **conn;
+int maxFds;
+int fdsUsed; // One past the highest fd we've had a connection on
 int conns = 0;
-byte forwardingBuf[MAX_CLIENT_ID_LEN+MAX_MESSAGE_LEN+3]; // For the message forwarding to use
+connection *workerConn[WORKERS]; // Each worker's connection, or NULL if it's not connected
+int appsPaused; // We've stopped reading from the apps that send messages, as a worker has more than MANAGER_OUTPUT_HIGH waiting for it
+typedef struct workerOutput {
+	byte data[WIRE_HEADER + WIRE_BATCH_SIZE]; // The messages going to a worker, after room for the batch frame's header
+	int len; // How much there is after the header
+	byte channelFrames[WIRE_BATCH_SIZE]; // Channel messages going to it, each its own frame
+	int channelLen;
+} workerOutput;
+workerOutput pending[WORKERS]; // Messages for each worker, sent when we've read all there is from the app (or it's full)
+byte forwardingBuf[WIRE_HEADER+MAX_CLIENT_ID_LEN+MAX_MESSAGE_LEN+3]; // For a message too big to go in a batch
+typedef struct workerSpool {
+	byte *data; // Frames for the worker while it's not connected, each after the time it arrived (4 bytes). Malloc'd when first needed
+	int len;
+	unsigned long dropped; // Messages that didn't fit
+} workerSpool;
+workerSpool spools[WORKERS]; // Sent to each worker when it says hello again
+KHASH_MAP_INIT_STR(channels, unsigned int);
+khash_t(channels) *channels; // Which workers have someone listening to each channel, a bit per worker
+connection *readingConn; // The connection whose frames are being parsed, for the channel subscriptions and stats requests
+
+// Stats (see megastats.h), for a WIRE_STATS frame
+unsigned long forwardedMessages, forwardedBytes; // Client messages passed on to their worker, including replayed ones
+unsigned long channelMessages; // Channel messages from the app
+unsigned long spooledMessages; // Messages kept for a worker that wasn't connected
+unsigned long spoolDrops; // And ones that didn't fit
+unsigned long spoolExpired; // Spooled too long ago to be worth replaying
+unsigned long replayedMessages; // Sent on from the spool when their worker came back
+unsigned long workerWrites, workerWriteBytes; // Writes (or ring writes) to the workers
+unsigned long workerWriteErrors;
+unsigned long workerStalls; // Times a worker's socket (or ring) was too full to take everything
+unsigned long workerOutputDrops; // Bytes that were waiting for a worker when it went away, and couldn't be spooled
+unsigned long appPauses; // Times we stopped reading from the apps, as a worker wasn't keeping up
+unsigned long badFrames; // Connections closed for sending a frame we couldn't make sense of
+statsHistogram loopTime; // How long each go round the event loop takes, not counting the wait
+double loopStart;
+
+#if WORKERS > 32
+#error "A channel only has a bit per worker"
+#endif
 
 void newConnectionCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
 void readCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void drainCallback(struct ev_loop *loop, struct ev_io *watcher, int revents);
+void flushWorkers();
+void spoolFrame(int worker, int type, const char *id, int idLen, const char *payload, int len);
+void replaySpool(int worker);
 
 // Open the listening socket for incoming worker connections
 void openManagerSocket(void) {
@@ -76,10 +144,48 @@ void openManagerSocket(void) {
 	// puts("Socket opened");
 }
 
+// Open the unix socket for workers on this box, that can have a shared ring
+void openLocalSocket(void) {
+	localSd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (localSd < 0) {
+		perror("local socket error");
+		exit(1);
+	}
+	struct sockaddr_un addr;
+	socklen_t addrLen = ringSocketAddress(&addr);
+	if (bind(localSd, (struct sockaddr*) &addr, addrLen) < 0 || listen(localSd, LISTEN_BACKLOG) < 0) {
+		perror("local socket bind error (is the manager already running?)");
+		exit(1);
+	}
+}
+
 // All the setup stuff goes here
 void setup() {
-	puts("MegaComet Manager");
+	logInit("manager");
+	logInfo("MegaComet Manager");
+	signal(SIGPIPE, SIG_IGN); // Writing to a worker that's just gone should be an error, not kill the manager
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	maxFds = limit.rlim_cur < MAX_CONNECTIONS ? limit.rlim_cur : MAX_CONNECTIONS;
+	conn = calloc(maxFds, sizeof(connection*));
+	channels = kh_init(channels);
 	openManagerSocket();
+	if (SHARED_RING) {
+		openLocalSocket();
+	}
+}
+
+// Time each go round the event loop, from when the wait's over to when it's about to wait again
+void loopStartCallback(struct ev_loop *loop, struct ev_check *watcher, int revents) {
+	loopStart = statsNowUs();
+}
+
+// Each go round, once everything that's ready has been read, the workers are sent what's pending for them
+void loopEndCallback(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+	flushWorkers();
+	if (loopStart) {
+		statsRecord(&loopTime, statsNowUs() - loopStart);
+	}
 }
 
 // The main libev loop
@@ -91,8 +197,21 @@ void run() {
 	struct ev_io managerPortWatcher;
 	ev_io_init(&managerPortWatcher, newConnectionCallback, managerSd, EV_READ);
 	ev_io_start(libEvLoop, &managerPortWatcher);
+	struct ev_io localWatcher;
+	if (SHARED_RING) {
+		ev_io_init(&localWatcher, newConnectionCallback, localSd, EV_READ);
+		ev_io_start(libEvLoop, &localWatcher);
+	}
 
-	puts("Libev initialised, starting...");
+	// Time each go round the loop, for the stats
+	struct ev_check loopStartWatcher;
+	struct ev_prepare loopEndWatcher;
+	ev_check_init(&loopStartWatcher, loopStartCallback);
+	ev_check_start(libEvLoop, &loopStartWatcher);
+	ev_prepare_init(&loopEndWatcher, loopEndCallback);
+	ev_prepare_start(libEvLoop, &loopEndWatcher);
+
+	logInfo("Libev initialised, starting...");
 
 	// Start infinite loop
 	ev_loop(libEvLoop, 0);
@@ -115,7 +234,7 @@ int main(int argc, char **args) {
 // Accept client requests
 void newConnectionCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 	if (EV_ERROR & revents) {
-		puts("got invalid event");
+		logError("got invalid event");
 		return;
 	}
 
@@ -125,176 +244,751 @@ void newConnectionCallback(struct ev_loop *loop, struct ev_io *watcher, int reve
 	int client_sd = accept(watcher->fd, (struct sockaddr *)&client_addr, &client_len);
 
 	if (client_sd < 0) {
-		puts("accept error");
+		logError("accept error");
 		return;
 	}
 
-	// Set it up in the connections list
-	if (conns >= MAX_MANAGER_CONNS) {
+	// Set it up in the connections table
+	if (conns >= MAX_MANAGER_CONNS || client_sd >= maxFds) {
 		// Too many
-		puts("Too many connections");
+		logWarn("Too many connections");
 		close(client_sd);
 		return;
 	}
-	memset(&conn[conns], 0, sizeof(connection));
-	conn[conns].socket = client_sd;
-	conn[conns].readStatus = 0;
-	conn[conns].workerNo = -1;
+	connection *c = calloc(1, sizeof(connection));
+	c->socket = client_sd;
+	c->readStatus = 0;
+	c->workerNo = -1;
+	c->version = 1;
+	c->buffer = malloc(MANAGER_BUFFER_SIZE);
+	c->local = watcher->fd == localSd;
+	conn[client_sd] = c;
 	conns++;
+	if (client_sd >= fdsUsed) {
+		fdsUsed = client_sd + 1;
+	}
+
+	// Start watching it to read client requests
+	ev_io_init(&c->watcher, readCallback, client_sd, EV_READ);
+	ev_io_start(loop, &c->watcher);
+}
+
+// How much a worker's link hasn't taken yet
+#define outputWaiting(c) ((c)->outputLen - (c)->outputSent)
+// The length of the (version 2) frame at p
+#define frameSize(p) (WIRE_HEADER + (p)[1] + wireGetLength((p) + 2))
+
+// Stop (or start again) reading from the apps, while a worker's not keeping up with what they're sending it. Only the
+// ones that have sent messages, so the workers and anyone asking for the stats can still be heard
+void pauseApps(int pause) {
+	appsPaused = pause;
+	for (int fd=0; fd<fdsUsed; fd++) {
+		connection *c = conn[fd];
+		if (c && c->sender) {
+			if (pause) {
+				ev_io_stop(libEvLoop, &c->watcher);
+			} else {
+				ev_io_start(libEvLoop, &c->watcher);
+			}
+		}
+	}
+}
 
-	// Initialize and start watcher to read client requests
-	struct ev_io *watcherRead = calloc (1, sizeof(struct ev_io));
-	ev_io_init(watcherRead, readCallback, client_sd, EV_READ);
-	ev_io_start(loop, watcherRead);
+// Stop reading from the apps when a worker has more than MANAGER_OUTPUT_HIGH waiting for it, and start again when
+// they've all caught up to MANAGER_OUTPUT_LOW. The gap between the two is so it's not on and off with every write
+void checkWorkersBehind() {
+	int most = 0;
+	for (int w=0; w<WORKERS; w++) {
+		if (workerConn[w] && outputWaiting(workerConn[w]) > most) {
+			most = outputWaiting(workerConn[w]);
+		}
+	}
+	if (!appsPaused && most > MANAGER_OUTPUT_HIGH) {
+		appPauses++;
+		logWarn("A worker has %d bytes waiting for it, not reading from the apps till it catches up", most);
+		pauseApps(1);
+	} else if (appsPaused && most <= MANAGER_OUTPUT_LOW) {
+		logInfo("The workers have caught up, reading from the apps again");
+		pauseApps(0);
+	}
 }
 
-// Close a connection and free the memory associated
-void closeConnection(struct ev_io *watcher, int iconn) {
-	ev_io_stop(libEvLoop, watcher); // Tell libev to stop following it
-	close(watcher->fd); // Close the socket
+// Put the frames in some of a worker's output in its spool, through wireParse
+int spoolingWorker;
+void spoolMessage(const char *id, int idLen, const char *message, int len) {
+	spoolFrame(spoolingWorker, WIRE_MESSAGE, id, idLen, message, len);
+}
+void spoolOther(int type, const char *id, int idLen, const char *payload, int len) {
+	spoolFrame(spoolingWorker, type, id, idLen, payload, len);
+}
 
-	// Remove the client status from the array
-	if (iconn < conns-1) { // Do we need to shuffle the last entry to this position?		
-		memcpy(&conn[iconn], &conn[conns-1], sizeof(connection));
+// Close a connection and free the memory associated. If it's a worker's link, the frames it never took, and what's
+// pending for it, go in its spool, to be sent when it's back. Only a frame it took part of is lost, or with version 1
+// (which isn't in frames), all of it
+void closeConnection(connection *c) {
+	ev_io_stop(libEvLoop, &c->watcher); // Tell libev to stop following it
+	ev_io_stop(libEvLoop, &c->drainWatcher);
+	close(c->socket); // Close the socket
+	int worker = c->workerNo, dropped = 0;
+	if (worker >= 0 && worker < WORKERS) {
+		spoolingWorker = worker;
+		workerOutput *out = &pending[worker];
+		int current = workerConn[worker] == c;
+		if (current) {
+			workerConn[worker] = NULL;
+		}
+		if (c->version < 2) {
+			dropped = outputWaiting(c) + (current ? out->len + out->channelLen : 0);
+		} else {
+			dropped = c->outputFrame - c->outputSent;
+			wireParse(c->output + c->outputFrame, c->outputLen - c->outputFrame, spoolMessage, spoolOther);
+			if (current && out->len) {
+				wireHeader(out->data, WIRE_BATCH, 0, out->len);
+				wireParse(out->data, WIRE_HEADER + out->len, spoolMessage, spoolOther);
+			}
+			if (current) {
+				wireParse(out->channelFrames, out->channelLen, spoolMessage, spoolOther);
+			}
+		}
+		if (current) {
+			out->len = out->channelLen = 0;
+		} else if (workerConn[worker]) {
+			replaySpool(worker); // It's already back on another connection, so it gets them there
+		}
+	}
+	if (dropped) {
+		workerOutputDrops += dropped;
+		logWarn("Worker %d went away with %d bytes waiting for it that couldn't be spooled, dropped", worker, dropped);
+	}
+	free(c->buffer);
+	free(c->output);
+	if (c->ring) {
+		ringClose(c->ring);
+		free(c->ring);
 	}
+	conn[c->socket] = NULL;
 	conns--;
+	free(c);
+	checkWorkersBehind(); // It might have been the one that's behind
+}
+
+// Keep what a worker's link wouldn't take, after anything that's already waiting
+void queueOutput(connection *c, const byte *data, int len) {
+	if (c->outputLen + len > c->outputSize && c->outputSent) { // Move what's waiting back to the start first
+		memmove(c->output, c->output + c->outputSent, outputWaiting(c));
+		c->outputLen -= c->outputSent;
+		c->outputFrame -= c->outputSent;
+		c->outputSent = 0;
+	}
+	if (c->outputLen + len > c->outputSize) {
+		c->outputSize = c->outputLen + len > 2*c->outputSize ? c->outputLen + len : 2*c->outputSize;
+		c->output = realloc(c->output, c->outputSize);
+	}
+	memcpy(c->output + c->outputLen, data, len);
+	c->outputLen += len;
+}
+
+// Put as many whole frames from data in a worker's ring as there's room for, as it only ever reads whole ones. Returns
+// how much went in
+int ringFrames(sharedRing *ring, const byte *data, int len) {
+	unsigned long room = ringRoom(ring);
+	int put = 0;
+	while (put < len) {
+		unsigned long size = frameSize(data + put);
+		if (size > room) {
+			break;
+		}
+		put += size;
+		room -= size;
+	}
+	if (put) {
+		ringPut(ring, data, put);
+	}
+	return put;
+}
+
+// A worker's got output waiting: watch for room in its socket, or for it to make room in its ring. A ring only says
+// when the writer's said it's waiting, which has to be said again each time
+void waitForWorker(connection *c) {
+	if (!ev_is_active(&c->drainWatcher)) {
+		workerStalls += c->workerNo >= 0;
+		ev_io_init(&c->drainWatcher, drainCallback, c->ring ? c->ring->spaceEvent : c->socket, c->ring ? EV_READ : EV_WRITE);
+		c->drainWatcher.data = c;
+		ev_io_start(libEvLoop, &c->drainWatcher);
+	}
+	if (c->ring) {
+		byte *next = c->output + c->outputSent;
+		if (!ringWait(c->ring, frameSize(next))) {
+			ev_feed_event(libEvLoop, &c->drainWatcher, EV_READ); // It made room in the meantime
+		}
+	}
+	checkWorkersBehind();
+}
+
+// Send a worker some frames (or commands, in version 1) after whatever it's still to take, through its ring if it has
+// one, in the one writev. This never waits: whatever its socket (or ring) won't take now is kept for when it will,
+// so a worker that's behind doesn't hold up the others, or the apps. An app's stats go this way too
+void sendToWorker(connection *c, struct iovec *iov, int count) {
+	struct iovec all[3];
+	int n = 0, waiting = outputWaiting(c) > 0;
+	if (waiting) {
+		all[n++] = (struct iovec) { c->output + c->outputSent, outputWaiting(c) };
+	}
+	for (int i=0; i<count; i++) {
+		if (iov[i].iov_len) {
+			all[n++] = iov[i];
+		}
+	}
+	if (!n) {
+		return;
+	}
+	ssize_t sent = 0;
+	if (c->ring) {
+		for (int i=0; i<n; i++) {
+			int put = ringFrames(c->ring, all[i].iov_base, all[i].iov_len);
+			sent += put;
+			if (put < all[i].iov_len) {
+				break;
+			}
+		}
+	} else {
+		sent = writev(c->socket, all, n);
+		if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			workerWriteErrors += c->workerNo >= 0;
+			logError("Couldn't write to %s %d", c->workerNo < 0 ? "app" : "worker", c->workerNo); // Reading from it will find it's gone
+			return;
+		}
+		if (sent < 0) {
+			sent = 0;
+		}
+	}
+	if (sent && c->workerNo >= 0) {
+		workerWrites++;
+		workerWriteBytes += sent;
+	}
+
+	// Keep what it didn't take
+	int i = 0;
+	if (waiting) {
+		int took = sent < all[0].iov_len ? sent : all[0].iov_len;
+		c->outputSent += took;
+		sent -= took;
+		if (c->outputSent == c->outputLen) {
+			c->outputSent = c->outputLen = c->outputFrame = 0;
+		}
+		while (c->version >= 2 && c->outputFrame < c->outputSent) { // Keep up with where the whole frames start
+			c->outputFrame += frameSize(c->output + c->outputFrame);
+		}
+		i++;
+	}
+	for (; i<n; i++) {
+		if (sent >= all[i].iov_len) {
+			sent -= all[i].iov_len;
+			continue;
+		}
+		if (sent && c->version >= 2) { // It took part of a frame, so there's nothing else waiting, and the next starts after it
+			byte *next = all[i].iov_base;
+			while (next < (byte*)all[i].iov_base + sent) {
+				next += frameSize(next);
+			}
+			c->outputFrame = next - (byte*)all[i].iov_base - sent;
+		}
+		queueOutput(c, (byte*)all[i].iov_base + sent, all[i].iov_len - sent);
+		sent = 0;
+	}
+	if (outputWaiting(c)) {
+		waitForWorker(c);
+	} else {
+		ev_io_stop(libEvLoop, &c->drainWatcher);
+	}
+}
+
+// There's room in a worker's socket (or ring) for some of what's waiting for it
+void drainCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	connection *c = watcher->data;
+	if (c->ring) {
+		unsigned long long n;
+		read(c->ring->spaceEvent, &n, sizeof(n)); // Reset it
+	}
+	sendToWorker(c, NULL, 0);
+	checkWorkersBehind();
+}
 
-	free(watcher); // Free the watcher (this is last because the fd is used above, after ev_io_stop)
+// Send a worker everything that's pending for it, after anything it's still to take, in one writev
+void flushWorker(int worker) {
+	workerOutput *out = &pending[worker];
+	if (!out->len && !out->channelLen) {
+		return;
+	}
+	connection *c = workerConn[worker];
+	if (!c) {
+		logWarn("Worker %d went away with messages waiting for it, dropped", worker);
+		out->len = out->channelLen = 0;
+		return;
+	}
+	struct iovec iov[2] = { { NULL, 0 }, { out->channelFrames, out->channelLen } };
+	if (out->len) {
+		iov[0].iov_base = out->data + WIRE_HEADER;
+		iov[0].iov_len = out->len;
+		if (c->version >= 2) { // It's a batch frame
+			iov[0].iov_base = out->data;
+			iov[0].iov_len += wireHeader(out->data, WIRE_BATCH, 0, out->len);
+		}
+	}
+	sendToWorker(c, iov, 2);
+	out->len = out->channelLen = 0;
+}
+
+void flushWorkers() {
+	for (int w=0; w<WORKERS; w++) {
+		flushWorker(w);
+	}
+}
+
+// Keep a frame for a worker that's not connected, to send it when it's back. Its channels are kept too, as its clients
+// are still waiting on it (a worker that's lost us keeps them), and it'll tell us the ones it still has
+void spoolFrame(int worker, int type, const char *id, int idLen, const char *payload, int len) {
+	workerSpool *spool = &spools[worker];
+	if (spool->len + 4 + WIRE_HEADER + idLen + len > MANAGER_SPOOL_SIZE) {
+		spoolDrops++;
+		if (!spool->dropped++) {
+			logWarn("Worker %d's spool is full, dropping its messages till it's back", worker);
+		}
+		return;
+	}
+	if (!spool->data) {
+		spool->data = malloc(MANAGER_SPOOL_SIZE);
+		logWarn("Worker %d isn't connected, keeping its messages till it's back", worker);
+	}
+	spooledMessages++;
+	unsigned int now = ev_now(libEvLoop);
+	memcpy(spool->data + spool->len, &now, 4);
+	spool->len += 4 + wireFrame(spool->data + spool->len + 4, type, id, idLen, payload, len);
 }
 
-// The app connection just received a message to forward to a worker
-void forwardMessage(int iconn) {
+// A message has arrived from the app to forward to a worker. It's added to what's pending for that worker
+void forwardMessage(const char *clientId, int clientIdLen, const char *message, int len) {
 	// Figure out which worker to send it to
-	conn[iconn].appClientId[conn[iconn].appClientIdLen] = 0; // Put on the null terminator
-	khint_t hash = kh_str_hash_func((char*)conn[iconn].appClientId); // Do a crypto hash on the client
+	unsigned int hash = 0; // khash's X31 string hash, but over the length as the id needn't be null terminated
+	for (int i=0; i<clientIdLen; i++) {
+		hash = (hash << 5) - hash + (unsigned char)clientId[i];
+	}
 	int worker = hash % WORKERS; // Use the hash value to determine which worker they'll be on
 
 	// Now see if we can find that worker, hopefully it's connected to us
-	int socket = -1;
-	for (int i=0;i<conns;i++) {
-		if (conn[i].workerNo == worker) {
-			socket = conn[i].socket;
-			break;
+	connection *c = workerConn[worker];
+	if (!c) {
+		spoolFrame(worker, WIRE_MESSAGE, clientId, clientIdLen, message, len);
+		return;
+	}
+
+	forwardedMessages++;
+	forwardedBytes += len;
+
+	// Make room for it
+	int version = c->version;
+	int size = version >= 2 ? WIRE_ITEM_HEADER + clientIdLen + len : clientIdLen + len + 3;
+	workerOutput *out = &pending[worker];
+	if (out->len + size > WIRE_BATCH_SIZE) {
+		flushWorker(worker);
+	}
+	if (size > WIRE_BATCH_SIZE) { // Too big for a batch even on its own, so it goes by itself
+		int off = wireFrame(forwardingBuf, WIRE_MESSAGE, clientId, clientIdLen, message, len);
+		if (version < 2) {
+			off = 0;
+			forwardingBuf[off++] = WIRE_LEGACY_MESSAGE;
+			memcpy(forwardingBuf+off, clientId, clientIdLen);
+			off += clientIdLen;
+			forwardingBuf[off++] = 0;
+			memcpy(forwardingBuf+off, message, len);
+			off += len;
+			forwardingBuf[off++] = 0;
 		}
+		sendToWorker(c, &(struct iovec) { forwardingBuf, off }, 1);
+		return;
 	}
-	if (socket<0) {
-		printf ("Got a message for worker %d but it's not connected, dropped\r\n", worker);
+
+	byte *p = out->data + WIRE_HEADER + out->len;
+	if (version >= 2) {
+		out->len += wireBatchItem(p, clientId, clientIdLen, message, len);
 		return;
 	}
+	*p++ = WIRE_LEGACY_MESSAGE; // The original 2 id\0 message\0
+	memcpy(p, clientId, clientIdLen);
+	p[clientIdLen] = 0;
+	memcpy(p + clientIdLen + 1, message, len);
+	p[clientIdLen + 1 + len] = 0;
+	out->len += size;
+}
 
-	// Now forward the message to that worker
-	// Firstly compile it
-	int off=0;
-	forwardingBuf[off]=2; // 2 means 'message'
-	off++;
-	memcpy(forwardingBuf+off, conn[iconn].appClientId, conn[iconn].appClientIdLen); // The client id
-	off += conn[iconn].appClientIdLen;
-	forwardingBuf[off]=0; // Null terminate the client id
-	off++;
-	memcpy(forwardingBuf+off, conn[iconn].appMessage, conn[iconn].appMessageLen); // The message
-	off += conn[iconn].appMessageLen;
-	forwardingBuf[off]=0; // Null terminate the message
-	off++;
+// A message frame from a connection
+void appMessage(const char *clientId, int clientIdLen, const char *message, int len) {
+	readingConn->sender = 1;
+	forwardMessage(clientId, clientIdLen, message, len);
+}
 
-	// Now send it
-	write(socket, forwardingBuf, off);
+// A channel's name, null terminated for the hash
+void channelName(char *name, const char *channel, int len) {
+	memcpy(name, channel, len);
+	name[len] = 0;
 }
 
-/* Read client message */
-void readCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-	byte buffer[BUFFER_SIZE];
-	size_t read;
+// Add a channel message to what's pending for a worker
+void channelToWorker(int worker, const char *channel, int channelLen, const char *message, int len) {
+	connection *c = workerConn[worker];
+	if (!c) {
+		spoolFrame(worker, WIRE_CHANNEL, channel, channelLen, message, len);
+		return;
+	}
+	if (c->version < 2) {
+		return; // It's come back talking version 1, so it can't have channels
+	}
+	workerOutput *out = &pending[worker];
+	int size = WIRE_HEADER + channelLen + len;
+	if (out->channelLen + size > sizeof(out->channelFrames)) {
+		flushWorker(worker);
+	}
+	if (size > sizeof(out->channelFrames)) { // Too big to go with the others
+		sendToWorker(c, &(struct iovec) { forwardingBuf, wireFrame(forwardingBuf, WIRE_CHANNEL, channel, channelLen, message, len) }, 1);
+		return;
+	}
+	out->channelLen += wireFrame(out->channelFrames + out->channelLen, WIRE_CHANNEL, channel, channelLen, message, len);
+}
 
-	if (EV_ERROR & revents) {
-		puts ("got invalid event");
+// A worker's said hello: send it whatever was spooled while it was gone, batched like any other messages. Anything
+// that's waited longer than QUEUE_TTL_SECONDS is skipped, as the worker would only have expired it
+void replaySpool(int worker) {
+	workerSpool *spool = &spools[worker];
+	if (!spool->data) {
 		return;
 	}
+	unsigned int now = ev_now(libEvLoop);
+	int replayed = 0, stale = 0;
+	for (byte *p = spool->data, *end = spool->data + spool->len; p < end; ) {
+		unsigned int arrived;
+		memcpy(&arrived, p, 4);
+		int type = p[4], idLen = p[5];
+		unsigned int len = wireGetLength(p + 6);
+		const char *id = (const char*)p + 4 + WIRE_HEADER;
+		p += 4 + WIRE_HEADER + idLen + len;
+		if (now - arrived > QUEUE_TTL_SECONDS) {
+			stale++;
+			spoolExpired++;
+		} else if (type == WIRE_CHANNEL) {
+			channelToWorker(worker, id, idLen, id + idLen, len);
+			replayed++;
+		} else {
+			forwardMessage(id, idLen, id + idLen, len);
+			replayed++;
+		}
+	}
+	replayedMessages += replayed;
+	logInfo("Sent worker %d the %d messages it missed (%d were too old, %lu didn't fit)", worker, replayed, stale, spool->dropped);
+	free(spool->data);
+	memset(spool, 0, sizeof(workerSpool));
+	flushWorker(worker);
+}
 
-	// Find this socket in the conns list.
-	int iconn = -1;
-	for (int i=0;i<conns;i++) {
-		if (conn[i].socket == watcher->fd) {
-			iconn = i;
-			break;
+// A message from the app for a channel. Each worker with someone listening to it gets the one copy, and shares it out
+void channelMessage(const char *channel, int channelLen, const char *message, int len) {
+	char name[MAX_CLIENT_ID_LEN+1];
+	channelName(name, channel, channelLen);
+	khiter_t k = kh_get(channels, channels, name);
+	if (k == kh_end(channels)) {
+		return; // Nobody's listening
+	}
+	unsigned int workers = kh_value(channels, k);
+	for (int w=0; w<WORKERS; w++) {
+		if (workers & (1u << w)) {
+			channelToWorker(w, channel, channelLen, message, len);
 		}
 	}
-	if (iconn < 0) {
-		puts ("unknown file descriptor");
+}
+
+// Stop sending a worker a channel's messages, and forget the channel if nobody else wants them
+void unsubscribe(khiter_t k, int worker) {
+	kh_value(channels, k) &= ~(1u << worker);
+	if (!kh_value(channels, k)) {
+		free((char*)kh_key(channels, k));
+		kh_del(channels, channels, k);
+	}
+}
+
+// Our stats, in the Prometheus text format (see megastats.h)
+void writeStats(statsText *t) {
+	int workers = 0;
+	unsigned long spooled = 0, output = 0;
+	for (int w=0; w<WORKERS; w++) {
+		if (workerConn[w]) {
+			workers++;
+			output += outputWaiting(workerConn[w]);
+		}
+		spooled += spools[w].len;
+	}
+	statsValue(t, "megamanager_connections", "gauge", "Workers and apps connected", conns);
+	statsValue(t, "megamanager_workers_connected", "gauge", "Workers connected", workers);
+	statsValue(t, "megamanager_forwarded_messages_total", "counter", "Client messages passed on to their worker", forwardedMessages);
+	statsValue(t, "megamanager_forwarded_bytes_total", "counter", "Bytes of client messages passed on to their worker", forwardedBytes);
+	statsValue(t, "megamanager_channel_messages_total", "counter", "Channel messages from the app", channelMessages);
+	statsValue(t, "megamanager_channels", "gauge", "Channels that a worker has listeners for", kh_size(channels));
+	statsValue(t, "megamanager_spooled_messages_total", "counter", "Messages kept for a worker that wasn't connected", spooledMessages);
+	statsValue(t, "megamanager_spooled_bytes", "gauge", "Bytes kept for workers that aren't connected", spooled);
+	statsValue(t, "megamanager_spool_drops_total", "counter", "Messages dropped as their worker's spool was full", spoolDrops);
+	statsValue(t, "megamanager_spool_expired_total", "counter", "Spooled messages too old to send on when their worker came back", spoolExpired);
+	statsValue(t, "megamanager_replayed_messages_total", "counter", "Spooled messages sent on when their worker came back", replayedMessages);
+	statsValue(t, "megamanager_worker_writes_total", "counter", "Writes to the workers (or their rings)", workerWrites);
+	statsValue(t, "megamanager_worker_write_bytes_total", "counter", "Bytes written to the workers", workerWriteBytes);
+	statsValue(t, "megamanager_worker_write_errors_total", "counter", "Writes to a worker that failed", workerWriteErrors);
+	statsValue(t, "megamanager_worker_output_bytes", "gauge", "Bytes waiting for workers whose socket (or ring) is full", output);
+	statsValue(t, "megamanager_worker_stalls_total", "counter", "Times a worker's socket (or ring) was too full to take everything", workerStalls);
+	statsValue(t, "megamanager_worker_output_drops_total", "counter", "Bytes that were waiting for a worker when it went away, and couldn't be spooled", workerOutputDrops);
+	statsValue(t, "megamanager_app_pauses_total", "counter", "Times the apps weren't read from, as a worker was too far behind", appPauses);
+	statsValue(t, "megamanager_apps_paused", "gauge", "1 while the apps aren't being read from", appsPaused);
+	statsValue(t, "megamanager_bad_frames_total", "counter", "Connections closed for sending a bad frame", badFrames);
+	statsHistogramText(t, "megamanager_loop_seconds", "How long each go round the event loop took, not counting the wait", &loopTime);
+}
+
+// Answer a WIRE_STATS frame with our stats. They go the way the workers' frames do, so an app that isn't reading its
+// answers can't hold us up, though it's not sent any more while it has a lot of them waiting
+void sendStats(connection *c) {
+	static byte frame[WIRE_HEADER + STATS_TEXT_SIZE];
+	if (outputWaiting(c) > MANAGER_OUTPUT_HIGH) {
+		logWarn("App isn't reading its stats, not sending it any more till it does");
 		return;
 	}
+	statsText t = { (char*)frame + WIRE_HEADER, 0, STATS_TEXT_SIZE };
+	writeStats(&t);
+	wireHeader(frame, WIRE_STATS, 0, t.len);
+	fcntl(c->socket, F_SETFL, fcntl(c->socket, F_GETFL) | O_NONBLOCK);
+	sendToWorker(c, &(struct iovec) { frame, WIRE_HEADER + t.len }, 1);
+}
 
-	// Receive message from client socket
-	read = recv(watcher->fd, buffer, BUFFER_SIZE, 0);
-	
-	if (read < 0) {
-		puts ("read error");
-		closeConnection(watcher, iconn);
+// The version 2 frames that aren't client messages: channel messages from the app, and workers saying which channels
+// they have listeners for
+void otherFrame(int type, const char *id, int idLen, const char *payload, int len) {
+	if (type == WIRE_CHANNEL) {
+		readingConn->sender = 1;
+		channelMessages++;
+		channelMessage(id, idLen, payload, len);
 		return;
 	}
-	if (read == 0) {
-		// Stop and free watcher if client socket is closing
-		if (conn[iconn].workerNo < 0) {
-			puts("App connection closing nicely");
-		} else {
-			printf("Worker %d connection closing nicely\r\n", conn[iconn].workerNo);
+	if (type == WIRE_STATS) {
+		sendStats(readingConn);
+		return;
+	}
+	int worker = readingConn->workerNo;
+	if (worker < 0 || worker >= WORKERS) {
+		return; // Only workers have listeners
+	}
+	char name[MAX_CLIENT_ID_LEN+1];
+	channelName(name, id, idLen);
+	khiter_t k = kh_get(channels, channels, name);
+	if (type == WIRE_SUBSCRIBE) {
+		if (k == kh_end(channels)) {
+			int ret;
+			k = kh_put(channels, channels, strdup(name), &ret);
+			kh_value(channels, k) = 0;
 		}
-		closeConnection(watcher, iconn); // TODO is the socket close in this function necessary since the other side closed it anyway?
+		kh_value(channels, k) |= 1u << worker;
+	} else if (type == WIRE_UNSUBSCRIBE && k != kh_end(channels)) {
+		unsubscribe(k, worker);
+	}
+}
+
+// A connection's said it's a worker. From here on its socket doesn't block, as whatever it can't take yet waits in its
+// output. Anything still pending for a connection it's replacing goes first, as that was made for the old one
+void workerConnected(connection *c, int worker) {
+	c->workerNo = worker;
+	fcntl(c->socket, F_SETFL, fcntl(c->socket, F_GETFL) | O_NONBLOCK);
+	if (worker >= WORKERS) {
+		return;
+	}
+	if (workerConn[worker] && workerConn[worker] != c) {
+		flushWorker(worker);
+	}
+	workerConn[worker] = c;
+	replaySpool(worker);
+}
+
+// Make a worker a shared ring, and send it the memfd and eventfds with the answer to its hello. If the ring can't be
+// made, it gets the plain answer and its messages go down the socket
+void sendRing(connection *c, byte *reply) {
+	sharedRing *ring = malloc(sizeof(sharedRing));
+	if (!ringCreate(ring, SHARED_RING_SIZE, c->socket)) {
+		logWarn("Couldn't make a shared ring for worker %d", c->workerNo);
+		free(ring);
+		write(c->socket, reply, 2);
 		return;
 	}
-	// Go through the bytes read and parse what the client is sending us
+	int fds[3] = { ring->memFd, ring->dataEvent, ring->spaceEvent };
+	struct iovec iov = { .iov_base = reply, .iov_len = 2 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(c->socket, &msg, 0) != 2) {
+		logError("Couldn't send worker %d its ring", c->workerNo);
+		ringClose(ring);
+		free(ring);
+		return;
+	}
+	c->ring = ring;
+}
+
+// Parse what a connection sent in protocol version 1, a byte at a time. Returns how much it got through, which is
+// all of it unless it said hello and switched to frames
+int legacyCommands(connection *c, const byte *buffer, int read) {
 	for (int i=0; i<read; i++) {
-		if (conn[iconn].readStatus==0) {
-			if (buffer[i]==1) { // Start of the 'my worker # is X'
-				conn[iconn].readStatus = 100;
+		if (c->readStatus==0) {
+			if (buffer[i]==WIRE_LEGACY_HELLO) { // Start of the 'my worker # is X'
+				c->readStatus = 100;
 				continue;				
 			}		
-			if (buffer[i]==2) { // Start of the app sending a message
-				conn[iconn].readStatus = 200;
-				conn[iconn].appClientIdLen = 0;
-				conn[iconn].appMessageLen = 0;
+			if (buffer[i]==WIRE_HELLO) { // A worker or app saying which version it talks
+				c->readStatus = 300;
+				continue;
+			}
+			if (buffer[i]==WIRE_LEGACY_MESSAGE) { // Start of the app sending a message
+				c->readStatus = 200;
+				c->appClientIdLen = 0;
+				c->appMessageLen = 0;
 				continue;				
 			}		
 		}
-		if (conn[iconn].readStatus==100) { // We are waiting for the worker #
-			conn[iconn].workerNo = buffer[i];
-			printf("Worker %d connected\r\n", conn[iconn].workerNo);
-			conn[iconn].readStatus = 0;
+		if (c->readStatus==100) { // We are waiting for the worker #
+			logInfo("Worker %d connected", buffer[i]);
+			c->readStatus = 0;
+			workerConnected(c, buffer[i]);
 			continue;
 		}
-		if (conn[iconn].readStatus==200) { // We are waiting for the app sending a client id
+		if (c->readStatus==300) { // We are waiting for the version in a hello
+			c->version = buffer[i] < PROTOCOL_VERSION ? buffer[i] : PROTOCOL_VERSION;
+			c->readStatus = 301;
+			continue;
+		}
+		if (c->readStatus==301) { // And then who it is
+			if (buffer[i] != WIRE_APP) {
+				c->workerNo = buffer[i];
+			}
+			c->readStatus = 0;
+			if (c->version < 1) {
+				c->version = 1;
+			}
+			byte reply[2] = { WIRE_HELLO, c->version };
+			if (c->local && buffer[i] != WIRE_APP && c->version >= 2) {
+				sendRing(c, reply); // A worker on this box, so it can have a ring
+			} else {
+				write(c->socket, reply, 2);
+			}
+			logInfo("%s %d connected, talking protocol version %d%s", buffer[i] == WIRE_APP ? "App" : "Worker", buffer[i],
+				c->version, c->ring ? ", through a shared ring" : "");
+			if (buffer[i] != WIRE_APP) {
+				workerConnected(c, buffer[i]);
+			}
+			if (c->version >= 2) {
+				return i+1; // The rest is frames
+			}
+			continue;
+		}
+		if (c->readStatus==200) { // We are waiting for the app sending a client id
 			if (buffer[i]==0) {
-				conn[iconn].readStatus=201; // Now wait for the message	
+				c->readStatus=201; // Now wait for the message	
 				continue;
 			} else {
-				if (conn[iconn].appClientIdLen < MAX_CLIENT_ID_LEN) {
-					conn[iconn].appClientId[conn[iconn].appClientIdLen] = buffer[i];
-					conn[iconn].appClientIdLen ++;
+				if (c->appClientIdLen < MAX_CLIENT_ID_LEN) {
+					c->appClientId[c->appClientIdLen] = buffer[i];
+					c->appClientIdLen ++;
 					continue;
 				} else {
 					// Buffer overrun on the client id, so put the error and kill this connection todo
-					puts("Buffer overrun on the client id");
+					logWarn("Buffer overrun on the client id");
 					continue;
 				}
 			}
 		}
-		if (conn[iconn].readStatus==201) { // We are waiting for the app sending a message
+		if (c->readStatus==201) { // We are waiting for the app sending a message
 			if (buffer[i]==0) {
-				forwardMessage(iconn); // Send the message to the correct worker
-				conn[iconn].readStatus=0; // Now wait for the next command	
+				c->sender = 1;
+				forwardMessage((char*)c->appClientId, c->appClientIdLen, (char*)c->appMessage, c->appMessageLen); // Send the message to the correct worker
+				c->readStatus=0; // Now wait for the next command	
 				continue;
 			} else {
-				if (conn[iconn].appMessageLen < MAX_MESSAGE_LEN) {
-					conn[iconn].appMessage[conn[iconn].appMessageLen] = buffer[i];
-					conn[iconn].appMessageLen ++;
+				if (c->appMessageLen < MAX_MESSAGE_LEN) {
+					c->appMessage[c->appMessageLen] = buffer[i];
+					c->appMessageLen ++;
 					continue;
 				} else {
 					// Buffer overrun on the message, so put the error and kill this connection todo
-					puts("Buffer overrun on the message");
+					logWarn("Buffer overrun on the message");
 					continue;
 				}
 			}
 		}
 		// If it got to the end of the loop here, then the client has sent a malformed message so lets reset the parser
-		conn[iconn].readStatus = 0;
+		c->readStatus = 0;
 	} // end of the for loop
+	return read;
+}
+
+
+/* Read client message */
+void readCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	if (EV_ERROR & revents) {
+		logError("got invalid event");
+		return;
+	}
+
+	// Find this socket in the connections table
+	connection *c = conn[watcher->fd];
+	if (!c) {
+		logError("unknown file descriptor");
+		return;
+	}
+
+	// Read everything that's there, parsing as we go. The workers are sent what's for them at the end of the loop
+	for (;;) {
+		ssize_t read = recv(watcher->fd, c->buffer + c->buffered, MANAGER_BUFFER_SIZE - c->buffered, MSG_DONTWAIT);
+		if (read < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			logError("read error");
+			closeConnection(c);
+			break;
+		}
+		if (read == 0) {
+			// Stop and free watcher if client socket is closing
+			if (c->workerNo < 0) {
+				logInfo("App connection closing nicely");
+			} else {
+				logInfo("Worker %d connection closing nicely", c->workerNo);
+			}
+			closeConnection(c); // TODO is the socket close in this function necessary since the other side closed it anyway?
+			break;
+		}
+		int len = c->buffered + read, used = 0;
+		if (c->version < 2) {
+			used = legacyCommands(c, c->buffer, len);
+		}
+		if (c->version >= 2) {
+			readingConn = c;
+			int parsed = wireParse(c->buffer + used, len - used, appMessage, otherFrame);
+			if (parsed == WIRE_ERROR) {
+				badFrames++;
+				logWarn("Bad frame from %s %d, closing it", c->workerNo < 0 ? "app" : "worker", c->workerNo);
+				closeConnection(c);
+				break;
+			}
+			used += parsed;
+		}
+		c->buffered = len - used;
+		memmove(c->buffer, c->buffer + used, c->buffered); // Keep the start of the next frame
+		if (appsPaused && c->sender) { // A worker's too far behind, so the rest waits till it's caught up
+			ev_io_stop(loop, watcher);
+			break;
+		}
+	}
 }
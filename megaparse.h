@@ -0,0 +1,186 @@
+// MegaComet http request parser
+// All we want out of a request is the client id from the first line, eg 'myClientId' for:
+// GET /myClientId.js?c=cachekiller HTTP/1.1
+// and then to know where the request ends (the blank line after the headers). Rather than going byte
+// by byte, this jumps between the interesting bytes using SSE2/AVX2 compares (16/32 bytes at a time),
+// and falls back to memchr where there's no SIMD. Once the client id is out, we search for the
+// "\r\n\r\n", and (with keep-alive on) go through the lines before it for the HTTP version and a
+// Connection header, to know if the client wants the connection closed after the response.
+// The state is a single int (the connection's readStatus) plus the client id buffer, so a request
+// can arrive split over as many recv's as it likes.
+
+#ifndef _MEGAPARSE_H
+#define _MEGAPARSE_H
+
+#include <string.h>
+#include <strings.h>
+#include "config.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Parser states (kept in the connection's readStatus)
+#define PARSE_START 0 // Waiting for the '/'
+#define PARSE_CLIENT_ID 10 // Found the '/', reading the client id up to the '.'
+#define PARSE_DOT_J 11 // Found the '.', waiting for the 'j'
+#define PARSE_DOT_JS 12 // Waiting for the 's'
+#define PARSE_HEADERS 20 // Skipping to the end of the headers. 21-23 = that many bytes of the "\r\n\r\n" were at the end of the last read
+#define PARSE_DONE 1000 // Got the whole request, ready to respond
+
+// Parser results
+#define PARSE_MORE 0 // Need more bytes
+#define PARSE_COMPLETE 1 // Found the end of the request
+#define PARSE_ERROR -1 // Not a request we handle, drop the connection
+
+// Find the first 'a' or 'b' in p..end, or NULL
+static inline const unsigned char *parseFind(const unsigned char *p, const unsigned char *end, unsigned char a, unsigned char b) {
+#if defined(__AVX2__)
+	__m256i a32 = _mm256_set1_epi8(a), b32 = _mm256_set1_epi8(b);
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, a32), _mm256_cmpeq_epi8(v, b32)));
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i a16 = _mm_set1_epi8(a), b16 = _mm_set1_epi8(b);
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, a16), _mm_cmpeq_epi8(v, b16)));
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#endif
+	if (a == b) return memchr(p, a, end - p);
+	for (; p < end; p++) {
+		if (*p == a || *p == b) return p;
+	}
+	return NULL;
+}
+
+// Find the first "\r\n\r\n" that fits entirely in p..end, or NULL
+static inline const unsigned char *parseFindEnd(const unsigned char *p, const unsigned char *end) {
+#if defined(__AVX2__)
+	__m256i cr32 = _mm256_set1_epi8('\r'), lf32 = _mm256_set1_epi8('\n');
+	for (; end - p >= 32+3; p += 32) { // Compare the block against itself shifted by 0..3 bytes
+		__m256i m = _mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), cr32), _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+1)), lf32)),
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+2)), cr32), _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+3)), lf32)));
+		unsigned mask = _mm256_movemask_epi8(m);
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i cr16 = _mm_set1_epi8('\r'), lf16 = _mm_set1_epi8('\n');
+	for (; end - p >= 16+3; p += 16) {
+		__m128i m = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), cr16), _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+1)), lf16)),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+2)), cr16), _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+3)), lf16)));
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#endif
+	while (end - p >= 4) {
+		p = memchr(p, '\r', end - p - 3);
+		if (!p) return NULL;
+		if (p[1]=='\n' && p[2]=='\r' && p[3]=='\n') return p;
+		p++;
+	}
+	return NULL;
+}
+
+// Look through some header lines for whether the client wants the connection closed after the response: it says
+// "Connection: close", or it's HTTP/1.0 without a "Connection: keep-alive". Sets *close if so. It goes a line at a
+// time, so a line split over two reads is missed, and then the connection stays open till the client closes it. Only
+// with keep-alive on, as otherwise every connection's closed anyway
+static inline void parseConnection(const unsigned char *p, const unsigned char *end, int *close) {
+	if (KEEP_ALIVE_REQUESTS <= 1) return;
+	int http10 = 0, closeToken = 0, keepAliveToken = 0;
+	while (p < end) {
+		const unsigned char *eol = memchr(p, '\n', end - p), *lineEnd = eol ? eol : end;
+		if (lineEnd - p >= 11 && !strncasecmp((const char*)p, "connection:", 11)) {
+			for (const unsigned char *v = p + 11; v < lineEnd; v++) {
+				if (lineEnd - v >= 5 && !strncasecmp((const char*)v, "close", 5)) closeToken = 1;
+				if (lineEnd - v >= 10 && !strncasecmp((const char*)v, "keep-alive", 10)) keepAliveToken = 1;
+			}
+		} else if (eol && eol - p >= 9 && !memcmp(eol - 9, "HTTP/1.0\r", 9)) { // The end of the request line
+			http10 = 1;
+		}
+		p = lineEnd + 1;
+	}
+	if (closeToken || (http10 && !keepAliveToken)) *close = 1;
+}
+
+// Feed some bytes of a request into the parser
+// Returns PARSE_MORE, PARSE_COMPLETE or PARSE_ERROR. On PARSE_COMPLETE, *used is how many bytes of buf
+// belonged to this request (anything after that is the start of the next one). *close is set if the client's
+// asked for the connection to be closed after the response (see parseConnection), and left alone otherwise
+static inline int parseRequest(int *status, char *clientId, int *clientIdLen, const unsigned char *buf, int len, int *used, int *close) {
+	static const char end[] = "\r\n\r\n";
+	const unsigned char *p = buf, *bufEnd = buf + len;
+
+	while (p < bufEnd) {
+		if (*status == PARSE_START) { // Skip the "GET "
+			const unsigned char *slash = parseFind(p, bufEnd, '/', '/');
+			if (!slash) break;
+			p = slash + 1;
+			*status = PARSE_CLIENT_ID;
+			*clientIdLen = 0;
+			continue;
+		}
+		if (*status == PARSE_CLIENT_ID) { // Copy the client id in one go, up to the '.'
+			const unsigned char *dot = parseFind(p, bufEnd, '.', ' ');
+			int n = (dot ? dot : bufEnd) - p;
+			if (*clientIdLen + n > MAX_CLIENT_ID_LEN) return PARSE_ERROR; // Client id too long
+			memcpy(clientId + *clientIdLen, p, n);
+			*clientIdLen += n;
+			if (!dot) break;
+			clientId[*clientIdLen] = 0; // Put the null terminator on the end of the client id
+			p = dot + 1;
+			if (*dot == ' ') { // No '.' on the first line. That's fine for the stats page, anything else might be the favicon or something annoying like that
+				if (*clientIdLen < sizeof(STATS_PATH)-1 || memcmp(clientId, STATS_PATH, sizeof(STATS_PATH)-1)) return PARSE_ERROR;
+				*status = PARSE_HEADERS;
+				continue;
+			}
+			*status = PARSE_DOT_J;
+			continue;
+		}
+		if (*status == PARSE_DOT_J || *status == PARSE_DOT_JS) { // Reading the 'js' after the client id
+			if (*p != (*status == PARSE_DOT_J ? 'j' : 's')) return PARSE_ERROR; // Not a .js request!
+			p++;
+			*status = *status == PARSE_DOT_J ? PARSE_DOT_JS : PARSE_HEADERS;
+			continue;
+		}
+		// Skipping the rest of the request. First finish off a "\r\n\r\n" that was split over the last read
+		int matched = *status - PARSE_HEADERS;
+		while (matched && p < bufEnd && *p == end[matched]) {
+			p++;
+			matched++;
+			if (matched == 4) break;
+		}
+		if (matched < 4 && p == bufEnd && matched) { // Still only part way through it
+			*status = PARSE_HEADERS + matched;
+			break;
+		}
+		if (matched < 4) { // Now search the rest in bulk
+			const unsigned char *found = parseFindEnd(p, bufEnd);
+			parseConnection(p, found ? found + 2 : bufEnd, close);
+			if (!found) {
+				// Remember if the read ended part way through a "\r\n\r\n"
+				matched = 0;
+				if (bufEnd - p >= 3 && !memcmp(bufEnd-3, end, 3)) matched = 3;
+				else if (bufEnd - p >= 2 && !memcmp(bufEnd-2, end, 2)) matched = 2;
+				else if (bufEnd - p >= 1 && bufEnd[-1] == '\r') matched = 1;
+				*status = PARSE_HEADERS + matched;
+				break;
+			}
+			p = found + 4;
+		}
+		*status = PARSE_DONE;
+		*used = p - buf;
+		return PARSE_COMPLETE;
+	}
+	*used = len;
+	return PARSE_MORE;
+}
+
+#endif
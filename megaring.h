@@ -0,0 +1,216 @@
+// MegaComet shared memory ring
+// A worker on the same box as the manager can take its messages from a ring in shared memory rather than a socket,
+// so a batch costs the manager a memcpy instead of a write, and the worker parses it where it is instead of recv'ing
+// a copy. The manager makes a ring per worker in a memfd, and passes it (with two eventfds) to the worker over the
+// unix socket the worker connected on. What goes in it is the same version 2 frames that would have gone down the
+// socket (megawire.h). There's the one writer (the manager) and the one reader (the worker), so it's just the two
+// counters. The data is mapped twice, one copy straight after the other, so a frame that wraps round the end is still
+// all in a row.
+// Nobody's woken unless they're asleep. The worker says it's going to sleep, checks once more that the ring's empty,
+// and goes back to the event loop to wait on dataEvent, which the manager only writes to if it sees the flag. So it's
+// only when the ring goes from empty to not. It's the same for the manager when the ring's full, which it waits out
+// in its event loop, watching spaceEvent, like it would a socket that's full.
+// A worker with more than one thread (WORKER_THREADS) also passes messages and clients between its threads in these,
+// each pair of threads having their own, so there's still only the one writer and the one reader.
+
+#ifndef _MEGARING_H
+#define _MEGARING_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include "config.h"
+#include "megawire.h"
+
+#define RING_CONTROL 4096 // The page at the start of the memfd with the counters in, the data comes after
+
+#if SHARED_RING_SIZE & (SHARED_RING_SIZE - 1) || SHARED_RING_SIZE % RING_CONTROL
+#error "SHARED_RING_SIZE has to be a power of 2, and whole pages"
+#endif
+#if THREAD_RING_SIZE & (THREAD_RING_SIZE - 1) || THREAD_RING_SIZE % RING_CONTROL
+#error "THREAD_RING_SIZE has to be a power of 2, and whole pages"
+#endif
+#if SHARED_RING_SIZE < WIRE_MAX_FRAME
+#error "SHARED_RING_SIZE has to hold the biggest frame"
+#endif
+
+typedef struct ringControl {
+	unsigned long head; // Bytes ever written. Only the manager changes it
+	char pad1[56]; // So the two sides aren't fighting over the one cache line
+	unsigned long tail; // Bytes ever read. Only the worker changes it
+	char pad2[56];
+	int readerAsleep; // The worker's waiting on dataEvent
+	int writerAsleep; // The manager's waiting on spaceEvent
+} ringControl;
+
+typedef struct sharedRing {
+	ringControl *control;
+	unsigned char *data; // size bytes, mapped twice in a row
+	unsigned long size; // A power of 2
+	int memFd, dataEvent, spaceEvent;
+	int peer; // The manager's socket to the worker, so it can tell if the worker's gone while it waits for room
+} sharedRing;
+
+// The address of the manager's unix socket, that workers connect to for a ring
+static inline socklen_t ringSocketAddress(struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	int len = snprintf(addr->sun_path+1, sizeof(addr->sun_path)-1, "%s", MANAGER_SOCKET_NAME); // Leading null = abstract
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static inline void ringClose(sharedRing *ring) {
+	if (ring->control) munmap(ring->control, RING_CONTROL);
+	if (ring->data) munmap(ring->data, 2*ring->size);
+	if (ring->memFd >= 0) close(ring->memFd);
+	if (ring->dataEvent >= 0) close(ring->dataEvent);
+	if (ring->spaceEvent >= 0) close(ring->spaceEvent);
+	ring->control = NULL;
+	ring->data = NULL;
+	ring->memFd = ring->dataEvent = ring->spaceEvent = -1;
+}
+
+// Map the memfd: the control page, and the data twice over in one reserved stretch of address space
+static inline int ringMap(sharedRing *ring) {
+	void *control = mmap(NULL, RING_CONTROL, PROT_READ|PROT_WRITE, MAP_SHARED, ring->memFd, 0);
+	if (control == MAP_FAILED) {
+		return 0;
+	}
+	ring->control = control;
+	unsigned char *data = mmap(NULL, 2*ring->size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+	ring->data = data;
+	for (int i=0; i<2; i++) {
+		if (mmap(data + i*ring->size, ring->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, ring->memFd, RING_CONTROL) == MAP_FAILED) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Make a new ring of 'size' bytes, for the manager (or one of a worker's threads) to write to. Returns 0 if it couldn't
+static inline int ringCreate(sharedRing *ring, unsigned long size, int peer) {
+	memset(ring, 0, sizeof(sharedRing));
+	ring->size = size;
+	ring->peer = peer;
+	ring->memFd = memfd_create("megacomet-ring", MFD_CLOEXEC);
+	ring->dataEvent = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ring->spaceEvent = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (ring->memFd < 0 || ring->dataEvent < 0 || ring->spaceEvent < 0
+			|| ftruncate(ring->memFd, RING_CONTROL + size) < 0 || !ringMap(ring)) {
+		ringClose(ring);
+		return 0;
+	}
+	ring->control->readerAsleep = 1; // So the first write wakes it
+	return 1;
+}
+
+// Map a ring the manager made, for the worker to read from. Returns 0 if it couldn't
+static inline int ringAttach(sharedRing *ring, int memFd, int dataEvent, int spaceEvent) {
+	memset(ring, 0, sizeof(sharedRing));
+	ring->memFd = memFd;
+	ring->dataEvent = dataEvent;
+	ring->spaceEvent = spaceEvent;
+	ring->peer = -1;
+	struct stat st;
+	if (fstat(memFd, &st) == 0 && st.st_size > RING_CONTROL) {
+		ring->size = st.st_size - RING_CONTROL;
+	}
+	if (!ring->size || ring->size & (ring->size - 1) || !ringMap(ring)) {
+		ringClose(ring);
+		return 0;
+	}
+	return 1;
+}
+
+// How much room there is for the writer
+static inline unsigned long ringRoom(sharedRing *ring) {
+	return ring->size - (ring->control->head - __atomic_load_n(&ring->control->tail, __ATOMIC_ACQUIRE));
+}
+
+// Put a frame in the ring, which the writer has checked it has room for, and wake the reader if it's asleep
+static inline void ringPut(sharedRing *ring, const void *frame, unsigned long len) {
+	ringControl *c = ring->control;
+	unsigned long head = c->head;
+	memcpy(ring->data + (head & (ring->size-1)), frame, len);
+	__atomic_store_n(&c->head, head + len, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&c->readerAsleep, 0, __ATOMIC_SEQ_CST)) {
+		unsigned long long one = 1;
+		write(ring->dataEvent, &one, sizeof(one));
+	}
+}
+
+// The writer's found no room for len bytes, and wants to wait on spaceEvent. Returns 0 if the reader made room in the
+// meantime, in which case it should carry on writing instead
+static inline int ringWait(sharedRing *ring, unsigned long len) {
+	ringControl *c = ring->control;
+	__atomic_store_n(&c->writerAsleep, 1, __ATOMIC_SEQ_CST);
+	if (ring->size - (c->head - __atomic_load_n(&c->tail, __ATOMIC_SEQ_CST)) >= len) {
+		__atomic_store_n(&c->writerAsleep, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+// Put a frame in the ring, waiting for room if it's full. Returns 0 if the worker went away while we waited
+static inline int ringWrite(sharedRing *ring, const void *frame, unsigned long len) {
+	while (ringRoom(ring) < len) {
+		if (!ringWait(ring, len)) {
+			break;
+		}
+		struct pollfd fds[2] = { { .fd = ring->spaceEvent, .events = POLLIN }, { .fd = ring->peer, .events = POLLRDHUP } };
+		if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+			return 0;
+		}
+		if (fds[1].revents & (POLLRDHUP|POLLHUP|POLLERR)) {
+			return 0;
+		}
+		unsigned long long n;
+		if (fds[0].revents & POLLIN) {
+			read(ring->spaceEvent, &n, sizeof(n));
+		}
+	}
+	ringPut(ring, frame, len);
+	return 1;
+}
+
+// How much is waiting to be read, and where it starts
+static inline unsigned long ringReadable(sharedRing *ring, unsigned char **start) {
+	unsigned long tail = ring->control->tail;
+	*start = ring->data + (tail & (ring->size-1));
+	return __atomic_load_n(&ring->control->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+// The reader's done with len bytes, so the writer can have the room back
+static inline void ringConsume(sharedRing *ring, unsigned long len) {
+	ringControl *c = ring->control;
+	__atomic_store_n(&c->tail, c->tail + len, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&c->writerAsleep, 0, __ATOMIC_SEQ_CST)) {
+		unsigned long long one = 1;
+		write(ring->spaceEvent, &one, sizeof(one));
+	}
+}
+
+// The reader's found the ring empty, and wants to wait on dataEvent. Returns 0 if something arrived in the meantime,
+// in which case it should carry on reading instead
+static inline int ringSleep(sharedRing *ring) {
+	ringControl *c = ring->control;
+	__atomic_store_n(&c->readerAsleep, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&c->head, __ATOMIC_SEQ_CST) != c->tail) {
+		__atomic_store_n(&c->readerAsleep, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+#endif
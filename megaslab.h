@@ -0,0 +1,91 @@
+// MegaComet slab allocator
+// The worker keeps its small variable sized things (client ids, queued messages) in here rather than malloc'ing each
+// one. Each size class (16, 32, 64... bytes) is a slab of fixed size slots, so there's no malloc header, and freed slots
+// go on their class's free list (threaded through the slots) to be reused, so once a worker has been running a while
+// it doesn't call malloc at all. Slabs grow a chunk at a time and chunks never move, so a slot stays put for as long
+// as it's allocated. Slots are referred to by a 32-bit handle: the size class in the top 5 bits, the slot number in
+// the rest. Handle 0 is never given out, so it can mean 'none'.
+
+#ifndef _MEGASLAB_H
+#define _MEGASLAB_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_MIN_BITS 4 // The smallest slots are 16 bytes
+#define SLAB_CLASSES 20 // Up to 8MB
+#define SLAB_CHUNK_BITS 16 // Slabs grow 64KB at a time (or a slot at a time, for slots bigger than that)
+#define SLAB_SLOT_BITS 27 // The slot number part of a handle
+
+typedef struct slabClass {
+	char **chunks; // The slab's chunks
+	unsigned int chunkCount;
+	unsigned int used; // Slots handed out from the end of the slab so far
+	unsigned int freeSlot; // First slot on the free list plus 1, so 0 = none (slot 0 of every class but the first is used)
+} slabClass;
+
+typedef struct slabStore {
+	slabClass classes[SLAB_CLASSES];
+	unsigned long slots; // How many are allocated
+	unsigned long bytes; // Memory in the slabs
+	unsigned long chunkMallocs; // How many times it's had to grow
+} slabStore;
+
+// log2 of the number of slots in one of a class's chunks
+static inline int slabPerChunk(int c) {
+	return c < SLAB_CHUNK_BITS - SLAB_MIN_BITS ? SLAB_CHUNK_BITS - SLAB_MIN_BITS - c : 0;
+}
+
+// The size class for a number of bytes
+static inline int slabClassFor(int bytes) {
+	int c = 0;
+	while ((1 << (SLAB_MIN_BITS + c)) < bytes) {
+		c++;
+	}
+	return c;
+}
+
+// Where the slot with this handle is
+static inline char *slabPtr(slabStore *s, unsigned int handle) {
+	int c = handle >> SLAB_SLOT_BITS;
+	unsigned int slot = handle & ((1u << SLAB_SLOT_BITS) - 1);
+	int perChunk = slabPerChunk(c);
+	return s->classes[c].chunks[slot >> perChunk] + ((size_t)(slot & ((1u << perChunk) - 1)) << (SLAB_MIN_BITS + c));
+}
+
+// Get a slot of at least this many bytes. Returns its handle
+static inline unsigned int slabAlloc(slabStore *s, int bytes) {
+	int c = slabClassFor(bytes);
+	slabClass *k = &s->classes[c];
+	unsigned int handle;
+	s->slots++;
+	if (k->freeSlot) { // Reuse a freed one
+		handle = ((unsigned int)c << SLAB_SLOT_BITS) | (k->freeSlot - 1);
+		memcpy(&k->freeSlot, slabPtr(s, handle), sizeof(unsigned int)); // The next one's number, plus 1 too
+		return handle;
+	}
+	if (!c && !k->used) {
+		k->used = 1; // Slot 0 of the smallest class would be handle 0
+	}
+	unsigned int slot = k->used++;
+	if ((slot >> slabPerChunk(c)) >= k->chunkCount) { // Slab's full, add a chunk
+		size_t chunkBytes = (size_t)1 << (SLAB_MIN_BITS + c + slabPerChunk(c));
+		if (!(k->chunkCount & (k->chunkCount - 1))) { // The list of chunks doubles whenever it's a power of 2 long
+			k->chunks = realloc(k->chunks, (k->chunkCount ? k->chunkCount*2 : 1) * sizeof(char*));
+		}
+		k->chunks[k->chunkCount++] = malloc(chunkBytes);
+		s->bytes += chunkBytes;
+		s->chunkMallocs++;
+	}
+	return ((unsigned int)c << SLAB_SLOT_BITS) | slot;
+}
+
+// Give a slot back
+static inline void slabFree(slabStore *s, unsigned int handle) {
+	slabClass *k = &s->classes[handle >> SLAB_SLOT_BITS];
+	memcpy(slabPtr(s, handle), &k->freeSlot, sizeof(unsigned int));
+	k->freeSlot = (handle & ((1u << SLAB_SLOT_BITS) - 1)) + 1;
+	s->slots--;
+}
+
+#endif
@@ -11,7 +11,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <sys/un.h>
 #include "config.h"
+#include "megawire.h"
+
+#define STATS_LINES 1024 // Most different lines 'megastart stats' can add up
+#define STATS_REPLY_SIZE 65536 // Biggest stats reply it reads
 
 // This tests to see if a port is listening. This is a good way to test if the megacomet manager/workers are running.
 int isPortFree(int port) {
@@ -36,6 +42,199 @@ int isPortFree(int port) {
 	return 1; // Free
 }
 
+// In SHARED_PORT mode the workers all listen on the one port, so instead this tests to see if a worker is running
+// by trying to bind to its handoff socket name
+int isHandoffFree(int worker) {
+	int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		return 0; // Not free
+	}
+
+	// Same address as the worker's handoffAddress
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	int len = snprintf(addr.sun_path+1, sizeof(addr.sun_path)-1, HANDOFF_SOCKET_NAME, worker);
+	int bindResult = bind(sock, (struct sockaddr*) &addr, offsetof(struct sockaddr_un, sun_path) + 1 + len);
+	close(sock);
+	return bindResult == 0;
+}
+
+// Connect to a port on this box. Returns the socket, or -1
+int connectLocal(int port) {
+	int sock = socket(PF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Read until there's 'want' bytes in buf, or it's full, or the other end's done. Returns how many there are
+int readAtLeast(int sock, char *buf, int have, int want, int size) {
+	while (have < want && have < size) {
+		int got = read(sock, buf + have, size - have);
+		if (got <= 0) {
+			break;
+		}
+		have += got;
+	}
+	return have;
+}
+
+// How many threads each worker runs, worked out the way they do it (WORKER_THREADS, or MEGACOMET_THREADS)
+int workerThreads() {
+	const char *env = getenv("MEGACOMET_THREADS");
+	int threads = env ? atoi(env) : WORKER_THREADS;
+	return threads < 1 || SHARED_PORT ? 1 : threads;
+}
+
+// Get a worker's stats (or one of its thread's) from its comet port. Returns the length of the text in buf, or -1
+int fetchWorkerStats(int worker, int thread, char *buf, int size) {
+	int sock = connectLocal(SHARED_PORT ? COMET_BASE_PORT_NO : COMET_BASE_PORT_NO + worker);
+	if (sock < 0) {
+		return -1;
+	}
+	char request[64];
+	int len = snprintf(request, sizeof(request), "GET /" STATS_PATH);
+	if (SHARED_PORT) {
+		len += snprintf(request + len, sizeof(request) - len, "%d", worker);
+	}
+	if (workerThreads() > 1) {
+		len += snprintf(request + len, sizeof(request) - len, "-%d", thread);
+	}
+	len += snprintf(request + len, sizeof(request) - len, " HTTP/1.1\r\n\r\n");
+	if (write(sock, request, len) != len) {
+		close(sock);
+		return -1;
+	}
+	// The headers, then Content-Length bytes of stats
+	int have = 0;
+	char *body = NULL;
+	while (!body && have < size - 1) {
+		int got = read(sock, buf + have, size - 1 - have);
+		if (got <= 0) {
+			break;
+		}
+		have += got;
+		buf[have] = 0;
+		body = strstr(buf, "\r\n\r\n");
+	}
+	char *contentLength = body ? strstr(buf, "Content-Length: ") : NULL;
+	if (!contentLength || contentLength > body) {
+		close(sock);
+		return -1;
+	}
+	body += 4;
+	int bodyLen = atoi(contentLength + 16);
+	have = readAtLeast(sock, buf, have, body - buf + bodyLen, size);
+	close(sock);
+	if (have < body - buf + bodyLen) {
+		return -1;
+	}
+	memmove(buf, body, bodyLen);
+	return bodyLen;
+}
+
+// Get the manager's stats, by saying hello as an app and sending it a WIRE_STATS frame. Returns the length, or -1
+int fetchManagerStats(char *buf, int size) {
+	int sock = connectLocal(MANAGER_PORT_NO);
+	if (sock < 0) {
+		return -1;
+	}
+	unsigned char hello[3] = { WIRE_HELLO, PROTOCOL_VERSION, WIRE_APP }, request[WIRE_HEADER];
+	wireHeader(request, WIRE_STATS, 0, 0);
+	if (write(sock, hello, 3) != 3 || write(sock, request, WIRE_HEADER) != WIRE_HEADER
+			|| readAtLeast(sock, buf, 0, 2, 2) < 2 || buf[1] < 2) { // Its hello back, with a version that has stats
+		close(sock);
+		return -1;
+	}
+	int have = readAtLeast(sock, buf, 0, WIRE_HEADER, size);
+	int len = have >= WIRE_HEADER && buf[0] == WIRE_STATS ? wireGetLength((unsigned char*)buf + 2) : -1;
+	if (len < 0 || len > size - WIRE_HEADER || readAtLeast(sock, buf, have, WIRE_HEADER + len, size) < WIRE_HEADER + len) {
+		close(sock);
+		return -1;
+	}
+	close(sock);
+	memmove(buf, buf + WIRE_HEADER, len);
+	return len;
+}
+
+// The workers' stats, added up: lines are matched by everything before the value, so each counter and histogram
+// bucket is summed over them. Comment lines just go in once. Quantiles don't add up, so they're left out
+char *statsLines[STATS_LINES];
+double statsSums[STATS_LINES];
+int statsLineCount = 0;
+
+void addStats(char *text) {
+	for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+		if (strstr(line, "_quantile")) {
+			continue;
+		}
+		char *value = line[0] == '#' ? NULL : strrchr(line, ' ');
+		if (value) {
+			*value++ = 0;
+		}
+		int i = 0;
+		while (i < statsLineCount && strcmp(statsLines[i], line)) {
+			i++;
+		}
+		if (i == statsLineCount) {
+			if (statsLineCount == STATS_LINES) {
+				continue;
+			}
+			statsLines[statsLineCount] = strdup(line);
+			statsSums[statsLineCount++] = 0;
+		}
+		if (value) {
+			statsSums[i] += atof(value);
+		}
+	}
+}
+
+// Print everyone's stats: the workers' (and their threads') added up, then the manager's
+int showStats() {
+	static char buf[STATS_REPLY_SIZE];
+	int workersUp = 0;
+	for (int worker=0; worker<WORKERS; worker++) {
+		int threadsUp = 0;
+		for (int thread=0; thread<workerThreads(); thread++) {
+			int len = fetchWorkerStats(worker, thread, buf, sizeof(buf) - 1);
+			if (len < 0) {
+				fprintf(stderr, "Couldn't get the stats from worker %d thread %d\n", worker, thread);
+				continue;
+			}
+			buf[len] = 0;
+			addStats(buf);
+			threadsUp++;
+		}
+		workersUp += threadsUp == workerThreads();
+	}
+	printf("# %d of %d workers\n", workersUp, WORKERS);
+	for (int i=0; i<statsLineCount; i++) {
+		if (statsLines[i][0] == '#') {
+			printf("%s\n", statsLines[i]);
+		} else {
+			printf("%s %.15g\n", statsLines[i], statsSums[i]);
+		}
+	}
+	int len = fetchManagerStats(buf, sizeof(buf));
+	if (len < 0) {
+		fprintf(stderr, "Couldn't get the stats from the manager\n");
+		return 1;
+	}
+	fwrite(buf, 1, len, stdout);
+	return workersUp < WORKERS;
+}
+
 // Daemonise the process by forking it
 void daemonise() {
 	puts ("Running in the background");
@@ -56,12 +255,11 @@ void daemonise() {
 // Run one iteration of the daemon loop
 void daemonIter() {
 	if (isPortFree(MANAGER_PORT_NO)) {
-		system("killall megacomet"); // Kill all the workers if the manager died
-		system("./megamanager start &");
+		system("./megamanager start &"); // The workers keep their clients, and reconnect to it once it's up
 		sleep(MANAGER_START_DELAY);
 	}
 	for (int worker=0; worker<WORKERS; worker++) {
-		if (isPortFree(COMET_BASE_PORT_NO + worker)) {
+		if (SHARED_PORT ? isHandoffFree(worker) : isPortFree(COMET_BASE_PORT_NO + worker)) {
 			char cmd[20];
 			snprintf(cmd, 20, "./megacomet %d &", worker);
 			system(cmd);
@@ -78,6 +276,9 @@ void daemonLoop() {
 }
 
 int main(int argc, char **args) {
+	if (argc == 2 && !strcmp(args[1], "stats")) {
+		return showStats();
+	}
 	puts("MegaComet Starter");
 	// Suss out the command line
 	if (argc<2) {
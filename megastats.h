@@ -0,0 +1,112 @@
+// MegaComet stats
+// The worker and the manager count what they do, and keep histograms of how long things take. The counters are plain
+// globals: each process only touches its own from its event loop (a worker's threads each have their own, as they're
+// __thread), so there's nothing to lock or make atomic, and a count is one add. They're served in the Prometheus text
+// format: the worker's at GET /_stats on its comet port, the manager's in answer to a WIRE_STATS frame, and
+// 'megastart stats' adds up all the workers'.
+// The histograms are HDR style: each power of 2 is split into STATS_SUB_BUCKETS even buckets, so a value's recorded to
+// within 1/STATS_SUB_BUCKETS of itself however big it is, in a fixed array, for a count of the leading zeros and a
+// shift. Values are in microseconds. For Prometheus they're added up into power of 2 buckets, which add up across
+// processes, and the quantiles from the fine buckets are given as well.
+
+#ifndef _MEGASTATS_H
+#define _MEGASTATS_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define STATS_SUB_BITS 3 // 8 buckets per power of 2, so values are within 12.5%
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 32 // Up to 2^32 microseconds (over an hour). Anything longer goes in the last bucket
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+#define STATS_TEXT_SIZE 16384 // Room for all of a process's stats
+
+typedef struct statsHistogram {
+	unsigned long counts[STATS_BUCKETS];
+	unsigned long count;
+	double sum; // Microseconds
+} statsHistogram;
+
+// Where the stats text is built up
+typedef struct statsText {
+	char *p;
+	int len, size;
+} statsText;
+
+static inline double statsNowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+// Which bucket a value goes in
+static inline int statsBucket(unsigned long us) {
+	if (us < STATS_SUB_BUCKETS) {
+		return us;
+	}
+	int bits = 63 - __builtin_clzl(us); // At least STATS_SUB_BITS
+	int b = (bits - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + (int)((us >> (bits - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS-1));
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS-1;
+}
+
+// The first value that's past a bucket
+static inline unsigned long statsBucketEnd(int b) {
+	if (b < STATS_SUB_BUCKETS) {
+		return b + 1;
+	}
+	int shift = b / STATS_SUB_BUCKETS - 1;
+	return (unsigned long)(STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS + 1) << shift;
+}
+
+static inline void statsRecord(statsHistogram *h, double us) {
+	h->counts[statsBucket(us < 0 ? 0 : (unsigned long)us)]++;
+	h->count++;
+	h->sum += us;
+}
+
+// The value that a fraction q of those recorded are at or below (give or take the bucket size)
+static inline double statsQuantile(statsHistogram *h, double q) {
+	unsigned long want = q * h->count, seen = 0;
+	for (int b=0; b<STATS_BUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen > want) {
+			return statsBucketEnd(b) - 1;
+		}
+	}
+	return 0;
+}
+
+static inline void statsPrintf(statsText *t, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(t->p + t->len, t->size - t->len, format, args);
+	va_end(args);
+	t->len += n < t->size - t->len ? n : t->size - t->len - 1;
+}
+
+// A counter (type "counter", only goes up) or a gauge (type "gauge", what it is now)
+static inline void statsValue(statsText *t, const char *name, const char *type, const char *help, double value) {
+	statsPrintf(t, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, value);
+}
+
+// A histogram, in seconds, with its power of 2 buckets, and then its quantiles as name_quantile
+static inline void statsHistogramText(statsText *t, const char *name, const char *help, statsHistogram *h) {
+	statsPrintf(t, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	unsigned long cumulative = 0;
+	int b = 0;
+	for (int bits=0; bits<=STATS_MAX_BITS; bits++) {
+		for (; b < STATS_BUCKETS && statsBucketEnd(b) <= (1ul << bits); b++) {
+			cumulative += h->counts[b];
+		}
+		statsPrintf(t, "%s_bucket{le=\"%.6f\"} %lu\n", name, (1ul << bits) / 1e6, cumulative);
+	}
+	statsPrintf(t, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.6f\n%s_count %lu\n", name, h->count, name, h->sum / 1e6, name, h->count);
+	statsPrintf(t, "# HELP %s_quantile %s, quantiles of this process's\n# TYPE %s_quantile gauge\n", name, help, name);
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	for (int q=0; q<4; q++) {
+		statsPrintf(t, "%s_quantile{quantile=\"%g\"} %.6f\n", name, quantiles[q], statsQuantile(h, quantiles[q]) / 1e6);
+	}
+}
+
+#endif
@@ -0,0 +1,244 @@
+// MegaComet io_uring
+// The worker can drive its client sockets through an io_uring instead of epoll. Rather than being told a socket's
+// ready and then making the accept, recv, write or close call itself, it queues those on the ring, and the kernel does
+// them and queues a completion for each. Everything queued in a go round the event loop goes in one io_uring_enter,
+// so at hundreds of thousands of connections a second the syscalls are per loop, not per connection. The accept and
+// the recvs are multishot: queued once, they keep completing (a connection, or a read, each time) until they're
+// cancelled. Reads go into buffers from a ring of them the kernel picks from, so a connection that's waiting for a
+// message doesn't have a buffer tied up in it.
+// This is a thin layer over the raw syscalls (there's no liburing on most of the boxes), just the setup, queueing,
+// submitting and reaping. It needs Linux 6.0 (multishot recv) to run, and uringInit says if it's not there, and the
+// kernel headers from 6.0 or later to build.
+
+#ifndef _MEGAURING_H
+#define _MEGAURING_H
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#define URING_BUFFER_GROUP 0 // The id of the provided buffer ring
+
+typedef struct uring {
+	int fd;
+	unsigned int *sqHead, *sqTail, *sqFlags, sqMask, sqEntries;
+	struct io_uring_sqe *sqes;
+	unsigned int *cqHead, *cqTail, cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned int tail; // Our copy of the submission tail, the kernel sees it when we submit
+	unsigned int submitted; // How much of that it's had
+	struct io_uring_buf_ring *buffers; // The receive buffers the kernel picks from
+	char *bufferData;
+	unsigned int bufferCount, bufferSize;
+	unsigned long enters, completions; // io_uring_enter calls, and completions reaped, for the stats
+} uring;
+
+static inline int uringEnter(uring *r, unsigned int submit, unsigned int flags) {
+	r->enters++;
+	return syscall(__NR_io_uring_enter, r->fd, submit, 0, flags, NULL, 0);
+}
+
+// Set up a ring with room for 'entries' queued operations, and 'bufferCount' (a power of 2) receive buffers of
+// 'bufferSize'. Returns 0 if the kernel can't do everything we need
+static inline int uringInit(uring *r, unsigned int entries, unsigned int bufferCount, unsigned int bufferSize) {
+	memset(r, 0, sizeof(uring));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	// SINGLE_ISSUER came in with multishot recv (6.0), so a kernel that takes it has that too. The completion queue's
+	// bigger than usual, as the multishots can complete more than once per submission
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER;
+	p.cq_entries = entries * 4;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) {
+		return 0;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+		close(r->fd);
+		return 0;
+	}
+
+	// The submission and completion rings are one mapping, the submission entries another
+	size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+	char *ring = mmap(NULL, ringSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		close(r->fd);
+		return 0;
+	}
+	r->sqHead = (unsigned int*)(ring + p.sq_off.head);
+	r->sqTail = (unsigned int*)(ring + p.sq_off.tail);
+	r->sqFlags = (unsigned int*)(ring + p.sq_off.flags);
+	r->sqMask = *(unsigned int*)(ring + p.sq_off.ring_mask);
+	r->sqEntries = p.sq_entries;
+	unsigned int *array = (unsigned int*)(ring + p.sq_off.array);
+	for (unsigned int i=0; i<p.sq_entries; i++) {
+		array[i] = i; // Entries are always used in order, so the indirection's fixed
+	}
+	r->cqHead = (unsigned int*)(ring + p.cq_off.head);
+	r->cqTail = (unsigned int*)(ring + p.cq_off.tail);
+	r->cqMask = *(unsigned int*)(ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+	r->tail = *r->sqTail;
+	r->submitted = r->tail;
+
+	// The receive buffers, and the ring the kernel takes them from (5.19). They're only given memory as they're used
+	r->bufferCount = bufferCount;
+	r->bufferSize = bufferSize;
+	r->buffers = mmap(NULL, bufferCount * sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	r->bufferData = mmap(NULL, (size_t)bufferCount * bufferSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (r->buffers == MAP_FAILED || r->bufferData == MAP_FAILED) {
+		close(r->fd);
+		return 0;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)r->buffers;
+	reg.ring_entries = bufferCount;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		close(r->fd);
+		return 0;
+	}
+	for (unsigned int i=0; i<bufferCount; i++) {
+		struct io_uring_buf *b = &r->buffers->bufs[i];
+		b->addr = (unsigned long)(r->bufferData + (size_t)i * bufferSize);
+		b->len = bufferSize;
+		b->bid = i;
+	}
+	__atomic_store_n(&r->buffers->tail, (unsigned short)bufferCount, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// Hand the kernel everything that's been queued. Returns how many it took
+static inline int uringSubmit(uring *r) {
+	unsigned int submit = r->tail - r->submitted;
+	if (!submit) {
+		return 0;
+	}
+	__atomic_store_n(r->sqTail, r->tail, __ATOMIC_RELEASE);
+	int n = uringEnter(r, submit, 0);
+	if (n > 0) {
+		r->submitted += n;
+	}
+	return n;
+}
+
+// Make sure the next n entries can be queued without a submit between them, as linked ones have to be together
+static inline void uringReserve(uring *r, unsigned int n) {
+	if (r->tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) + n > r->sqEntries) {
+		uringSubmit(r);
+	}
+}
+
+// The next submission entry, cleared. If they're all queued already, those go first
+static inline struct io_uring_sqe *uringSqe(uring *r) {
+	uringReserve(r, 1);
+	struct io_uring_sqe *sqe = &r->sqes[r->tail & r->sqMask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->tail++;
+	return sqe;
+}
+
+// Queue a multishot accept, that completes with each new connection's fd
+static inline struct io_uring_sqe *uringAccept(uring *r, int fd, int flags, unsigned long long data) {
+	struct io_uring_sqe *sqe = uringSqe(r);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = flags;
+	sqe->user_data = data;
+	return sqe;
+}
+
+// Queue a multishot recv, that completes each time something arrives, in one of the receive buffers
+static inline struct io_uring_sqe *uringRecv(uring *r, int fd, unsigned long long data) {
+	struct io_uring_sqe *sqe = uringSqe(r);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = data;
+	return sqe;
+}
+
+// Queue a sendmsg. The msghdr, its iovecs and what they point to have to stay put until it completes
+static inline struct io_uring_sqe *uringSendmsg(uring *r, int fd, struct msghdr *msg, int flags, unsigned long long data) {
+	struct io_uring_sqe *sqe = uringSqe(r);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)msg;
+	sqe->msg_flags = flags;
+	sqe->user_data = data;
+	return sqe;
+}
+
+// Queue a close. It only completes if it fails
+static inline struct io_uring_sqe *uringClose(uring *r, int fd, unsigned long long data) {
+	struct io_uring_sqe *sqe = uringSqe(r);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = data;
+	return sqe;
+}
+
+// Queue cancelling everything that's on the go for a socket. Each of those completes with -ECANCELED (unless it had
+// already finished), and this only completes if there wasn't anything
+static inline struct io_uring_sqe *uringCancel(uring *r, int fd, unsigned long long data) {
+	struct io_uring_sqe *sqe = uringSqe(r);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = data;
+	return sqe;
+}
+
+// Take the next completion off the ring, into 'cqe'. Returns 0 if there aren't any
+static inline int uringNext(uring *r, struct io_uring_cqe *cqe) {
+	unsigned int head = *r->cqHead;
+	if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+		if (!(__atomic_load_n(r->sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) {
+			return 0;
+		}
+		uringEnter(r, 0, IORING_ENTER_GETEVENTS); // Some didn't fit, and the kernel's holding them till there's room
+		if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+	}
+	*cqe = r->cqes[head & r->cqMask];
+	__atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+	r->completions++;
+	return 1;
+}
+
+// The receive buffer a completion's data is in, or NULL if it hasn't got one
+static inline char *uringBuffer(uring *r, struct io_uring_cqe *cqe) {
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		return NULL;
+	}
+	return r->bufferData + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * r->bufferSize;
+}
+
+// Give a receive buffer back for the kernel to use again, once we're done with what's in it
+static inline void uringRecycle(uring *r, struct io_uring_cqe *cqe) {
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		return;
+	}
+	unsigned int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	unsigned short tail = r->buffers->tail;
+	struct io_uring_buf *b = &r->buffers->bufs[tail & (r->bufferCount-1)];
+	b->addr = (unsigned long)(r->bufferData + (size_t)id * r->bufferSize);
+	b->len = r->bufferSize;
+	b->bid = id;
+	__atomic_store_n(&r->buffers->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#endif
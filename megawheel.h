@@ -0,0 +1,137 @@
+// MegaComet timing wheel
+// Keeps track of hundreds of thousands of connection deadlines without an ev_timer (and a heap entry) each.
+// It's hierarchical: level 0 has a slot per tick, level 1 a slot per 64 ticks, and so on, so adding and removing a
+// timer is O(1) however far away it is. Each tick, the slot that's come up (plus any higher level slot that's come
+// around) is spliced whole onto the 'due' list, also O(1). The caller then works through 'due' with a budget, so a
+// tick where 100k connections all time out together gets spread over the following ticks rather than stalling the loop.
+// Timers live in one array and are linked by 32-bit index rather than pointer, so each is 12 bytes. Timer 'id' is
+// stored at timers[WHEEL_HEADS + id], which lets the worker use the fd as the id. Zeroed memory is all unscheduled.
+
+#ifndef _MEGAWHEEL_H
+#define _MEGAWHEEL_H
+
+#define WHEEL_BITS 6 // 64 slots per level
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks, ie 19 days of 100ms ticks, is as far ahead as a timer can be
+#define WHEEL_DUE (WHEEL_LEVELS*WHEEL_SLOTS + 1) // Index of the due list's head. Index 0 isn't used, so 0 can mean 'not linked'
+#define WHEEL_HEADS (WHEEL_DUE + 1) // The list heads come first in the timers array, then the timers themselves
+
+typedef struct wheelTimer {
+	unsigned int next, prev; // Neighbours in the slot (or due) list, next is 0 when it isn't scheduled
+	unsigned int expires; // Which tick it's due on
+} wheelTimer;
+
+typedef struct timingWheel {
+	unsigned int now; // The current tick
+	wheelTimer *timers; // WHEEL_HEADS list heads, then a timer per id
+} timingWheel;
+
+// The list head for a slot
+static inline unsigned int wheelSlot(int level, unsigned int slot) {
+	return 1 + level*WHEEL_SLOTS + slot;
+}
+
+// Append timer i to the list with head h
+static inline void wheelLink(timingWheel *w, unsigned int h, unsigned int i) {
+	wheelTimer *t = w->timers;
+	t[i].prev = t[h].prev;
+	t[i].next = h;
+	t[t[h].prev].next = i;
+	t[h].prev = i;
+}
+
+// Move the whole list with head 'from' onto the end of the list with head 'to'
+static inline void wheelSplice(timingWheel *w, unsigned int to, unsigned int from) {
+	wheelTimer *t = w->timers;
+	if (t[from].next == from) return; // Empty
+	t[t[from].next].prev = t[to].prev;
+	t[t[to].prev].next = t[from].next;
+	t[t[from].prev].next = to;
+	t[to].prev = t[from].prev;
+	t[from].next = t[from].prev = from;
+}
+
+// Set up a wheel. 'timers' needs room for WHEEL_HEADS + the number of ids, zeroed
+static inline void wheelInit(timingWheel *w, wheelTimer *timers, unsigned int now) {
+	w->now = now;
+	w->timers = timers;
+	for (unsigned int h=1; h<WHEEL_HEADS; h++) {
+		timers[h].next = timers[h].prev = h;
+	}
+}
+
+// Is this timer scheduled?
+static inline int wheelPending(timingWheel *w, unsigned int id) {
+	return w->timers[WHEEL_HEADS + id].next != 0;
+}
+
+// Unlink timer i (an index, not an id) from whatever list it's in. Fine to call on one that isn't scheduled
+static inline void wheelUnlink(timingWheel *w, unsigned int i) {
+	wheelTimer *t = w->timers;
+	if (!t[i].next) return;
+	t[t[i].prev].next = t[i].next;
+	t[t[i].next].prev = t[i].prev;
+	t[i].next = t[i].prev = 0;
+}
+
+// Unschedule a timer
+static inline void wheelDel(timingWheel *w, unsigned int id) {
+	wheelUnlink(w, WHEEL_HEADS + id);
+}
+
+// Put timer i in the slot for its expiry tick
+static inline void wheelInsert(timingWheel *w, unsigned int i) {
+	wheelTimer *t = &w->timers[i];
+	unsigned int delta = t->expires - w->now;
+	if ((int)delta <= 0) { // Already due
+		wheelLink(w, WHEEL_DUE, i);
+		return;
+	}
+	int level = 0;
+	while (level < WHEEL_LEVELS-1 && delta >= (1u << (WHEEL_BITS*(level+1)))) {
+		level++;
+	}
+	if (delta >= (1u << (WHEEL_BITS*WHEEL_LEVELS))) { // Too far off, cap it at the furthest we can go
+		t->expires = w->now + (1u << (WHEEL_BITS*WHEEL_LEVELS)) - 1;
+	}
+	wheelLink(w, wheelSlot(level, (t->expires >> (WHEEL_BITS*level)) & (WHEEL_SLOTS-1)), i);
+}
+
+// (Re)schedule a timer for the given tick
+static inline void wheelAdd(timingWheel *w, unsigned int id, unsigned int expires) {
+	unsigned int i = WHEEL_HEADS + id;
+	wheelUnlink(w, i);
+	w->timers[i].expires = expires;
+	wheelInsert(w, i);
+}
+
+// Move the wheel on to the given tick. This only splices lists, so it's cheap however many timers are due
+static inline void wheelAdvance(timingWheel *w, unsigned int now) {
+	while ((int)(now - w->now) > 0) {
+		w->now++;
+		// Whenever a level wraps, the next slot of the level above comes around and its timers need sorting out
+		for (int l=1; l<WHEEL_LEVELS && !(w->now & ((1u << (WHEEL_BITS*l)) - 1)); l++) {
+			wheelSplice(w, WHEEL_DUE, wheelSlot(l, (w->now >> (WHEEL_BITS*l)) & (WHEEL_SLOTS-1)));
+		}
+		wheelSplice(w, WHEEL_DUE, wheelSlot(0, w->now & (WHEEL_SLOTS-1)));
+	}
+}
+
+// Work through at most 'budget' of the due timers: the ones that have expired are unscheduled and their id passed
+// to the callback, the rest (from higher levels) go back into a lower slot. Returns how many were expired
+static inline int wheelExpire(timingWheel *w, int budget, void (*expired)(unsigned int id)) {
+	int count = 0;
+	while (budget-- > 0 && w->timers[WHEEL_DUE].next != WHEEL_DUE) {
+		unsigned int i = w->timers[WHEEL_DUE].next;
+		wheelUnlink(w, i);
+		if ((int)(w->timers[i].expires - w->now) <= 0) {
+			count++;
+			expired(i - WHEEL_HEADS);
+		} else {
+			wheelInsert(w, i);
+		}
+	}
+	return count;
+}
+
+#endif
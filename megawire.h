@@ -0,0 +1,133 @@
+// MegaComet manager protocol
+// Version 1 is the original: "1 n" for worker n saying hello, and "2 clientId\0 message\0" for a message. It has to be
+// parsed a byte at a time, and neither the id nor the message can have a null in it.
+// Version 2 puts the lengths first. Everything is a frame:
+//   type (1 byte), id length (1 byte), payload length (4 bytes, network order), the id, the payload
+// A WIRE_MESSAGE frame's id is the client id and its payload is the message. A WIRE_BATCH frame has no id, and its
+// payload is any number of messages, each an id length (1 byte), a message length (4 bytes), the id and the message.
+// So the receiver knows where everything is from the lengths, and can use the ids and messages right where they are
+// in its receive buffer, and the manager can send a worker a whole batch of messages in one write.
+// The version is agreed when a worker (or app) connects: it sends "3 version role", with the newest version it speaks,
+// and its worker number as the role (or WIRE_APP). The manager answers "3 version" with the one they'll both use.
+// Apps that don't say hello are spoken to in version 1.
+// Channels (megachannel.h) are version 2 only. A WIRE_CHANNEL frame is a message for everyone listening to a channel:
+// its id is the channel. Workers send the manager WIRE_SUBSCRIBE and WIRE_UNSUBSCRIBE frames (with no payload) when
+// they get their first listener for a channel, and when they stop having any, so it knows who to send them to.
+// An app (or megastart) can send the manager a WIRE_STATS frame, with no id or payload, and it answers with one whose
+// payload is its stats, in the Prometheus text format (megastats.h). That one can be longer than a message.
+
+#ifndef _MEGAWIRE_H
+#define _MEGAWIRE_H
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "config.h"
+
+#define WIRE_LEGACY_HELLO 1 // Version 1 commands
+#define WIRE_LEGACY_MESSAGE 2
+#define WIRE_HELLO 3 // Says which version to use
+#define WIRE_MESSAGE 4 // Version 2 frame types
+#define WIRE_BATCH 5
+#define WIRE_CHANNEL 6
+#define WIRE_SUBSCRIBE 7
+#define WIRE_UNSUBSCRIBE 8
+#define WIRE_STATS 9
+#define WIRE_APP 255 // The role an app says hello with
+#define WIRE_HEADER 6 // Bytes in a frame header
+#define WIRE_ITEM_HEADER 5 // Bytes before each message in a batch
+#define WIRE_MAX_FRAME (WIRE_HEADER + WIRE_BATCH_SIZE + MAX_CLIENT_ID_LEN + MAX_MESSAGE_LEN) // A batch, or one message too big for a batch
+#define WIRE_ERROR -1
+
+#if MAX_CLIENT_ID_LEN > 255
+#error "A frame only has a byte for the client id length"
+#endif
+#if MANAGER_BUFFER_SIZE < WIRE_MAX_FRAME
+#error "MANAGER_BUFFER_SIZE has to hold a whole frame"
+#endif
+
+static inline void wirePutLength(unsigned char *p, unsigned int len) {
+	len = htonl(len);
+	memcpy(p, &len, 4);
+}
+
+static inline unsigned int wireGetLength(const unsigned char *p) {
+	unsigned int len;
+	memcpy(&len, p, 4);
+	return ntohl(len);
+}
+
+// Write a frame header. Returns its length
+static inline int wireHeader(unsigned char *p, int type, int idLen, unsigned int payloadLen) {
+	p[0] = type;
+	p[1] = idLen;
+	wirePutLength(p+2, payloadLen);
+	return WIRE_HEADER;
+}
+
+// Write a whole frame: a message, or any of the others. Returns its length
+static inline int wireFrame(unsigned char *p, int type, const char *id, int idLen, const char *payload, int len) {
+	wireHeader(p, type, idLen, len);
+	memcpy(p + WIRE_HEADER, id, idLen);
+	memcpy(p + WIRE_HEADER + idLen, payload, len);
+	return WIRE_HEADER + idLen + len;
+}
+
+// Write a message that's going in a batch. Returns its length
+static inline int wireBatchItem(unsigned char *p, const char *id, int idLen, const char *message, int len) {
+	p[0] = idLen;
+	wirePutLength(p+1, len);
+	memcpy(p + WIRE_ITEM_HEADER, id, idLen);
+	memcpy(p + WIRE_ITEM_HEADER + idLen, message, len);
+	return WIRE_ITEM_HEADER + idLen + len;
+}
+
+// Is a message with these lengths one we'd take?
+static inline int wireValid(unsigned int idLen, unsigned int len) {
+	return idLen > 0 && idLen <= MAX_CLIENT_ID_LEN && len <= MAX_MESSAGE_LEN;
+}
+
+// Go through the complete frames at the start of buf, passing each message to 'message', and any other frames (channel
+// messages, subscriptions and stats requests) to 'other', if it's not NULL. The ids and payloads are pointers into
+// buf, so they're only good until it's reused. Returns how much of buf it got through (what's left is the start of a
+// frame that hasn't all arrived yet), or WIRE_ERROR if it's not valid
+static inline int wireParse(const unsigned char *buf, int len, void (*message)(const char *id, int idLen, const char *msg, int msgLen),
+		void (*other)(int type, const char *id, int idLen, const char *payload, int payloadLen)) {
+	const unsigned char *p = buf, *end = buf + len;
+	while (end - p >= WIRE_HEADER) {
+		int type = p[0], idLen = p[1];
+		unsigned int payloadLen = wireGetLength(p+2);
+		if (type == WIRE_BATCH ? idLen || payloadLen > WIRE_BATCH_SIZE : type == WIRE_MESSAGE ? !wireValid(idLen, payloadLen)
+				: type == WIRE_STATS ? idLen || payloadLen || !other
+				: type < WIRE_CHANNEL || type > WIRE_UNSUBSCRIBE || !other || !wireValid(idLen, payloadLen)) {
+			return WIRE_ERROR;
+		}
+		if (end - p < WIRE_HEADER + idLen + payloadLen) {
+			break; // Wait for the rest
+		}
+		const unsigned char *body = p + WIRE_HEADER;
+		p = body + idLen + payloadLen;
+		if (type == WIRE_MESSAGE) {
+			message((const char*)body, idLen, (const char*)body + idLen, payloadLen);
+			continue;
+		}
+		if (type != WIRE_BATCH) {
+			other(type, (const char*)body, idLen, (const char*)body + idLen, payloadLen);
+			continue;
+		}
+		while (body < p) { // The messages in a batch
+			if (p - body < WIRE_ITEM_HEADER) {
+				return WIRE_ERROR;
+			}
+			int itemIdLen = body[0];
+			unsigned int itemLen = wireGetLength(body+1);
+			if (!wireValid(itemIdLen, itemLen) || p - body - WIRE_ITEM_HEADER < itemIdLen + itemLen) {
+				return WIRE_ERROR;
+			}
+			message((const char*)body + WIRE_ITEM_HEADER, itemIdLen, (const char*)body + WIRE_ITEM_HEADER + itemIdLen, itemLen);
+			body += WIRE_ITEM_HEADER + itemIdLen + itemLen;
+		}
+	}
+	return p - buf;
+}
+
+#endif
@@ -0,0 +1,999 @@
+// This is the mega comet benchmark
+// It times the worker's hot code in isolation, so changes can be compared without a full load test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../config.h"
+#include "../megaparse.h"
+#include "../megaindex.h"
+#include "../megalog.h"
+#include "../megawire.h"
+#include "../megaring.h"
+#include "../megachannel.h"
+#include "../khash.h"
+#include "../klist.h"
+
+// Constants
+#define BENCH_REQUESTS 2000000
+#define BENCH_WIRE_MESSAGES 500000 // How many messages go over loopback in the manager protocol benchmark
+#define BENCH_RING_MESSAGES 1000000 // How many messages the shared ring benchmark sends for the CPU figure
+#define BENCH_RING_PINGS 20000 // And how many it times one at a time for the latency
+#define BENCH_CLIENTS 1000000 // How many client ids the lookup benchmarks have in their tables
+#define BENCH_FANOUT 100000 // How many clients are listening to the channel in the fan-out benchmark
+#define BENCH_POOL_LIVE 100000 // How many things are allocated at once in the pool churn benchmark
+#define BENCH_POOL_OPS 5000000 // And how many are freed and allocated again
+#define BENCH_QUEUE_CLIENTS 10000 // How many clients get messages queued in the queue benchmark
+#define BENCH_QUEUE_DEPTH 4 // How many each, before they're all collected
+#define BENCH_QUEUE_ROUNDS 50
+// What chrome sends for a JSONP script tag, give or take
+#define BENCH_REQUEST "GET /myClientId1234.js?c=1306551234567 HTTP/1.1\r\nHost: comet.example.com:8003\r\nConnection: keep-alive\r\n" \
+	"User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_6_7) AppleWebKit/534.24 (KHTML, like Gecko) Chrome/11.0.696.68 Safari/534.24\r\n" \
+	"Accept: */*\r\nReferer: http://www.example.com/chat\r\nAccept-Encoding: gzip,deflate,sdch\r\nAccept-Language: en-US,en;q=0.8\r\n" \
+	"Accept-Charset: ISO-8859-1,utf-8;q=0.7,*;q=0.3\r\nCookie: session=0123456789abcdef0123456789abcdef\r\n\r\n"
+
+#define LEGACY_HTTP_TEMPLATE "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s" // How responses used to be built
+
+// Useful utilities
+typedef unsigned char byte;
+#define __nop_free(x) // For the klib pools, nothing to free inside what they hold
+
+// The state each parser keeps per connection
+typedef struct benchClient {
+	int readStatus;
+	int clientIdLen;
+	char clientId[MAX_CLIENT_ID_LEN+1];
+} benchClient;
+
+double nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// Allocations are counted by having our own malloc, calloc and realloc, which pass them on to glibc's. The libraries'
+// calls (strdup's, khash's) come here too
+long mallocCalls;
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+void *malloc(size_t size) {
+	mallocCalls++;
+	return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) {
+	mallocCalls++;
+	return __libc_calloc(count, size);
+}
+void *realloc(void *p, size_t size) {
+	mallocCalls++;
+	return __libc_realloc(p, size);
+}
+
+// Cache misses come from the CPU's counter, if perf_event_open lets us have it (see kernel.perf_event_paranoid, and
+// virtual machines often don't have one). Otherwise they're left out
+int missCounter = -1;
+
+void openMissCounter() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	missCounter = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0); // This process, any CPU
+}
+
+long long cacheMisses() {
+	long long misses;
+	if (missCounter < 0 || read(missCounter, &misses, sizeof(misses)) != sizeof(misses)) {
+		return -1;
+	}
+	return misses;
+}
+
+// Each timing goes in the results file as well, if there is one (-o), a line of CSV per timing, so runs from different
+// commits can be compared
+FILE *results;
+
+typedef struct benchTimer {
+	double start;
+	long mallocs;
+	long long misses;
+	double ns, allocs, missesPerOp; // Per op, once it's stopped. missesPerOp is -1 if we can't count them
+} benchTimer;
+
+void benchStart(benchTimer *t) {
+	t->mallocs = mallocCalls;
+	t->misses = cacheMisses();
+	t->start = nowNs();
+}
+
+// Stop the timer, and record how it went for 'ops' of whatever it timed. Returns the ns per op
+double benchStop(benchTimer *t, const char *name, long ops) {
+	double end = nowNs();
+	long long misses = cacheMisses();
+	t->ns = (end - t->start) / ops;
+	t->allocs = (double)(mallocCalls - t->mallocs) / ops;
+	t->missesPerOp = misses >= 0 && t->misses >= 0 ? (double)(misses - t->misses) / ops : -1;
+	if (results) {
+		fprintf(results, "%s,%.2f,%.3f,", name, t->ns, t->allocs);
+		if (t->missesPerOp >= 0) {
+			fprintf(results, "%.3f", t->missesPerOp);
+		}
+		fprintf(results, "\n");
+	}
+	return t->ns;
+}
+
+// Record a timing that wasn't taken with a benchTimer (a rate, or a latency), which has no allocation or miss counts
+void benchRecord(const char *name, double ns) {
+	if (results) {
+		fprintf(results, "%s,%.2f,,\n", name, ns);
+	}
+}
+
+// Print a timing in the usual format
+void benchPrint(const char *name, benchTimer *t) {
+	printf("%-36s %8.1f ns/op %6.2f allocs/op", name, t->ns, t->allocs);
+	if (t->missesPerOp >= 0) {
+		printf(" %7.2f cache misses/op", t->missesPerOp);
+	}
+	printf("\n");
+}
+
+// The original byte at a time state machine from megacomet's readCallback, as the baseline
+// Returns 1 when it finds the end of the headers, -1 to drop the connection
+int legacyParse(benchClient *thisClient, byte *buffer, int read) {
+	for (int i=0; i<read; i++) {
+		if (thisClient->readStatus == 500) {
+			if (buffer[i]=='\n') {
+				thisClient->readStatus = 1000;
+				return 1;
+			}
+		}
+		if (thisClient->readStatus == 400) {
+			if (buffer[i]=='\r') {
+				thisClient->readStatus = 500;
+			} else {
+				thisClient->readStatus = 200;
+			}
+		}
+		if (thisClient->readStatus == 300) {
+			if (buffer[i]=='\n') {
+				thisClient->readStatus = 400;
+			}
+		}
+		if (thisClient->readStatus == 200) {
+			if (buffer[i]=='\r') {
+				thisClient->readStatus = 300;
+			}
+		}
+		if (thisClient->readStatus == 100) {
+			if (buffer[i]=='\n') {
+				thisClient->readStatus = 200;
+			}
+		}
+		if (thisClient->readStatus == 20) {
+			if (buffer[i]=='\r') {
+				thisClient->readStatus = 100;
+			}
+		}
+		if (thisClient->readStatus == 12) {
+			if (buffer[i]=='s') {
+				thisClient->readStatus=20;
+			} else {
+				return -1;
+			}
+		}
+		if (thisClient->readStatus == 11) {
+			if (buffer[i]=='j') {
+				thisClient->readStatus=12;
+			} else {
+				return -1;
+			}
+		}
+		if (thisClient->readStatus == 10) {
+			if (buffer[i]=='.') {
+				thisClient->clientId[thisClient->clientIdLen]=0;
+				thisClient->readStatus = 11;
+			} else {
+				if (thisClient->clientIdLen < MAX_CLIENT_ID_LEN) {
+					thisClient->clientId[thisClient->clientIdLen] = buffer[i];
+					thisClient->clientIdLen++;
+				}
+			}
+		}
+		if (thisClient->readStatus == 0) {
+			if (buffer[i]=='/') {
+				thisClient->readStatus = 10;
+				thisClient->clientIdLen = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+// The current parser, wrapped to look the same as the above
+int megaParse(benchClient *thisClient, byte *buffer, int read) {
+	int used, close = 0;
+	return parseRequest(&thisClient->readStatus, thisClient->clientId, &thisClient->clientIdLen, buffer, read, &used, &close);
+}
+
+// Parse the request BENCH_REQUESTS times, delivered in 'pieces' recv's each
+void benchParser(char *name, int (*parse)(benchClient*, byte*, int), int pieces) {
+	byte *req = (byte*)BENCH_REQUEST;
+	int len = strlen(BENCH_REQUEST);
+	benchClient client;
+	int done = 0;
+	benchTimer t;
+	benchStart(&t);
+	for (int r=0; r<BENCH_REQUESTS; r++) {
+		client.readStatus = 0;
+		client.clientIdLen = 0;
+		int off = 0;
+		for (int p=1; p<=pieces; p++) {
+			int end = p==pieces ? len : len*p/pieces - 1; // Split off-centre so the pieces cut the id and the \r\n's
+			if (parse(&client, req+off, end-off) == 1) done++;
+			off = end;
+		}
+	}
+	double ns = benchStop(&t, name, BENCH_REQUESTS);
+	if (done != BENCH_REQUESTS || strcmp(client.clientId, "myClientId1234")) {
+		printf("%s: parser failed\n", name);
+		exit(1);
+	}
+	printf("%-28s %8.1f ns/request %8.1f MB/s\n", name, ns, len*1000/ns);
+}
+
+// Build the response for a message of each size, the old way (snprintf into a buffer, then strlen it for the write)
+// and the current way (an iovec of the prebuilt header parts and the message). Reports the bytes copied in user space
+void benchResponse(int messageLen) {
+	static char httpResponse[MAX_MESSAGE_LEN + 80];
+	static char httpLengths[MAX_MESSAGE_LEN+1][HTTP_LENGTH_SIZE];
+	static int httpLengthsLen[MAX_MESSAGE_LEN+1];
+	for (int len=0; len<=MAX_MESSAGE_LEN; len++) {
+		httpLengthsLen[len] = snprintf(httpLengths[len], HTTP_LENGTH_SIZE, "%d" HTTP_HEADER_END, len);
+	}
+	char message[MAX_MESSAGE_LEN+1];
+	memset(message, 'x', messageLen);
+	message[messageLen] = 0;
+
+	long total = 0;
+	char name[48];
+	benchTimer t;
+	snprintf(name, sizeof(name), "response snprintf %d", messageLen);
+	benchStart(&t);
+	for (int r=0; r<BENCH_REQUESTS; r++) {
+		snprintf(httpResponse, sizeof(httpResponse), LEGACY_HTTP_TEMPLATE, messageLen, message);
+		total += strlen(httpResponse);
+		__asm__ volatile("" : : "r"(httpResponse) : "memory"); // Don't let the compiler skip it
+	}
+	double legacyNs = benchStop(&t, name, BENCH_REQUESTS);
+	int legacyCopied = total / BENCH_REQUESTS;
+
+	struct iovec iov[3];
+	total = 0;
+	snprintf(name, sizeof(name), "response iovec %d", messageLen);
+	benchStart(&t);
+	for (int r=0; r<BENCH_REQUESTS; r++) {
+		iov[0].iov_base = HTTP_HEADER_START;
+		iov[0].iov_len = sizeof(HTTP_HEADER_START)-1;
+		iov[1].iov_base = httpLengths[messageLen];
+		iov[1].iov_len = httpLengthsLen[messageLen];
+		iov[2].iov_base = message;
+		iov[2].iov_len = messageLen;
+		total += iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+		__asm__ volatile("" : : "r"(iov) : "memory");
+	}
+	double iovNs = benchStop(&t, name, BENCH_REQUESTS);
+
+	printf("response %4d byte message   snprintf %6.1f ns, %4d bytes copied   writev iovec %6.1f ns, 0 bytes copied\n",
+		messageLen, legacyNs, legacyCopied, iovNs);
+}
+
+// Add, look up (and look up as many that aren't there) and delete 'clients' clients in a khash of strdup'd ids, the
+// way the worker used to for both its clientStatuses and queue hashes, and in the client index
+KHASH_MAP_INIT_STR(benchHash, int);
+void benchLookups(int clients) {
+	static char ids[BENCH_CLIENTS][16], missing[BENCH_CLIENTS][16];
+	static int lens[BENCH_CLIENTS], missingLens[BENCH_CLIENTS];
+	for (int i=0; i<clients; i++) {
+		lens[i] = sprintf(ids[i], "user%07d", i);
+		missingLens[i] = sprintf(missing[i], "nobody%07d", i);
+	}
+	char name[48];
+	benchTimer t;
+
+	khash_t(benchHash) *hash = kh_init(benchHash);
+	snprintf(name, sizeof(name), "khash str insert %d", clients);
+	benchStart(&t);
+	for (int i=0; i<clients; i++) {
+		int ret;
+		khiter_t k = kh_put(benchHash, hash, strdup(ids[i]), &ret);
+		kh_value(hash, k) = i;
+	}
+	double insertNs = benchStop(&t, name, clients), insertAllocs = t.allocs;
+	double bytes = (double)kh_n_buckets(hash) * (sizeof(char*) + sizeof(int) + 0.25) / clients;
+	long found = 0;
+	snprintf(name, sizeof(name), "khash str lookup %d", clients);
+	benchStart(&t);
+	for (int i=0; i<clients; i++) {
+		found += kh_get(benchHash, hash, ids[(int)((long)i*7919 % clients)]) != kh_end(hash);
+		found += kh_get(benchHash, hash, missing[i]) != kh_end(hash);
+	}
+	double lookupNs = benchStop(&t, name, clients*2);
+	snprintf(name, sizeof(name), "khash str delete %d", clients);
+	benchStart(&t);
+	for (int i=0; i<clients; i++) {
+		khiter_t k = kh_get(benchHash, hash, ids[(int)((long)i*7919 % clients)]);
+		free((char*)kh_key(hash, k));
+		kh_del(benchHash, hash, k);
+	}
+	double deleteNs = benchStop(&t, name, clients);
+	printf("khash str    %7d  insert %6.1f ns  lookup %6.1f ns  delete %6.1f ns  %4.2f allocs/insert  %5.1f bytes/client + the strdup\n",
+		clients, insertNs, lookupNs, deleteNs, insertAllocs, bytes);
+	kh_destroy(benchHash, hash);
+
+	static slabStore ids2;
+	memset(&ids2, 0, sizeof(ids2));
+	clientIndex index;
+	indexInit(&index, &ids2);
+	snprintf(name, sizeof(name), "client index insert %d", clients);
+	benchStart(&t);
+	for (int i=0; i<clients; i++) {
+		indexAdd(&index, ids[i], lens[i], indexHash(ids[i], lens[i]))->fd = i;
+	}
+	insertNs = benchStop(&t, name, clients);
+	insertAllocs = t.allocs;
+	bytes = (double)index.groups * INDEX_GROUP * (sizeof(indexEntry) + 1) / clients;
+	double idBytes = (double)ids2.bytes / clients;
+	long found2 = 0;
+	snprintf(name, sizeof(name), "client index lookup %d", clients);
+	benchStart(&t);
+	for (int i=0; i<clients; i++) {
+		int c = (int)((long)i*7919 % clients);
+		found2 += indexFind(&index, ids[c], lens[c], indexHash(ids[c], lens[c])) != NULL;
+		found2 += indexFind(&index, missing[i], missingLens[i], indexHash(missing[i], missingLens[i])) != NULL;
+	}
+	lookupNs = benchStop(&t, name, clients*2);
+	snprintf(name, sizeof(name), "client index delete %d", clients);
+	benchStart(&t);
+	for (int i=0; i<clients; i++) {
+		int c = (int)((long)i*7919 % clients);
+		indexDel(&index, indexFind(&index, ids[c], lens[c], indexHash(ids[c], lens[c])));
+	}
+	deleteNs = benchStop(&t, name, clients);
+	printf("client index %7d  insert %6.1f ns  lookup %6.1f ns  delete %6.1f ns  %4.2f allocs/insert  %5.1f bytes/client + %.1f of interned id\n",
+		clients, insertNs, lookupNs, deleteNs, insertAllocs, bytes, idBytes);
+	if (found != clients || found2 != clients || index.count) {
+		puts("lookups failed");
+		exit(1);
+	}
+}
+
+// Keep BENCH_POOL_LIVE things allocated, freeing a random one and allocating another in its place, BENCH_POOL_OPS
+// times: from a kmempool, the way the worker used to get its clientStatuses from csPool, and from the slab
+typedef struct benchStatus {
+	char bytes[80]; // About what a clientStatus was, with its ev_io
+} benchStatus;
+KMEMPOOL_INIT(benchPool, benchStatus, __nop_free);
+void benchPool() {
+	static benchStatus *live[BENCH_POOL_LIVE];
+	static unsigned int liveSlots[BENCH_POOL_LIVE];
+	benchTimer t;
+	unsigned int r = 1;
+
+	kmempool_t(benchPool) *pool = kmp_init(benchPool);
+	for (int i=0; i<BENCH_POOL_LIVE; i++) {
+		live[i] = kmp_alloc(benchPool, pool);
+	}
+	benchStart(&t);
+	for (int i=0; i<BENCH_POOL_OPS; i++) {
+		r = r * 1103515245 + 12345;
+		int victim = (r >> 8) % BENCH_POOL_LIVE;
+		kmp_free(benchPool, pool, live[victim]);
+		live[victim] = kmp_alloc(benchPool, pool);
+		live[victim]->bytes[0] = i; // Touch it, as the worker would
+	}
+	benchStop(&t, "pool churn kmempool", BENCH_POOL_OPS);
+	benchPrint("pool churn kmempool (free + alloc)", &t);
+	for (int i=0; i<BENCH_POOL_LIVE; i++) {
+		kmp_free(benchPool, pool, live[i]);
+	}
+	kmp_destroy(benchPool, pool);
+
+	// Every slot has to be reused once it's freed, including slot 0 of the classes above the first
+	static slabStore reuse;
+	unsigned int first[10];
+	for (int i=0; i<10; i++) {
+		first[i] = slabAlloc(&reuse, 32);
+	}
+	for (int i=0; i<10; i++) {
+		slabFree(&reuse, first[i]);
+	}
+	for (int i=0; i<10; i++) {
+		if ((slabAlloc(&reuse, 32) & ((1u << SLAB_SLOT_BITS) - 1)) >= 10) {
+			puts("slab reuse failed");
+			exit(1);
+		}
+	}
+
+	static slabStore slab;
+	for (int i=0; i<BENCH_POOL_LIVE; i++) {
+		liveSlots[i] = slabAlloc(&slab, sizeof(benchStatus));
+	}
+	r = 1;
+	benchStart(&t);
+	for (int i=0; i<BENCH_POOL_OPS; i++) {
+		r = r * 1103515245 + 12345;
+		int victim = (r >> 8) % BENCH_POOL_LIVE;
+		slabFree(&slab, liveSlots[victim]);
+		liveSlots[victim] = slabAlloc(&slab, sizeof(benchStatus));
+		slabPtr(&slab, liveSlots[victim])[0] = i;
+	}
+	benchStop(&t, "pool churn slab", BENCH_POOL_OPS);
+	benchPrint("pool churn slab (free + alloc)", &t);
+}
+
+// Queue BENCH_QUEUE_DEPTH messages for each of BENCH_QUEUE_CLIENTS clients, then collect them all, oldest first
+// The legacy way: a khash of strdup'd client ids to klists of strdup'd messages, each list freed once it's empty
+KLIST_INIT(benchMessages, char*, __nop_free);
+KHASH_MAP_INIT_STR(benchQueue, klist_t(benchMessages)*);
+
+// And the current way, the same as megacomet's queueMessage and shiftMessage less the lingering and the stats: a
+// client index entry pointing at a circular list of slab slots, which are on the expiry list too
+typedef struct benchQueued {
+	unsigned int next, older, newer, clientId, queuedAt;
+	int len;
+	char message[];
+} benchQueued;
+slabStore queueSlab, queueIds;
+clientIndex queueIndex;
+unsigned int queueOldest, queueNewest;
+#define benchQueued(handle) ((benchQueued*)slabPtr(&queueSlab, handle))
+
+void benchQueueMessage(indexEntry *entry, const char *message, int len) {
+	unsigned int handle = slabAlloc(&queueSlab, sizeof(benchQueued) + len + 1);
+	benchQueued *m = benchQueued(handle);
+	memcpy(m->message, message, len);
+	m->message[len] = 0;
+	m->len = len;
+	m->clientId = entry->id;
+	if (!entry->messages) {
+		m->next = handle;
+	} else {
+		m->next = benchQueued(entry->messages)->next;
+		benchQueued(entry->messages)->next = handle;
+	}
+	entry->messages = handle;
+	m->older = queueNewest;
+	m->newer = 0;
+	if (queueNewest) {
+		benchQueued(queueNewest)->newer = handle;
+	} else {
+		queueOldest = handle;
+	}
+	queueNewest = handle;
+}
+
+unsigned int benchShiftMessage(indexEntry *entry) {
+	benchQueued *newest = benchQueued(entry->messages);
+	unsigned int oldest = newest->next;
+	if (oldest == entry->messages) {
+		entry->messages = 0;
+		indexDel(&queueIndex, entry);
+	} else {
+		newest->next = benchQueued(oldest)->next;
+	}
+	benchQueued *m = benchQueued(oldest);
+	if (m->older) benchQueued(m->older)->newer = m->newer; else queueOldest = m->newer;
+	if (m->newer) benchQueued(m->newer)->older = m->older; else queueNewest = m->older;
+	return oldest;
+}
+
+void benchQueue(int messageLen) {
+	static char ids[BENCH_QUEUE_CLIENTS][16];
+	static int lens[BENCH_QUEUE_CLIENTS];
+	for (int i=0; i<BENCH_QUEUE_CLIENTS; i++) {
+		lens[i] = sprintf(ids[i], "user%07d", i);
+	}
+	char message[MAX_MESSAGE_LEN+1], name[48];
+	memset(message, 'x', messageLen);
+	message[messageLen] = 0;
+	long ops = (long)BENCH_QUEUE_ROUNDS * BENCH_QUEUE_CLIENTS * BENCH_QUEUE_DEPTH, got = 0;
+	benchTimer t;
+
+	khash_t(benchQueue) *queue = kh_init(benchQueue);
+	snprintf(name, sizeof(name), "queue klist %d", messageLen);
+	benchStart(&t);
+	for (int round=0; round<BENCH_QUEUE_ROUNDS; round++) {
+		for (int d=0; d<BENCH_QUEUE_DEPTH; d++) {
+			for (int i=0; i<BENCH_QUEUE_CLIENTS; i++) {
+				khiter_t q = kh_get(benchQueue, queue, ids[i]);
+				if (q == kh_end(queue)) {
+					int ret;
+					q = kh_put(benchQueue, queue, strdup(ids[i]), &ret);
+					kh_value(queue, q) = kl_init(benchMessages);
+				}
+				*kl_pushp(benchMessages, kh_value(queue, q)) = strdup(message);
+			}
+		}
+		for (int i=0; i<BENCH_QUEUE_CLIENTS; i++) {
+			khiter_t q = kh_get(benchQueue, queue, ids[i]);
+			char *m;
+			while (kl_shift(benchMessages, kh_value(queue, q), &m) == 0) {
+				got += strlen(m) == messageLen;
+				free(m);
+			}
+			kl_destroy(benchMessages, kh_value(queue, q));
+			free((char*)kh_key(queue, q));
+			kh_del(benchQueue, queue, q);
+		}
+	}
+	benchStop(&t, name, ops);
+	snprintf(name, sizeof(name), "queue klist %d bytes (push + shift)", messageLen);
+	benchPrint(name, &t);
+	kh_destroy(benchQueue, queue);
+
+	indexInit(&queueIndex, &queueIds);
+	snprintf(name, sizeof(name), "queue slab %d", messageLen);
+	benchStart(&t);
+	for (int round=0; round<BENCH_QUEUE_ROUNDS; round++) {
+		for (int d=0; d<BENCH_QUEUE_DEPTH; d++) {
+			for (int i=0; i<BENCH_QUEUE_CLIENTS; i++) {
+				benchQueueMessage(indexAdd(&queueIndex, ids[i], lens[i], indexHash(ids[i], lens[i])), message, messageLen);
+			}
+		}
+		for (int i=0; i<BENCH_QUEUE_CLIENTS; i++) {
+			indexEntry *entry = indexFind(&queueIndex, ids[i], lens[i], indexHash(ids[i], lens[i]));
+			while (entry && entry->messages) {
+				unsigned int m = benchShiftMessage(entry);
+				got += benchQueued(m)->len == messageLen;
+				slabFree(&queueSlab, m);
+			}
+		}
+	}
+	benchStop(&t, name, ops);
+	snprintf(name, sizeof(name), "queue slab %d bytes (push + shift)", messageLen);
+	benchPrint(name, &t);
+	if (got != ops*2 || queueIndex.count) {
+		puts("queue failed");
+		exit(1);
+	}
+}
+
+// What a log call costs the event loop: when its level is turned off, when its site is over the rate limit, and when
+// it goes in the ring (which is emptied as if by the writer, without the writing)
+void benchLogging() {
+	char clientId[] = "myClientId1234";
+	logLevel = LOG_ERROR;
+	double start = nowNs();
+	for (int r=0; r<BENCH_REQUESTS; r++) {
+		logAt(LOG_INFO, "Message arrived for %s, %d bytes", clientId, r);
+		__asm__ volatile("" : : : "memory");
+	}
+	double offNs = (nowNs() - start) / BENCH_REQUESTS;
+
+	logLevel = LOG_INFO;
+	start = nowNs();
+	for (int r=0; r<BENCH_REQUESTS; r++) {
+		logAt(LOG_INFO, "Message arrived for %s, %d bytes", clientId, r); // All but the first LOG_RATE_LIMIT are dropped
+	}
+	double limitedNs = (nowNs() - start) / BENCH_REQUESTS;
+
+	start = nowNs();
+	for (int r=0; r<BENCH_REQUESTS; r++) {
+		logSite site = {0};
+		logWrite(&site, LOG_INFO, "Message arrived for %s, %d bytes", clientId, r);
+		logMine->tail = logMine->head;
+	}
+	double ringNs = (nowNs() - start) / BENCH_REQUESTS;
+	printf("log call           level off %5.1f ns  rate limited %5.1f ns  into the ring %5.1f ns\n", offNs, limitedNs, ringNs);
+}
+
+// A loopback connection to ourselves: the listening end's accepted socket comes back, and *sender is the other end
+int loopbackPair(int *sender) {
+	int listener = socket(PF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	bind(listener, (struct sockaddr*)&addr, len);
+	listen(listener, 1);
+	getsockname(listener, (struct sockaddr*)&addr, &len);
+	*sender = socket(PF_INET, SOCK_STREAM, 0);
+	connect(*sender, (struct sockaddr*)&addr, len);
+	int receiver = accept(listener, NULL, NULL);
+	close(listener);
+	return receiver;
+}
+
+// Sends the manager protocol messages for the wire benchmark, as the manager does. Runs in the child
+void wireSend(int sd, int framed, int messageLen) {
+	char clientId[] = "myClientId1234", message[MAX_MESSAGE_LEN];
+	int idLen = strlen(clientId);
+	memset(message, 'x', messageLen);
+	static byte batch[WIRE_HEADER + WIRE_BATCH_SIZE];
+	int len = 0;
+	for (int m=0; m<BENCH_WIRE_MESSAGES; m++) {
+		if (!framed) { // Version 1: a write per message
+			byte command[MAX_CLIENT_ID_LEN + MAX_MESSAGE_LEN + 3];
+			command[0] = WIRE_LEGACY_MESSAGE;
+			memcpy(command+1, clientId, idLen+1);
+			memcpy(command+2+idLen, message, messageLen);
+			command[2+idLen+messageLen] = 0;
+			write(sd, command, 3+idLen+messageLen);
+			continue;
+		}
+		if (len + WIRE_ITEM_HEADER + idLen + messageLen > WIRE_BATCH_SIZE) {
+			wireHeader(batch, WIRE_BATCH, 0, len);
+			write(sd, batch, WIRE_HEADER + len);
+			len = 0;
+		}
+		len += wireBatchItem(batch + WIRE_HEADER + len, clientId, idLen, message, messageLen);
+	}
+	if (len) {
+		wireHeader(batch, WIRE_BATCH, 0, len);
+		write(sd, batch, WIRE_HEADER + len);
+	}
+}
+
+// What the receiving end does with each message: count it, and touch it the way the worker would
+int wireReceived;
+unsigned int wireChecksum;
+double *wireLatencies; // If it's timing each message, how long each took to arrive. The message starts with when it was sent
+void wireArrived(const char *clientId, int clientIdLen, const char *message, int len) {
+	if (wireLatencies) {
+		double sent;
+		memcpy(&sent, message, sizeof(sent));
+		wireLatencies[wireReceived] = nowNs() - sent;
+	}
+	wireReceived++;
+	wireChecksum += indexHash(clientId, clientIdLen) + message[len-1];
+}
+
+// The worker's version 1 parser: a recv of BUFFER_SIZE, then a byte at a time into the id and message
+void wireLegacyReceive(int sd) {
+	static byte buffer[BUFFER_SIZE], clientId[MAX_CLIENT_ID_LEN+1], message[MAX_MESSAGE_LEN+1];
+	int status = 0, idLen = 0, len = 0;
+	while (wireReceived < BENCH_WIRE_MESSAGES) {
+		int read = recv(sd, buffer, BUFFER_SIZE, 0);
+		if (read <= 0) break;
+		for (int i=0; i<read; i++) {
+			if (status == 0) {
+				if (buffer[i] == WIRE_LEGACY_MESSAGE) {
+					status = 200;
+					idLen = len = 0;
+				}
+			} else if (status == 200) {
+				if (buffer[i] == 0) {
+					clientId[idLen] = 0;
+					status = 201;
+				} else if (idLen < MAX_CLIENT_ID_LEN) {
+					clientId[idLen++] = buffer[i];
+				}
+			} else if (buffer[i] == 0) {
+				message[len] = 0;
+				wireArrived((char*)clientId, idLen, (char*)message, len);
+				status = 0;
+			} else if (len < MAX_MESSAGE_LEN) {
+				message[len++] = buffer[i];
+			}
+		}
+	}
+}
+
+// Version 2: recv as much as there's room for, and take the messages from where they are in the buffer
+void wireFramedReceive(int sd, int count) {
+	static byte buffer[MANAGER_BUFFER_SIZE];
+	int buffered = 0;
+	while (wireReceived < count) {
+		int read = recv(sd, buffer + buffered, MANAGER_BUFFER_SIZE - buffered, 0);
+		if (read <= 0) break;
+		int len = buffered + read, used = wireParse(buffer, len, wireArrived, NULL);
+		if (used == WIRE_ERROR) break;
+		buffered = len - used;
+		memmove(buffer, buffer + used, buffered);
+	}
+}
+
+// Messages per second from the manager to a worker, over loopback, in each version of the protocol
+void benchWire(int messageLen) {
+	double rates[2];
+	for (int framed=0; framed<2; framed++) {
+		int sender, receiver = loopbackPair(&sender);
+		wireReceived = 0;
+		double start = nowNs();
+		pid_t child = fork();
+		if (!child) {
+			close(receiver);
+			wireSend(sender, framed, messageLen);
+			close(sender);
+			_exit(0);
+		}
+		close(sender);
+		if (framed) wireFramedReceive(receiver, BENCH_WIRE_MESSAGES); else wireLegacyReceive(receiver);
+		rates[framed] = wireReceived / ((nowNs() - start) / 1e9);
+		close(receiver);
+		waitpid(child, NULL, 0);
+		if (wireReceived != BENCH_WIRE_MESSAGES) {
+			printf("manager protocol: only got %d of %d messages\n", wireReceived, BENCH_WIRE_MESSAGES);
+		}
+	}
+	printf("manager protocol %4d bytes  v1 %8.0f msgs/s  v2 batched %8.0f msgs/s\n", messageLen, rates[0], rates[1]);
+	char name[48];
+	snprintf(name, sizeof(name), "manager protocol v1 %d", messageLen);
+	benchRecord(name, 1e9 / rates[0]);
+	snprintf(name, sizeof(name), "manager protocol v2 %d", messageLen);
+	benchRecord(name, 1e9 / rates[1]);
+}
+
+// What the worker does with its ring: wait for the eventfd, then take everything there until it's empty
+void ringReceive(sharedRing *ring, int count) {
+	while (wireReceived < count) {
+		struct pollfd p = { .fd = ring->dataEvent, .events = POLLIN };
+		poll(&p, 1, -1);
+		unsigned long long n;
+		read(ring->dataEvent, &n, sizeof(n));
+		do {
+			byte *start;
+			unsigned long len;
+			while ((len = ringReadable(ring, &start))) {
+				ringConsume(ring, wireParse(start, len, wireArrived, NULL));
+			}
+		} while (!ringSleep(ring) && wireReceived < count);
+	}
+}
+
+// The manager's side: batches of messages, or one at a time with a pause between (and when it was sent in each)
+void ringSend(int sd, sharedRing *ring, int count, int perBatch, int messageLen) {
+	char clientId[] = "myClientId1234", message[MAX_MESSAGE_LEN];
+	int idLen = strlen(clientId);
+	memset(message, 'x', messageLen);
+	static byte batch[WIRE_HEADER + WIRE_BATCH_SIZE];
+	int len = 0, inBatch = 0;
+	for (int m=0; m<count; m++) {
+		double sent = nowNs();
+		memcpy(message, &sent, sizeof(sent));
+		len += wireBatchItem(batch + WIRE_HEADER + len, clientId, idLen, message, messageLen);
+		if (++inBatch < perBatch && m < count-1 && len + WIRE_ITEM_HEADER + idLen + messageLen <= WIRE_BATCH_SIZE) {
+			continue;
+		}
+		wireHeader(batch, WIRE_BATCH, 0, len);
+		if (ring) ringWrite(ring, batch, WIRE_HEADER + len); else write(sd, batch, WIRE_HEADER + len);
+		len = inBatch = 0;
+		if (perBatch == 1) {
+			struct timespec pause = { 0, 20000 };
+			nanosleep(&pause, NULL);
+		}
+	}
+}
+
+double cpuNs() { // Of this process and its children that have been waited for
+	struct rusage self, children;
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	return (self.ru_utime.tv_sec + self.ru_stime.tv_sec + children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1e9
+		+ (self.ru_utime.tv_usec + self.ru_stime.tv_usec + children.ru_utime.tv_usec + children.ru_stime.tv_usec) * 1e3;
+}
+
+int compareDoubles(const void *a, const void *b) {
+	return *(double*)a < *(double*)b ? -1 : *(double*)a > *(double*)b;
+}
+
+// Manager to worker over TCP loopback versus the shared ring: latency of a message on its own, and the CPU (both
+// processes) per million messages sent in batches of 64 (or as many as fit)
+void benchRing(int messageLen) {
+	static double latencies[BENCH_RING_PINGS];
+	for (int useRing=0; useRing<2; useRing++) {
+		double median = 0, p99 = 0, cpu = 0;
+		for (int timing=1; timing>=0; timing--) {
+			int count = timing ? BENCH_RING_PINGS : BENCH_RING_MESSAGES;
+			sharedRing ring;
+			int sender, receiver = loopbackPair(&sender);
+			if (useRing && !ringCreate(&ring, SHARED_RING_SIZE, -1)) {
+				printf("shared ring: couldn't make one\n");
+				return;
+			}
+			wireReceived = 0;
+			wireLatencies = timing ? latencies : NULL;
+			double startCpu = cpuNs();
+			pid_t child = fork();
+			if (!child) {
+				close(receiver);
+				ringSend(sender, useRing ? &ring : NULL, count, timing ? 1 : 64, messageLen);
+				close(sender);
+				_exit(0);
+			}
+			close(sender);
+			if (useRing) ringReceive(&ring, count); else wireFramedReceive(receiver, count);
+			waitpid(child, NULL, 0);
+			close(receiver);
+			if (useRing) ringClose(&ring);
+			if (timing) {
+				qsort(latencies, wireReceived, sizeof(double), compareDoubles);
+				median = latencies[wireReceived/2] / 1000;
+				p99 = latencies[wireReceived*99/100] / 1000;
+			} else {
+				cpu = (cpuNs() - startCpu) / 1e6 * (1000000. / count);
+			}
+		}
+		wireLatencies = NULL;
+		printf("manager to worker %4d bytes  %-12s latency median %6.1f us  p99 %6.1f us   CPU %6.0f ms per million\n",
+			messageLen, useRing ? "shared ring" : "TCP loopback", median, p99, cpu);
+		char name[48];
+		snprintf(name, sizeof(name), "manager to worker %s median %d", useRing ? "ring" : "tcp", messageLen);
+		benchRecord(name, median * 1000);
+		snprintf(name, sizeof(name), "manager to worker %s p99 %d", useRing ? "ring" : "tcp", messageLen);
+		benchRecord(name, p99 * 1000);
+		snprintf(name, sizeof(name), "manager to worker %s cpu %d", useRing ? "ring" : "tcp", messageLen);
+		benchRecord(name, cpu); // ms per million is ns each
+	}
+}
+
+// What the fan-out benchmark's callbacks work on
+clientIndex *fanoutClients;
+channelIndex *fanoutChannels;
+unsigned int *fanoutConns; // Each subscriber's channels
+int *fanout;
+int fanoutOut; // /dev/null, where the responses go
+long fanoutSent, fanoutCopied;
+char fanoutLength[HTTP_LENGTH_SIZE];
+
+// Respond to a client the way the worker does, with the body from wherever it is
+void fanoutWrite(const char *body, int len) {
+	struct iovec iov[3] = { { HTTP_HEADER_START, sizeof(HTTP_HEADER_START)-1 }, { fanoutLength, strlen(fanoutLength) },
+		{ (void*)body, len } };
+	fanoutSent += writev(fanoutOut, iov, 3) > 0;
+}
+
+// A client message in a batch: find who it's for, and send it
+void fanoutMessage(const char *clientId, int clientIdLen, const char *message, int len) {
+	if (indexFind(fanoutClients, clientId, clientIdLen, indexHash(clientId, clientIdLen))) {
+		fanoutWrite(message, len);
+	}
+}
+
+// A channel message: one copy of the body, sent to each subscriber, who come off their channels as they're answered
+void fanoutChannel(int type, const char *channel, int channelLen, const char *message, int len) {
+	indexEntry *e = channelFind(fanoutChannels, channel, channelLen);
+	int count = 0;
+	for (unsigned int s = e->messages; s; s = channelSub(fanoutChannels, s)->next) {
+		fanout[count++] = channelSub(fanoutChannels, s)->fd;
+	}
+	char *body = malloc(len);
+	memcpy(body, message, len);
+	fanoutCopied += len;
+	for (int i=0; i<count; i++) {
+		channelLeaveAll(fanoutChannels, &fanoutConns[fanout[i]]);
+		fanoutWrite(body, len);
+	}
+	free(body);
+}
+
+// One message for BENCH_FANOUT waiting clients: sent as that many client messages (a batch item each, as the manager
+// would send them, each looked up in the client index), and as one channel message that the worker shares out
+void benchFanout(int messageLen) {
+	static char ids[BENCH_FANOUT][16];
+	static unsigned int conns[BENCH_FANOUT];
+	static int fds[BENCH_FANOUT];
+	static slabStore idSlab;
+	clientIndex clients;
+	channelIndex channels;
+	indexInit(&clients, &idSlab);
+	channelInit(&channels);
+	fanoutClients = &clients;
+	fanoutChannels = &channels;
+	fanoutConns = conns;
+	fanout = fds;
+	fanoutOut = open("/dev/null", O_WRONLY);
+	snprintf(fanoutLength, HTTP_LENGTH_SIZE, "%d" HTTP_HEADER_END, messageLen);
+	char message[MAX_MESSAGE_LEN];
+	memset(message, 'x', messageLen);
+
+	// The client messages, a batch at a time
+	byte *wire = malloc((long)BENCH_FANOUT * (WIRE_HEADER + WIRE_ITEM_HEADER + 16 + messageLen));
+	long wireLen = 0;
+	for (int i=0, batchStart=-1; i<BENCH_FANOUT; i++) {
+		int len = sprintf(ids[i], "user%07d", i);
+		indexAdd(&clients, ids[i], len, indexHash(ids[i], len))->fd = i;
+		if (batchStart < 0) {
+			batchStart = wireLen;
+			wireLen += WIRE_HEADER;
+		}
+		wireLen += wireBatchItem(wire + wireLen, ids[i], len, message, messageLen);
+		if (i == BENCH_FANOUT-1 || wireLen - batchStart + WIRE_ITEM_HEADER + 16 + messageLen > WIRE_BATCH_SIZE) {
+			wireHeader(wire + batchStart, WIRE_BATCH, 0, wireLen - batchStart - WIRE_HEADER);
+			batchStart = -1;
+		}
+	}
+	fanoutSent = 0;
+	double start = nowNs();
+	wireParse(wire, wireLen, fanoutMessage, NULL);
+	double clientsMs = (nowNs() - start) / 1e6;
+	long clientsSent = fanoutSent;
+
+	// The channel message
+	for (int i=0; i<BENCH_FANOUT; i++) {
+		channelSubscribe(&channels, "news", 4, i, &conns[i]);
+	}
+	int frameLen = wireFrame(wire, WIRE_CHANNEL, "news", 4, message, messageLen);
+	fanoutSent = fanoutCopied = 0;
+	start = nowNs();
+	wireParse(wire, frameLen, NULL, fanoutChannel);
+	double channelMs = (nowNs() - start) / 1e6;
+	if (clientsSent != BENCH_FANOUT || fanoutSent != BENCH_FANOUT || channels.subs.slots) {
+		puts("fan-out failed");
+		exit(1);
+	}
+	printf("fan-out to %d %4d bytes  client messages %6.1f ms, %8ld bytes from the manager   channel %6.1f ms, %4d bytes from the manager, %4ld copied\n",
+		BENCH_FANOUT, messageLen, clientsMs, wireLen, channelMs, frameLen, fanoutCopied);
+	char name[48];
+	snprintf(name, sizeof(name), "fan-out client messages %d", messageLen); // Per listener
+	benchRecord(name, clientsMs * 1e6 / BENCH_FANOUT);
+	snprintf(name, sizeof(name), "fan-out channel %d", messageLen);
+	benchRecord(name, channelMs * 1e6 / BENCH_FANOUT);
+	free(wire);
+	close(fanoutOut);
+}
+
+int main(int argc, char **args) {
+	if (argc == 3 && !strcmp(args[1], "-o")) {
+		results = fopen(args[2], "w");
+		if (!results) {
+			perror(args[2]);
+			return 1;
+		}
+		fprintf(results, "benchmark,ns_per_op,allocs_per_op,cache_misses_per_op\n");
+	} else if (argc > 1) {
+		puts("Usage: megabench [-o results.csv]");
+		return 1;
+	}
+	openMissCounter();
+	if (missCounter < 0) {
+		puts("No cache miss counter here (perf_event_open isn't allowed, or there's no PMU), so they're left out");
+	}
+	printf("Request is %d bytes, %d requests per run\n", (int)strlen(BENCH_REQUEST), BENCH_REQUESTS);
+	benchParser("parser legacy whole", legacyParse, 1);
+	benchParser("parser legacy 3 pieces", legacyParse, 3);
+	benchParser("parser simd whole", megaParse, 1);
+	benchParser("parser simd 3 pieces", megaParse, 3);
+	benchParser("parser legacy 16 byte pieces", legacyParse, strlen(BENCH_REQUEST) / 16); // Dribbled in, the worst case
+	benchParser("parser simd 16 byte pieces", megaParse, strlen(BENCH_REQUEST) / 16);
+	benchResponse(16);
+	benchResponse(256);
+	benchResponse(MAX_MESSAGE_LEN);
+	benchLookups(10000);
+	benchLookups(100000);
+	benchLookups(BENCH_CLIENTS);
+	benchPool();
+	benchQueue(16);
+	benchQueue(256);
+	benchLogging();
+	benchWire(64);
+	benchWire(MAX_MESSAGE_LEN);
+	benchRing(64);
+	benchRing(MAX_MESSAGE_LEN);
+	benchFanout(64);
+	benchFanout(MAX_MESSAGE_LEN);
+	if (results) {
+		fclose(results);
+	}
+	return 0;
+}
@@ -0,0 +1,254 @@
+// This is the mega comet resource sampler
+// It watches the workers and the manager during a load test, and prints a line of CSV every so often with how much
+// memory and CPU they're using, and how much memory the kernel's using for their sockets, so the memory each
+// connection costs can be tracked as the connections go up. Everything comes from /proc, so it's Linux only.
+// Usage: megasample [seconds between samples] [samples], eg ./megasample 10 360 > stats.csv for an hour
+// The connections are the box's TCP sockets in use (from /proc/net/sockstat), so run the test clients elsewhere
+// The last columns are the socket profile: what each connection costs in the processes (user), in socket buffers (TCP)
+// and in the kernel's own structures (slab, from how much SUnreclaim has grown since the first sample for each socket
+// that's been added), and from those, how many connections the box's memory would hold. Start it before the test.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
+
+// Constants
+#define MAX_PROCS 1024 // Most megacomet/megamanager processes it keeps track of
+#define DEFAULT_INTERVAL 10
+#define WORKER_NAME "megacomet"
+#define MANAGER_NAME "megamanager"
+
+// What we know about a process from one sample
+typedef struct procSample {
+	int pid;
+	int isManager;
+	long rssKb, anonKb; // From status
+	long privateKb, sharedKb, swapKb; // From smaps_rollup
+	unsigned long minorFaults, majorFaults, cpuTicks; // From stat, since it started
+} procSample;
+
+// All the processes added up
+typedef struct roleTotals {
+	int count;
+	long rssKb, anonKb, privateKb, sharedKb, swapKb;
+	unsigned long minorFaults, majorFaults; // Since the last sample
+	double cpu; // Percent of one core, since the last sample
+} roleTotals;
+
+// Globals
+procSample procs[MAX_PROCS], lastProcs[MAX_PROCS];
+int procCount = 0, lastProcCount = 0;
+long pageSize, ticksPerSecond;
+long firstSlabKb = -1, firstTcpInUse;
+
+// Read a whole (small) /proc file into buf. Returns its length, or -1
+int readProcFile(const char *path, char *buf, int size) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	int len = fread(buf, 1, size-1, f);
+	fclose(f);
+	buf[len] = 0;
+	return len;
+}
+
+// The number after 'name' in text like /proc's "Name:   123 kB", or 0 if it's not there
+long procField(const char *text, const char *name) {
+	const char *p = strstr(text, name);
+	return p ? atol(p + strlen(name)) : 0;
+}
+
+// Fill in a process's sample. Returns 0 if it's gone
+int sampleProc(procSample *s) {
+	char path[64], buf[4096];
+
+	snprintf(path, sizeof(path), "/proc/%d/status", s->pid);
+	if (readProcFile(path, buf, sizeof(buf)) < 0) {
+		return 0;
+	}
+	s->rssKb = procField(buf, "\nVmRSS:");
+	s->anonKb = procField(buf, "\nRssAnon:");
+
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", s->pid); // Needs 4.14 or later, otherwise these stay 0
+	if (readProcFile(path, buf, sizeof(buf)) >= 0) {
+		s->privateKb = procField(buf, "\nPrivate_Clean:") + procField(buf, "\nPrivate_Dirty:");
+		s->sharedKb = procField(buf, "\nShared_Clean:") + procField(buf, "\nShared_Dirty:");
+		s->swapKb = procField(buf, "\nSwap:");
+	}
+
+	// The fields after the command name, which is in brackets and could have spaces in it
+	snprintf(path, sizeof(path), "/proc/%d/stat", s->pid);
+	if (readProcFile(path, buf, sizeof(buf)) < 0) {
+		return 0;
+	}
+	char *p = strrchr(buf, ')');
+	unsigned long utime, stime;
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+			&s->minorFaults, &s->majorFaults, &utime, &stime) != 4) {
+		return 0;
+	}
+	s->cpuTicks = utime + stime;
+	return 1;
+}
+
+// Find all the workers and managers running, and sample them
+void sampleProcs() {
+	memcpy(lastProcs, procs, sizeof(procSample) * procCount);
+	lastProcCount = procCount;
+	procCount = 0;
+	DIR *dir = opendir("/proc");
+	if (!dir) {
+		perror("/proc");
+		exit(1);
+	}
+	struct dirent *d;
+	while ((d = readdir(dir)) && procCount < MAX_PROCS) {
+		if (!isdigit(d->d_name[0])) {
+			continue;
+		}
+		int pid = atoi(d->d_name);
+		char path[64], comm[32];
+		snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+		if (readProcFile(path, comm, sizeof(comm)) < 0) {
+			continue;
+		}
+		comm[strcspn(comm, "\n")] = 0;
+		if (strcmp(comm, WORKER_NAME) && strcmp(comm, MANAGER_NAME)) {
+			continue;
+		}
+		procSample *s = &procs[procCount];
+		memset(s, 0, sizeof(procSample));
+		s->pid = pid;
+		s->isManager = !strcmp(comm, MANAGER_NAME);
+		procCount += sampleProc(s);
+	}
+	closedir(dir);
+}
+
+// The last sample of a process, or NULL if it's new
+procSample *lastSampleOf(int pid) {
+	for (int i=0; i<lastProcCount; i++) {
+		if (lastProcs[i].pid == pid) {
+			return &lastProcs[i];
+		}
+	}
+	return NULL;
+}
+
+// Add up the workers (or the manager), with the faults and CPU since the last sample
+void addUp(roleTotals *t, int isManager, double seconds) {
+	memset(t, 0, sizeof(roleTotals));
+	for (int i=0; i<procCount; i++) {
+		procSample *s = &procs[i], *last = lastSampleOf(s->pid);
+		if (s->isManager != isManager) {
+			continue;
+		}
+		t->count++;
+		t->rssKb += s->rssKb;
+		t->anonKb += s->anonKb;
+		t->privateKb += s->privateKb;
+		t->sharedKb += s->sharedKb;
+		t->swapKb += s->swapKb;
+		if (last) { // A process that's started since the last sample has nothing to compare with, so it starts next time
+			t->minorFaults += s->minorFaults - last->minorFaults;
+			t->majorFaults += s->majorFaults - last->majorFaults;
+			t->cpu += (s->cpuTicks - last->cpuTicks) * 100.0 / ticksPerSecond / seconds;
+		}
+	}
+}
+
+void printRole(roleTotals *t) {
+	printf(",%d,%ld,%ld,%ld,%ld,%ld,%lu,%lu,%.1f", t->count, t->rssKb, t->anonKb, t->privateKb, t->sharedKb, t->swapKb,
+		t->minorFaults, t->majorFaults, t->cpu);
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **args) {
+	int interval = argc > 1 ? atoi(args[1]) : DEFAULT_INTERVAL;
+	long samples = argc > 2 ? atol(args[2]) : -1; // Forever
+	if (interval < 1) {
+		puts("Usage: megasample [seconds between samples] [samples]");
+		return 1;
+	}
+	pageSize = sysconf(_SC_PAGESIZE);
+	ticksPerSecond = sysconf(_SC_CLK_TCK);
+
+	puts("Time,Workers,Workers RSS (kB),Workers anon,Workers private,Workers shared,Workers swap,Workers minor faults,"
+		"Workers major faults,Workers CPU %,"
+		"Managers,Manager RSS (kB),Manager anon,Manager private,Manager shared,Manager swap,Manager minor faults,"
+		"Manager major faults,Manager CPU %,"
+		"TCP in use,TCP orphans,TCP time wait,TCP mem (pages),Slab unreclaimable (kB),Mem available (kB),"
+		"User bytes per conn,TCP bytes per conn,Slab bytes per conn,Conns in RAM");
+	fflush(stdout);
+
+	sampleProcs(); // So the first line has something to take the faults and CPU from
+	double lastTime = now();
+	for (long n=0; samples < 0 || n < samples; n++) {
+		sleep(interval);
+		sampleProcs();
+		double sampleTime = now(), seconds = sampleTime - lastTime;
+		lastTime = sampleTime;
+
+		roleTotals workers, managers;
+		addUp(&workers, 0, seconds);
+		addUp(&managers, 1, seconds);
+
+		// The kernel's socket memory, and what the box has left
+		char buf[4096];
+		long tcpInUse = 0, tcpOrphans = 0, tcpTimeWait = 0, tcpMemPages = 0, slabKb = 0, availableKb = 0, totalKb = 0;
+		if (readProcFile("/proc/net/sockstat", buf, sizeof(buf)) >= 0) {
+			char *tcp = strstr(buf, "\nTCP:");
+			if (tcp) {
+				tcpInUse = procField(tcp, " inuse ");
+				tcpOrphans = procField(tcp, " orphan ");
+				tcpTimeWait = procField(tcp, " tw ");
+				tcpMemPages = procField(tcp, " mem ");
+			}
+		}
+		if (readProcFile("/proc/meminfo", buf, sizeof(buf)) >= 0) {
+			slabKb = procField(buf, "\nSUnreclaim:");
+			availableKb = procField(buf, "\nMemAvailable:");
+			totalKb = procField(buf, "\nMemTotal:");
+		}
+		if (firstSlabKb < 0) {
+			firstSlabKb = slabKb;
+			firstTcpInUse = tcpInUse;
+		}
+
+		char timeText[32];
+		time_t wallTime = time(NULL);
+		strftime(timeText, sizeof(timeText), "%Y/%m/%d %H:%M:%S", localtime(&wallTime));
+		printf("%s", timeText);
+		printRole(&workers);
+		printRole(&managers);
+		printf(",%ld,%ld,%ld,%ld,%ld,%ld", tcpInUse, tcpOrphans, tcpTimeWait, tcpMemPages, slabKb, availableKb);
+		if (!tcpInUse) {
+			printf(",,,,\n");
+			fflush(stdout);
+			continue;
+		}
+		double userBytes = (workers.rssKb + managers.rssKb) * 1024.0 / tcpInUse, tcpBytes = tcpMemPages * (double)pageSize / tcpInUse;
+		printf(",%.0f,%.0f", userBytes, tcpBytes);
+		if (tcpInUse > firstTcpInUse) { // The slab's shared with everything else, so it's only a fair guess once there are a lot more
+			double slabBytes = (slabKb - firstSlabKb) * 1024.0 / (tcpInUse - firstTcpInUse);
+			if (slabBytes < 0) {
+				slabBytes = 0;
+			}
+			printf(",%.0f,%.0f\n", slabBytes, totalKb * 1024.0 / (userBytes + tcpBytes + slabBytes));
+		} else {
+			printf(",,\n");
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
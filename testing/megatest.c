@@ -1,93 +1,500 @@
 // This is the mega comet tester
-// It opens lots of client connections to a given target ip
+// It opens lots of client connections to a given target ip, and keeps them all polling like browsers would
+// The connections are spread over TEST_THREADS threads, each with its own libev loop, and are opened without blocking,
+// at a steady rate. They can come from a range of source addresses, as each one only has ~28k ephemeral ports to each
+// of the server's ports: on one box, 127.0.0.2 onwards all work without setting anything up.
+// Give it a message rate too and it plays the app as well, sending each message with the time it was sent, so it can
+// tell how long it took to arrive. Every STATS_SECONDS it prints the connect time, time to the first byte of each
+// response, and delivery time percentiles (the clocks need to agree if the server's another box).
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/resource.h>
 
 #include <ev.h>
 #include "../khash.h"
 #include "../config.h"
+#include "../megawire.h"
+#include "../megastats.h"
 
 // Constants
 #define TEST_CONNS 250000
+#define TEST_THREADS 4
+#define RAMP_RATE 10000 // Connections opened per second, at most
+#define RAMP_TICK 0.01 // How often each thread opens the next few
+#define RETRY_SECONDS 1 // How long a connection that failed waits before it's tried again
+#define STATS_SECONDS 5 // How often to print how the responses are going
+#define SEND_TICK 0.01 // How often the messages go to the manager, when it's sending them
+#define MIN_STAMP_DIGITS 13 // A run of at least this many digits in a response is the time a message was sent
 #define REQ_TEMPLATE "GET /%s.js HTTP/1.1\r\nHost: www.example.com\r\nUser-Agent: Some browser\r\nAccept: text/html\r\n\r\n"
 
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
 // Useful utilities
 typedef unsigned char byte;
 
+// Where a connection is up to
+#define CONNECTING 0
+#define WAITING 1 // Sent the poll, no response yet
+#define READING 2 // Part way through the response
+
+// A thread, with its share of the clients: clientNum % threads == number
+typedef struct testThread {
+	pthread_t thread;
+	struct ev_loop *loop;
+	int nextClient; // The next one to open for the first time
+	double rampBudget; // How many it can open now
+	int *retries, retryCount; // Clients whose connection failed, to try again
+	double lastRetry;
+	ev_timer rampTimer;
+	// Only the thread writes these, the main thread just reads them for the report
+	long open, connectErrors, readErrors, responses, emptyResponses, messages;
+	statsHistogram connectTime, firstByte, delivery;
+} testThread;
+
+// How each connection's response is going, indexed by fd. Responses are counted as they stream in, so it doesn't
+// need to keep them
+typedef struct testConn {
+	ev_io watcher; // In its thread's loop
+	testThread *thread;
+	int clientNum; // Which client it's polling for
+	byte state;
+	byte headerMatched; // How much of the "\r\n\r\n" at the end of the headers we've had, 4 = onto the body
+	byte lengthMatched, closeMatched; // How much of the Content-Length and Connection: close headers we've had
+	byte closing; // It said Connection: close
+	byte depth; // How many brackets deep we are in a BATCH_JSON body
+	byte inString, escaped, inItem; // Where we are in the BATCH_JSON body
+	byte stampDigits; // How long the run of digits we're in is
+	unsigned long stamp; // And what they are
+	int contentLength, bodyLeft;
+	int messages; // How many messages the body has had so far
+	double started; // When the connect, and then each poll, started
+} testConn;
+
 // Globals (i know, globals are yuck, but we're going for speed not beauty in this code...)
-// struct ev_loop *libEvLoop; // The main libev loop. Global so that we don't have to pass it around everywhere
-// ev_io conn[TEST_CONNS];
-int conns = 0;
-char httpRequest[1000];
+testConn *testConns;
+testThread *threads;
+int threadCount = TEST_THREADS, testConnCount = TEST_CONNS;
+double rampRate = RAMP_RATE, sendRate = 0;
+char *testPrefix, *testServerIp;
+struct in_addr firstSource; // The source addresses to spread the connections over, if they're given
+int sourceCount = 0;
+int appSd = -1; // The connection to the manager, when we're sending messages too
 
 int findWorker(char* clientIdStr) {
 	khint_t hash = kh_str_hash_func(clientIdStr); // Do a crypto hash on the client
-	int worker = hash % WORKERS; // Use the hash value to determine which worker they'll be on
+	return hash % WORKERS; // Use the hash value to determine which worker they'll be on
+}
+
+double nowSeconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Wall clock microseconds, which is what the messages are stamped with, so it works across boxes
+unsigned long wallMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
+void openClient(testThread *t, int clientNum);
+
+// Give up on a connection, and try the client again in a while
+void failClient(testConn *c, long *errors) {
+	testThread *t = c->thread;
+	ev_io_stop(t->loop, &c->watcher);
+	close(c->watcher.fd);
+	(*errors)++;
+	t->open--;
+	t->retries[t->retryCount++] = c->clientNum;
+}
+
+// Send the poll on an open connection
+void sendPoll(testConn *c) {
+	char clientIdStr[20], request[200];
+	snprintf(clientIdStr, 20, "%s%d", testPrefix, c->clientNum);
+	int len = snprintf(request, sizeof(request), REQ_TEMPLATE, clientIdStr);
+	memset((byte*)c + offsetof(testConn, state), 0, sizeof(testConn) - offsetof(testConn, state)); // Keep whose it is
+	c->state = WAITING;
+	c->started = nowSeconds();
+	if (write(c->watcher.fd, request, len) != len) { // It's a fresh (or just emptied) socket, so it'll all fit
+		failClient(c, &c->thread->readErrors);
+	}
+}
+
+// The end of a run of digits: if it's long enough it was a message's send time
+void endStamp(testConn *c) {
+	if (c->stampDigits >= MIN_STAMP_DIGITS) {
+		statsRecord(&c->thread->delivery, (double)wallMicros() - c->stamp);
+	}
+	c->stampDigits = 0;
+	c->stamp = 0;
+}
+
+// Count the messages in part of a response body, however the worker's BATCH_MODE frames them, and time any that
+// we sent
+void countMessages(testConn *c, const byte *p, int len) {
+	for (int i=0; i<len; i++) {
+		byte ch = p[i];
+		if (ch >= '0' && ch <= '9') {
+			c->stamp = c->stamp * 10 + ch - '0';
+			c->stampDigits += c->stampDigits < 255;
+		} else if (c->stampDigits) {
+			endStamp(c);
+		}
+		if (BATCH_MODE == BATCH_SINGLE) {
+			c->messages = 1;
+		} else if (BATCH_MODE == BATCH_LINES) {
+			c->messages += ch == '\n';
+		} else if (c->inString) { // Commas and brackets in strings don't count
+			if (c->escaped) c->escaped = 0;
+			else if (ch == '\\') c->escaped = 1;
+			else if (ch == '"') c->inString = 0;
+		} else if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n') {
+			if (c->depth == 1 && ch == ',') { // On to the next message in the array
+				c->inItem = 0;
+			} else if (c->depth == 1 && ch != ']' && !c->inItem) {
+				c->inItem = 1;
+				c->messages++;
+			}
+			if (ch == '"') c->inString = 1;
+			else if (ch == '[' || ch == '{') c->depth++;
+			else if (ch == ']' || ch == '}') c->depth--;
+		}
+	}
 }
 
-// Opens a single socket
-void openSocket(int worker, char* clientId, char* serverIp) {
-	// Open the socket file descriptor
-	int sock = socket(PF_INET, SOCK_STREAM, 0);
+// Go through the headers a byte at a time, as they may come in bits, picking out the length and whether it'll close.
+// Returns how many bytes of p they took
+int readHeaders(testConn *c, const byte *p, int len) {
+	static const char lengthHeader[] = "\nContent-Length: ", closeHeader[] = "\nConnection: close";
+	int i = 0;
+	for (; i<len && c->headerMatched<4; i++) {
+		byte ch = p[i];
+		c->headerMatched = ch == "\r\n\r\n"[c->headerMatched] ? c->headerMatched+1 : ch == '\r';
+		if (c->lengthMatched == sizeof(lengthHeader)-1 && ch >= '0' && ch <= '9') {
+			c->contentLength = c->contentLength * 10 + ch - '0';
+			continue;
+		}
+		c->lengthMatched = ch == lengthHeader[c->lengthMatched] ? c->lengthMatched+1 : ch == '\n';
+		if (c->closeMatched < sizeof(closeHeader)-1) {
+			c->closeMatched = ch == closeHeader[c->closeMatched] ? c->closeMatched+1 : ch == '\n';
+			c->closing |= c->closeMatched == sizeof(closeHeader)-1;
+		}
+	}
+	if (c->headerMatched == 4) {
+		c->bodyLeft = c->contentLength;
+	}
+	return i;
+}
+
+// A whole response has arrived: count it and poll again, on the same connection unless the worker's closing it
+void finishResponse(testConn *c) {
+	testThread *t = c->thread;
+	endStamp(c);
+	t->responses++;
+	t->messages += c->messages;
+	t->emptyResponses += !c->messages;
+	if (!c->closing) {
+		sendPoll(c);
+		return;
+	}
+	ev_io_stop(t->loop, &c->watcher);
+	close(c->watcher.fd);
+	t->open--;
+	openClient(t, c->clientNum);
+}
+
+// Read what's arrived of a response
+void readCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	testConn *c = (testConn*)watcher;
+	byte buffer[BUFFER_SIZE];
+	ssize_t len = read(watcher->fd, buffer, BUFFER_SIZE);
+	if (len < 0 && errno == EAGAIN) {
+		return;
+	}
+	if (len <= 0) {
+		if (len == 0 && c->state == WAITING) { // A kept-alive connection the worker was done with, so open another
+			testThread *t = c->thread;
+			ev_io_stop(loop, watcher);
+			close(watcher->fd);
+			t->open--;
+			openClient(t, c->clientNum);
+			return;
+		}
+		failClient(c, &c->thread->readErrors);
+		return;
+	}
+	if (c->state == WAITING) {
+		statsRecord(&c->thread->firstByte, (nowSeconds() - c->started) * 1e6);
+		c->state = READING;
+	}
+	int i = c->headerMatched < 4 ? readHeaders(c, buffer, len) : 0;
+	if (c->headerMatched < 4) {
+		return;
+	}
+	int body = len - i < c->bodyLeft ? len - i : c->bodyLeft;
+	countMessages(c, buffer+i, body);
+	c->bodyLeft -= body;
+	if (!c->bodyLeft) {
+		finishResponse(c);
+	}
+}
+
+// The connect's finished, one way or the other
+void connectCallback(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+	testConn *c = (testConn*)watcher;
+	int error = 0;
+	socklen_t errorLen = sizeof(error);
+	getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+	if (error) {
+		failClient(c, &c->thread->connectErrors);
+		return;
+	}
+	statsRecord(&c->thread->connectTime, (nowSeconds() - c->started) * 1e6);
+	ev_io_stop(loop, watcher);
+	ev_io_set(watcher, watcher->fd, EV_READ);
+	ev_set_cb(watcher, readCallback);
+	ev_io_start(loop, watcher);
+	sendPoll(c);
+}
+
+// Start opening a client's connection (again)
+void openClient(testThread *t, int clientNum) {
+	char clientIdStr[20];
+	snprintf(clientIdStr, 20, "%s%d", testPrefix, clientNum);
+	int sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (sock < 0) {
-		perror("Can't create a socket");
-		exit(1);
+		t->connectErrors++;
+		t->retries[t->retryCount++] = clientNum;
+		return;
+	}
+	t->open++;
+	testConn *c = &testConns[sock];
+	memset(c, 0, sizeof(testConn));
+	c->thread = t;
+	c->clientNum = clientNum;
+	c->started = nowSeconds();
+
+	if (sourceCount) { // Each source address has its own ports, so they go further
+		struct sockaddr_in source;
+		memset(&source, 0, sizeof(source));
+		source.sin_family = AF_INET;
+		source.sin_addr.s_addr = htonl(ntohl(firstSource.s_addr) + clientNum % sourceCount);
+		int on = 1;
+		setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on)); // Pick the port at connect, per destination
+		bind(sock, (struct sockaddr*) &source, sizeof(source));
 	}
 
 	// Build the address of the server
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(COMET_BASE_PORT_NO + worker);
-	inet_pton(AF_INET, serverIp, &addr.sin_addr.s_addr);
+	addr.sin_port = htons(SHARED_PORT ? COMET_BASE_PORT_NO : COMET_BASE_PORT_NO + findWorker(clientIdStr));
+	inet_pton(AF_INET, testServerIp, &addr.sin_addr.s_addr);
+
+	ev_io_init(&c->watcher, connectCallback, sock, EV_WRITE);
+	if (connect(sock, (struct sockaddr*) &addr, sizeof addr) < 0 && errno != EINPROGRESS) {
+		failClient(c, &t->connectErrors);
+		return;
+	}
+	ev_io_start(t->loop, &c->watcher);
+}
+
+// Open the next few connections, no faster than the ramp rate. Ones that failed go first, once they've waited
+void rampCallback(struct ev_loop *loop, struct ev_timer *timer, int revents) {
+	testThread *t = (testThread*)((char*)timer - offsetof(testThread, rampTimer));
+	t->rampBudget += rampRate * RAMP_TICK / threadCount;
+	if (t->rampBudget > rampRate / threadCount) {
+		t->rampBudget = rampRate / threadCount; // Don't save up more than a second's worth
+	}
+	if (t->retryCount && ev_now(loop) - t->lastRetry >= RETRY_SECONDS) {
+		t->lastRetry = ev_now(loop);
+		// Ones that fail again go back on the list, in the part we've been through
+		int retrying = t->retryCount, i = 0;
+		t->retryCount = 0;
+		for (; i<retrying && t->rampBudget >= 1; i++, t->rampBudget--) {
+			openClient(t, t->retries[i]);
+		}
+		for (; i<retrying; i++) { // And the ones there wasn't room for wait for the next go
+			t->retries[t->retryCount++] = t->retries[i];
+		}
+	}
+	for (; t->nextClient < testConnCount && t->rampBudget >= 1; t->nextClient += threadCount, t->rampBudget--) {
+		openClient(t, t->nextClient);
+	}
+}
+
+void *runThread(void *arg) {
+	testThread *t = arg;
+	ev_timer_init(&t->rampTimer, rampCallback, 0, RAMP_TICK);
+	ev_timer_start(t->loop, &t->rampTimer);
+	ev_run(t->loop, 0);
+	return NULL;
+}
 
-	// Connect to the manager
-	int connectResult = connect(sock, (struct sockaddr*) &addr, sizeof addr);
-	if (connectResult < 0) {
-		perror("Could not connect");
+// Play the app: send messages to random clients, stamped with when they're sent
+void sendCallback(struct ev_loop *loop, struct ev_timer *timer, int revents) {
+	static double budget;
+	static byte frames[MANAGER_BUFFER_SIZE];
+	budget += sendRate * SEND_TICK;
+	int len = 0;
+	for (; budget >= 1 && len + WIRE_HEADER + 40 < sizeof(frames); budget--) {
+		char clientIdStr[20], stamp[24];
+		int idLen = snprintf(clientIdStr, 20, "%s%d", testPrefix, (int)(drand48() * testConnCount));
+		int stampLen = snprintf(stamp, sizeof(stamp), "%lu", wallMicros());
+		len += wireFrame(frames + len, WIRE_MESSAGE, clientIdStr, idLen, stamp, stampLen);
+	}
+	if (len && write(appSd, frames, len) != len) {
+		perror("Lost the manager");
 		exit(1);
 	}
+}
 
-	// Now send an HTTP request header
-	snprintf(httpRequest,1000,REQ_TEMPLATE,clientId);
-	write(sock, httpRequest, strlen(httpRequest));
+// Connect to the manager as an app, to send messages through
+void connectApp() {
+	appSd = socket(PF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(MANAGER_PORT_NO);
+	inet_pton(AF_INET, testServerIp, &addr.sin_addr.s_addr);
+	byte hello[3] = { WIRE_HELLO, PROTOCOL_VERSION, WIRE_APP }, reply[2];
+	if (connect(appSd, (struct sockaddr*) &addr, sizeof addr) < 0 || write(appSd, hello, 3) != 3
+			|| read(appSd, reply, 2) != 2 || reply[1] < 2) { // Its hello back, with a version that has frames
+		perror("Could not connect to the manager with protocol version 2");
+		exit(1);
+	}
 }
 
-// Find 64k id's that all point to the specified worker
-void runTestsWithPrefix(char* prefix, char* serverIp) {
-	printf("Running tests against prefix %s\n", prefix);
-	int clientNum=0;
-	char clientIdStr[20];
-	for (clientNum=0; clientNum < TEST_CONNS; clientNum++) {
-		snprintf(clientIdStr, 20, "%s%d", prefix, clientNum);
-		int worker = findWorker(clientIdStr);
-		openSocket(worker, clientIdStr, serverIp);
-		if (!(clientNum%1000)) {
-			printf("%s\n", clientIdStr);
-		}
+void *runApp(void *arg) {
+	struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+	ev_timer sendTimer;
+	ev_timer_init(&sendTimer, sendCallback, SEND_TICK, SEND_TICK);
+	ev_timer_start(loop, &sendTimer);
+	ev_run(loop, 0);
+	return NULL;
+}
+
+void addHistogram(statsHistogram *into, statsHistogram *h) {
+	for (int b=0; b<STATS_BUCKETS; b++) {
+		into->counts[b] += h->counts[b];
 	}
-	printf ("Opened all\n");
+	into->count += h->count;
+	into->sum += h->sum;
+}
+
+void printHistogram(const char *name, statsHistogram *h) {
+	printf("  %-12s %8lu  p50 %8.2fms  p90 %8.2fms  p99 %8.2fms  p99.9 %8.2fms\n", name, h->count,
+		statsQuantile(h, 0.5) / 1000, statsQuantile(h, 0.9) / 1000, statsQuantile(h, 0.99) / 1000, statsQuantile(h, 0.999) / 1000);
+}
+
+// Add up the threads' numbers and print them. They're read while the threads carry on, so they can be a little behind
+void report() {
+	long open = 0, connectErrors = 0, readErrors = 0, responses = 0, emptyResponses = 0, messages = 0;
+	static statsHistogram connectTime, firstByte, delivery;
+	memset(&connectTime, 0, sizeof(statsHistogram));
+	memset(&firstByte, 0, sizeof(statsHistogram));
+	memset(&delivery, 0, sizeof(statsHistogram));
+	for (int i=0; i<threadCount; i++) {
+		testThread *t = &threads[i];
+		open += t->open;
+		connectErrors += t->connectErrors;
+		readErrors += t->readErrors;
+		responses += t->responses;
+		emptyResponses += t->emptyResponses;
+		messages += t->messages;
+		addHistogram(&connectTime, &t->connectTime);
+		addHistogram(&firstByte, &t->firstByte);
+		addHistogram(&delivery, &t->delivery);
+	}
+	// Messages per connection is how many each poll brings in, which is what batching is for
+	printf("%ld open, %ld connect errors, %ld read errors, %ld responses, %ld empty, %ld messages, %.2f messages per response\n",
+		open, connectErrors, readErrors, responses, emptyResponses, messages, responses ? (double)messages / responses : 0);
+	printHistogram("connect", &connectTime);
+	printHistogram("first byte", &firstByte);
+	printHistogram("delivery", &delivery);
+	fflush(stdout);
+}
+
+void usage() {
+	puts("MegaComet Tester");
+	puts("Usage: megatest [-c connections] [-t threads] [-r connections per second] [-s first source ip] [-n source ips]");
+	puts("                [-m messages per second] X Y");
+	puts("Where X is the prefix for the client ids: (eg A-D)");
+	puts("And Y is the IP address of the comet server: (eg 1.2.3.4)");
+	printf("Creates %d connections by default, from %d threads\n", TEST_CONNS, TEST_THREADS);
+	puts("-s and -n spread them over n source addresses from s up, eg -s 127.0.0.2 -n 32 when testing on one box");
+	puts("-m sends that many messages a second through the manager (on Y too) to random clients, for the delivery times");
 }
 
 int main(int argc, char **args) {
-	if (argc<3) {
-		puts("MegaComet Tester");
-		puts("Usage: megatest X Y");
-		puts("Where X is the prefix for the client ids: (eg A-D)");
-		puts("And Y is the IP address of the comet server: (eg 1.2.3.4)");
-		printf("Creates %d connections\n", TEST_CONNS);
+	int opt;
+	while ((opt = getopt(argc, args, "c:t:r:s:n:m:")) != -1) {
+		switch (opt) {
+			case 'c': testConnCount = atoi(optarg); break;
+			case 't': threadCount = atoi(optarg); break;
+			case 'r': rampRate = atof(optarg); break;
+			case 's': inet_pton(AF_INET, optarg, &firstSource); break;
+			case 'n': sourceCount = atoi(optarg); break;
+			case 'm': sendRate = atof(optarg); break;
+			default: usage(); return 1;
+		}
+	}
+	if (argc - optind < 2 || threadCount < 1 || testConnCount < 1 || rampRate <= 0) {
+		usage();
 		return 1;
 	}
-	runTestsWithPrefix(args[1], args[2]);
-	
-	printf("Press enter to quit");
-	char temp[10];
-	fgets(temp,10,stdin);
+	if (sourceCount && !firstSource.s_addr) {
+		puts("-n needs -s");
+		return 1;
+	}
+	testPrefix = args[optind];
+	testServerIp = args[optind+1];
+
+	// As many connections as we're allowed
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	if (limit.rlim_cur < testConnCount + 100) {
+		printf("Only %ld files can be open, raise the limit (ulimit -n) for %d connections\n", (long)limit.rlim_cur, testConnCount);
+	}
+	testConns = calloc(limit.rlim_cur, sizeof(testConn));
 
+	printf("Opening %d connections with prefix %s, %.0f a second, from %d threads\n", testConnCount, testPrefix, rampRate, threadCount);
+	threads = calloc(threadCount, sizeof(testThread));
+	for (int i=0; i<threadCount; i++) {
+		testThread *t = &threads[i];
+		t->nextClient = i;
+		t->loop = ev_loop_new(EVFLAG_AUTO);
+		t->retries = malloc(sizeof(int) * (testConnCount / threadCount + 1));
+		pthread_create(&t->thread, NULL, runThread, t);
+	}
+	if (sendRate > 0) {
+		connectApp();
+		pthread_t appThread;
+		pthread_create(&appThread, NULL, runApp, NULL);
+	}
+
+	printf("Press enter to quit\n");
+	struct pollfd input = { .fd = 0, .events = POLLIN };
+	while (poll(&input, 1, STATS_SECONDS * 1000) == 0) {
+		report();
+	}
+	report();
 	return 0;
 }